@@ -0,0 +1,679 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include "alloc.h"
+#include "../error.h"
+
+/**
+ * @file alloc.c
+ * @brief An implementation of the free block index.
+ *
+ * Blocks are tracked in a bitmap with one bit per block (set means in use),
+ * plus a summary bitmap with one bit per bitmap word (set means the word is full).
+ * Allocation is next-fit from a hint just past the last allocated block,
+ * so filling a volume costs amortized O(1) per block instead of a scan from the start.
+ * When the block being extended is known the search starts right after it instead,
+ * which keeps files that grow at the same time from interleaving their chains.
+ *
+ * A second bitmap tracks allocated blocks which have never been written and so still hold
+ * whatever a previous file left there. They read as zeroes until written or zeroed in bulk.
+ *
+ * Blocks which become free are also remembered until their host storage is given back,
+ * so that deleting a file shrinks the image on the host.
+ *
+ * Each block also has a count of the FAT entries linking to it. It is more than one
+ * where cloned files share the rest of a chain.
+ *
+ * Blocks a snapshot still holds are pinned: they stay in use even once the live
+ * filesystem frees them, so their data is never reused or given back to the host.
+ *
+ * Blocks taken and freed by the current operation are logged, so that an operation which
+ * fails part way can put them back as they were.
+ */
+
+/**
+ * @brief Number of bits in a bitmap word.
+ */
+#define WORD_BITS 64
+
+/**
+ * @brief A block the current operation took, see `changes`.
+ */
+#define CHANGE_TAKEN 0
+
+/**
+ * @brief A block the current operation freed, see `changes`.
+ */
+#define CHANGE_FREED 1
+
+/**
+ * @brief A block the current operation freed which was still unwritten, see `changes`.
+ */
+#define CHANGE_FREED_UNWRITTEN 2
+
+/**
+ * @brief Bitmap of blocks in use, bit `b` for FAT block `b`.
+ */
+static uint64_t* used;
+
+/**
+ * @brief Bitmap of full words in `used`.
+ */
+static uint64_t* full;
+
+/**
+ * @brief Number of words in `used`.
+ */
+static int words;
+
+/**
+ * @brief Highest block number tracked.
+ */
+static int last;
+
+/**
+ * @brief Number of free blocks.
+ */
+static int free_count;
+
+/**
+ * @brief Word of `used` where the next search starts.
+ */
+static int hint;
+
+/**
+ * @brief Bitmap of allocated blocks not yet written or zeroed, bit `b` for FAT block `b`.
+ */
+static uint64_t* unwritten = NULL;
+
+/**
+ * @brief Number of set bits in `unwritten`.
+ */
+static int unwritten_count = 0;
+
+/**
+ * @brief Blocks freed by uncommitted operations, not yet available for allocation.
+ */
+static int* deferred = NULL;
+
+/**
+ * @brief Number of blocks in `deferred`.
+ */
+static int deferred_count = 0;
+
+/**
+ * @brief Capacity of `deferred`.
+ */
+static int deferred_cap = 0;
+
+/**
+ * @brief Blocks freed since the last `alloc_release_freed`.
+ */
+static int* released = NULL;
+
+/**
+ * @brief Number of blocks in `released`.
+ */
+static int released_count = 0;
+
+/**
+ * @brief Capacity of `released`.
+ */
+static int released_cap = 0;
+
+/**
+ * @brief Blocks taken and freed since `alloc_begin_op`, each a `CHANGE_` kind followed by the block.
+ */
+static int* changes = NULL;
+
+/**
+ * @brief Number of ints in `changes`.
+ */
+static int change_count = 0;
+
+/**
+ * @brief Capacity of `changes`.
+ */
+static int change_cap = 0;
+
+/**
+ * @brief Number of blocks in `deferred` when the current operation began.
+ */
+static int deferred_mark = 0;
+
+/**
+ * @brief Number of FAT entries linking to each block, indexed by FAT block number.
+ */
+static uint16_t* refs = NULL;
+
+/**
+ * @brief Number of blocks with more than one FAT entry linking to them.
+ */
+static int shared_count = 0;
+
+/**
+ * @brief Bitmap of blocks held by snapshots, bit `b` for FAT block `b`.
+ */
+static uint64_t* pinned = NULL;
+
+/**
+ * @brief Number of set bits in `pinned`.
+ */
+static int pinned_count = 0;
+
+/**
+ * @brief Append `block` to a growable list of blocks.
+ *
+ * @param list The list, reallocated as needed.
+ * @param count Number of blocks in the list.
+ * @param cap Capacity of the list.
+ * @param block The block to append.
+ */
+static void push_block(int** list, int* count, int* cap, int block) {
+    if (*count == *cap) {
+        *cap = *cap ? 2 * *cap : 64;
+        *list = (int*) realloc(*list, *cap * sizeof(int));
+        if (*list == NULL) {
+            cur_errno = ERR_PERM;
+            p_perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*list)[(*count)++] = block;
+}
+
+/**
+ * @brief Set bit `b` in the bitmap and keep the summary up to date.
+ *
+ * @param b The block to mark used.
+ */
+static void set_used(int b) {
+    used[b / WORD_BITS] |= 1ULL << (b % WORD_BITS);
+    if (used[b / WORD_BITS] == ~0ULL) {
+        full[b / WORD_BITS / WORD_BITS] |= 1ULL << (b / WORD_BITS % WORD_BITS);
+    }
+}
+
+/**
+ * @brief Clear bit `b` in the bitmap and the summary.
+ *
+ * @param b The block to mark free.
+ */
+static void clear_used(int b) {
+    used[b / WORD_BITS] &= ~(1ULL << (b % WORD_BITS));
+    full[b / WORD_BITS / WORD_BITS] &= ~(1ULL << (b / WORD_BITS % WORD_BITS));
+}
+
+/**
+ * @brief Log that the current operation changed `block`, see `alloc_abort_op`.
+ *
+ * @param kind One of the `CHANGE_` kinds.
+ * @param block The FAT block number.
+ */
+static void log_change(int kind, int block) {
+    push_block(&changes, &change_count, &change_cap, kind);
+    push_block(&changes, &change_count, &change_cap, block);
+}
+
+/**
+ * @brief Start tracking blocks 1 to `new_data_blocks`, all of them free.
+ *
+ * Block 0 and anything past the last block are permanently in use.
+ * Callers then mark the blocks already in the FAT with `alloc_mark_used`.
+ *
+ * @param new_data_blocks Number of data blocks.
+ */
+void alloc_init(int new_data_blocks) {
+    alloc_close();
+    last = new_data_blocks;
+    words = (last + WORD_BITS) / WORD_BITS;
+    int full_words = (words + WORD_BITS - 1) / WORD_BITS;
+    used = (uint64_t*) calloc(words, sizeof(uint64_t));
+    full = (uint64_t*) calloc(full_words, sizeof(uint64_t));
+    unwritten = (uint64_t*) calloc(words, sizeof(uint64_t));
+    refs = (uint16_t*) calloc(last + 1, sizeof(uint16_t));
+    pinned = (uint64_t*) calloc(words, sizeof(uint64_t));
+    if (used == NULL || full == NULL || unwritten == NULL || refs == NULL || pinned == NULL) {
+        cur_errno = ERR_PERM;
+        p_perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    set_used(0);
+    for (int b = last + 1; b < words * WORD_BITS; b++) {
+        set_used(b);
+    }
+    free_count = last;
+    hint = 0;
+}
+
+/**
+ * @brief Stop tracking blocks and release the bitmaps.
+ */
+void alloc_close() {
+    free(used);
+    free(full);
+    free(unwritten);
+    free(refs);
+    free(pinned);
+    free(deferred);
+    free(released);
+    free(changes);
+    used = NULL;
+    full = NULL;
+    unwritten = NULL;
+    unwritten_count = 0;
+    refs = NULL;
+    shared_count = 0;
+    pinned = NULL;
+    pinned_count = 0;
+    deferred = NULL;
+    deferred_count = 0;
+    deferred_cap = 0;
+    released = NULL;
+    released_count = 0;
+    released_cap = 0;
+    changes = NULL;
+    change_count = 0;
+    change_cap = 0;
+    deferred_mark = 0;
+    words = 0;
+    free_count = 0;
+}
+
+/**
+ * @brief Record that `block` is in use.
+ *
+ * @param block The FAT block number.
+ */
+void alloc_mark_used(int block) {
+    if (used[block / WORD_BITS] & (1ULL << (block % WORD_BITS))) { return; }
+    set_used(block);
+    free_count--;
+}
+
+/**
+ * @brief Record that `block` is free again.
+ *
+ * The block is remembered for `alloc_release_freed`.
+ * A pinned block stays in use until it is unpinned.
+ *
+ * @param block The FAT block number.
+ */
+void alloc_mark_free(int block) {
+    bool was_unwritten = alloc_unwritten(block);
+    alloc_mark_written(block);
+    if (alloc_pinned(block)) { return; }
+    if (!(used[block / WORD_BITS] & (1ULL << (block % WORD_BITS)))) { return; }
+    log_change(was_unwritten ? CHANGE_FREED_UNWRITTEN : CHANGE_FREED, block);
+    clear_used(block);
+    free_count++;
+    push_block(&released, &released_count, &released_cap, block);
+}
+
+/**
+ * @brief Record that `block` was allocated without being zeroed.
+ *
+ * @param block The FAT block number.
+ */
+void alloc_mark_unwritten(int block) {
+    if (alloc_unwritten(block)) { return; }
+    unwritten[block / WORD_BITS] |= 1ULL << (block % WORD_BITS);
+    unwritten_count++;
+}
+
+/**
+ * @brief Record that `block` no longer holds stale data.
+ *
+ * @param block The FAT block number.
+ */
+void alloc_mark_written(int block) {
+    if (!alloc_unwritten(block)) { return; }
+    unwritten[block / WORD_BITS] &= ~(1ULL << (block % WORD_BITS));
+    unwritten_count--;
+}
+
+/**
+ * @brief Does `block` still hold stale data which should read as zeroes?
+ *
+ * @return True if the block was allocated without being zeroed and hasn't been written since.
+ * @param block The FAT block number.
+ */
+bool alloc_unwritten(int block) {
+    if (unwritten_count == 0 || block >= words * WORD_BITS) { return false; }
+    return (unwritten[block / WORD_BITS] >> (block % WORD_BITS)) & 1;
+}
+
+/**
+ * @brief Record a new FAT entry linking to `block`.
+ *
+ * Callers must keep the count within `ALLOC_MAX_REFS`.
+ *
+ * @param block The FAT block number, ignored if out of range.
+ */
+void alloc_ref(int block) {
+    if (block <= 0 || block > last) { return; }
+    if (++refs[block] == 2) { shared_count++; }
+}
+
+/**
+ * @brief Record that a FAT entry no longer links to `block`.
+ *
+ * @param block The FAT block number, ignored if out of range.
+ */
+void alloc_unref(int block) {
+    if (block <= 0 || block > last || refs[block] == 0) { return; }
+    if (refs[block]-- == 2) { shared_count--; }
+}
+
+/**
+ * @brief Get the number of FAT entries linking to `block`.
+ *
+ * @return 0 for the first block of a chain, 1 for the rest, more for a block where chains join.
+ * @param block The FAT block number.
+ */
+int alloc_refs(int block) {
+    if (block <= 0 || block > last) { return 0; }
+    return refs[block];
+}
+
+/**
+ * @brief Do any chains share blocks?
+ *
+ * @return True if some block has more than one FAT entry linking to it.
+ */
+bool alloc_shared() {
+    return shared_count > 0;
+}
+
+/**
+ * @brief Record that a snapshot holds `block`, which is marked in use.
+ *
+ * @param block The FAT block number.
+ */
+void alloc_pin(int block) {
+    if (alloc_pinned(block)) { return; }
+    pinned[block / WORD_BITS] |= 1ULL << (block % WORD_BITS);
+    pinned_count++;
+    alloc_mark_used(block);
+}
+
+/**
+ * @brief Unpin every block.
+ *
+ * Blocks stay in use, callers free the ones the live filesystem no longer uses.
+ */
+void alloc_unpin_all() {
+    memset(pinned, 0, words * sizeof(uint64_t));
+    pinned_count = 0;
+}
+
+/**
+ * @brief Is `block` held by a snapshot?
+ *
+ * @return True if the block is pinned.
+ * @param block The FAT block number.
+ */
+bool alloc_pinned(int block) {
+    if (pinned_count == 0 || block <= 0 || block > last) { return false; }
+    return (pinned[block / WORD_BITS] >> (block % WORD_BITS)) & 1;
+}
+
+/**
+ * @brief Are any blocks pinned?
+ *
+ * @return True if some block is held by a snapshot.
+ */
+bool alloc_any_pinned() {
+    return pinned_count > 0;
+}
+
+/**
+ * @brief Call `zero` on each run of consecutive unwritten blocks and mark them all written.
+ *
+ * @param zero Called with the first block and length of each run.
+ */
+void alloc_zero_unwritten(void (*zero)(int block, int count)) {
+    for (int w = 0; w < words && unwritten_count > 0; w++) {
+        while (unwritten[w]) {
+            int b = w * WORD_BITS + __builtin_ctzll(unwritten[w]);
+            int count = 0;
+            while (alloc_unwritten(b + count)) {
+                alloc_mark_written(b + count);
+                count++;
+            }
+            zero(b, count);
+        }
+    }
+}
+
+/**
+ * @brief Record that `block` will be free once the operation freeing it is committed.
+ *
+ * Until then the block keeps its old contents so the uncommitted operation can be lost in a crash
+ * without another file's data landing in a block the old metadata still points to.
+ *
+ * @param block The FAT block number.
+ */
+void alloc_defer_free(int block) {
+    push_block(&deferred, &deferred_count, &deferred_cap, block);
+}
+
+/**
+ * @brief Free every block passed to `alloc_defer_free` since the last call.
+ */
+void alloc_commit_frees() {
+    for (int i = 0; i < deferred_count; i++) {
+        alloc_mark_free(deferred[i]);
+    }
+    deferred_count = 0;
+    deferred_mark = 0;
+}
+
+/**
+ * @brief Mark the start of an operation, whose changes `alloc_abort_op` undoes if it fails.
+ */
+void alloc_begin_op() {
+    change_count = 0;
+    deferred_mark = deferred_count;
+}
+
+/**
+ * @brief Undo every block taken or freed since `alloc_begin_op`, latest first.
+ *
+ * Blocks taken become free again, and are given back to the host with the rest at
+ * `alloc_release_freed`. Blocks freed are in use again, unwritten if they were before.
+ * Frees deferred since then are forgotten. Counts of links are left to the FAT's owner.
+ *
+ * @param taken Called with each block taken, which is free once it returns.
+ */
+void alloc_abort_op(void (*taken)(int block)) {
+    for (int i = change_count - 2; i >= 0; i -= 2) {
+        int block = changes[i + 1];
+        if (changes[i] == CHANGE_TAKEN) {
+            alloc_mark_written(block);
+            clear_used(block);
+            free_count++;
+            push_block(&released, &released_count, &released_cap, block);
+            taken(block);
+        } else {
+            set_used(block);
+            free_count--;
+            if (changes[i] == CHANGE_FREED_UNWRITTEN) { alloc_mark_unwritten(block); }
+        }
+    }
+    change_count = 0;
+    deferred_count = deferred_mark;
+}
+
+/**
+ * @brief Find a word of `used` with a free bit, searching forward from word `start`.
+ *
+ * Whole runs of full words are skipped using the summary bitmap.
+ *
+ * @return The index of the word or -1 if there is none at or after `start`.
+ * @param start The first word to consider.
+ */
+static int find_word(int start) {
+    int w = start;
+    while (w < words) {
+        uint64_t avail = ~full[w / WORD_BITS] & (~0ULL << (w % WORD_BITS));
+        if (avail != 0) {
+            w = w / WORD_BITS * WORD_BITS + __builtin_ctzll(avail);
+            return w < words ? w : -1;
+        }
+        w = (w / WORD_BITS + 1) * WORD_BITS;
+    }
+    return -1;
+}
+
+/**
+ * @brief Is block `b` in use?
+ *
+ * @return True if `b` is allocated or out of range.
+ * @param b The block number.
+ */
+static bool is_used(int b) {
+    if (b < 0 || b >= words * WORD_BITS) { return true; }
+    return (used[b / WORD_BITS] >> (b % WORD_BITS)) & 1;
+}
+
+/**
+ * @brief Find the first free block at or after `b`.
+ *
+ * @return The block or -1 if all blocks from `b` on are in use.
+ * @param b The first block to consider.
+ */
+static int next_free(int b) {
+    if (b >= words * WORD_BITS) { return -1; }
+    uint64_t avail = ~used[b / WORD_BITS] & (~0ULL << (b % WORD_BITS));
+    if (avail != 0) { return b / WORD_BITS * WORD_BITS + __builtin_ctzll(avail); }
+    int w = find_word(b / WORD_BITS + 1);
+    if (w == -1) { return -1; }
+    return w * WORD_BITS + __builtin_ctzll(~used[w]);
+}
+
+/**
+ * @brief Find the first used block at or after `b`.
+ *
+ * @return The block, or one past the last tracked block if none is used.
+ * @param b The first block to consider.
+ */
+static int next_used(int b) {
+    int w = b / WORD_BITS;
+    uint64_t taken = used[w] & (~0ULL << (b % WORD_BITS));
+    while (taken == 0) {
+        if (++w == words) { return words * WORD_BITS; }
+        taken = used[w];
+    }
+    return w * WORD_BITS + __builtin_ctzll(taken);
+}
+
+/**
+ * @brief Pick a free block near `near` and mark it used.
+ *
+ * Prefers `near + 1` so that a growing file stays physically contiguous,
+ * then the closest free block after `near`, wrapping around once.
+ * If `near` is 0 searches forward from just past the previous allocation instead.
+ *
+ * @return The allocated block or 0 if there are no free blocks.
+ * @param near The block the new block will follow, or 0 if there is none.
+ */
+int alloc_block(int near) {
+    if (free_count == 0) { return 0; }
+    int b;
+    if (near != 0 && !is_used(near + 1)) {
+        b = near + 1;
+    } else {
+        b = next_free(near != 0 ? near + 1 : hint * WORD_BITS);
+        if (b == -1) { b = next_free(0); }
+    }
+    set_used(b);
+    free_count--;
+    hint = b / WORD_BITS;
+    log_change(CHANGE_TAKEN, b);
+    return b;
+}
+
+/**
+ * @brief Reserve `count` physically contiguous free blocks after `near`.
+ *
+ * The first run of at least `count` free blocks following `near`
+ * (or the previous allocation if `near` is 0) is taken, wrapping around once.
+ *
+ * @return The first block of the run or 0 if there is no such run.
+ * @param near The block the run will follow, or 0 if there is none.
+ * @param count Number of blocks in the run.
+ */
+int alloc_run(int near, int count) {
+    if (count <= 0 || count > free_count) { return 0; }
+    int origin = near != 0 ? near + 1 : hint * WORD_BITS;
+    int b = origin;
+    bool wrapped = false;
+    while (true) {
+        int start = next_free(b);
+        if (start == -1 || (wrapped && start >= origin)) {
+            if (wrapped) { return 0; }
+            wrapped = true;
+            b = 0;
+            continue;
+        }
+        int end = next_used(start);
+        if (end - start >= count) {
+            for (int i = start; i < start + count; i++) {
+                set_used(i);
+                log_change(CHANGE_TAKEN, i);
+            }
+            free_count -= count;
+            hint = (start + count - 1) / WORD_BITS;
+            return start;
+        }
+        b = end;
+    }
+}
+
+/**
+ * @brief Order blocks for qsort.
+ *
+ * @return Negative, zero or positive as `a` is before, equal to or after `b`.
+ * @param a The first block.
+ * @param b The second block.
+ */
+static int compare_blocks(const void* a, const void* b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+/**
+ * @brief Call `release` on each run of consecutive blocks freed since the last call.
+ *
+ * Blocks which have been allocated again in the meantime are left out.
+ *
+ * @param release Called with the first block and length of each run.
+ */
+void alloc_release_freed(void (*release)(int block, int count)) {
+    qsort(released, released_count, sizeof(int), compare_blocks);
+    int i = 0;
+    while (i < released_count) {
+        int b = released[i++];
+        if (is_used(b)) { continue; }
+        // Extend over consecutive blocks still free, skipping blocks freed more than once
+        int count = 1;
+        while (i < released_count && (released[i] == b + count - 1 ||
+            (released[i] == b + count && !is_used(b + count)))) {
+            if (released[i] == b + count) { count++; }
+            i++;
+        }
+        release(b, count);
+    }
+    released_count = 0;
+}
+
+/**
+ * @brief Get the number of free blocks.
+ *
+ * @return The number of free data blocks.
+ */
+int alloc_free_count() {
+    return free_count;
+}
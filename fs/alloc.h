@@ -0,0 +1,65 @@
+#ifndef ALLOC
+#define ALLOC
+#include <stdbool.h>
+
+/**
+ * @file alloc.h
+ * @brief An in-memory index of free data blocks.
+ */
+
+/**
+ * @brief Most FAT entries which may link to a single block.
+ */
+#define ALLOC_MAX_REFS 0xFFFF
+
+// Documentation in alloc.c
+
+void alloc_init(int new_data_blocks);
+
+void alloc_close();
+
+void alloc_mark_used(int block);
+
+void alloc_mark_free(int block);
+
+void alloc_mark_unwritten(int block);
+
+void alloc_mark_written(int block);
+
+bool alloc_unwritten(int block);
+
+void alloc_ref(int block);
+
+void alloc_unref(int block);
+
+int alloc_refs(int block);
+
+bool alloc_shared();
+
+void alloc_pin(int block);
+
+void alloc_unpin_all();
+
+bool alloc_pinned(int block);
+
+bool alloc_any_pinned();
+
+void alloc_zero_unwritten(void (*zero)(int block, int count));
+
+void alloc_defer_free(int block);
+
+void alloc_commit_frees();
+
+void alloc_begin_op();
+
+void alloc_abort_op(void (*taken)(int block));
+
+void alloc_release_freed(void (*release)(int block, int count));
+
+int alloc_block(int near);
+
+int alloc_run(int near, int count);
+
+int alloc_free_count();
+
+#endif
@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "arena.h"
+#include "../error.h"
+
+/**
+ * @file arena.c
+ * @brief An implementation of scratch arenas.
+ *
+ * An arena hands out memory by bumping an offset, first in space the caller provides
+ * (normally on its stack) and then in chunks from malloc, which are only freed when the
+ * arena is reset past them or released. Most calls need less than the initial space
+ * and never reach malloc.
+ *
+ * A mark remembers how far the arena was used, so that a loop can reset to it after
+ * each round and keep reusing the same memory.
+ */
+
+/**
+ * @brief Smallest chunk obtained from malloc, so that many small temporaries share one.
+ */
+#define ARENA_CHUNK 4096
+
+/**
+ * @brief Start an arena in `size` bytes at `space`.
+ *
+ * @return The arena.
+ * @param space Memory aligned for any type, which must outlive the arena.
+ * @param size Bytes at `space`.
+ * @param owner Name of the function the arena belongs to.
+ */
+Arena arena_start(void* space, size_t size, const char* owner) {
+    return (Arena) { (uint8_t*) space, 0, size, NULL, (uint8_t*) space, size, 0, 0, owner };
+}
+
+/**
+ * @brief Allocate `size` bytes aligned for any type.
+ *
+ * The memory stays valid until the arena is reset to a mark taken before it, or released.
+ *
+ * @return Pointer to the memory.
+ * @param arena The arena to allocate from.
+ * @param size Bytes wanted.
+ */
+void* arena_alloc(Arena* arena, size_t size) {
+    size_t align = sizeof(max_align_t);
+    size = (size + align - 1) / align * align;
+    if (size > arena->size - arena->used) {
+        size_t bytes = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        ArenaChunk* chunk = (ArenaChunk*) malloc(sizeof(ArenaChunk) + bytes);
+        if (chunk == NULL) {
+            cur_errno = ERR_PERM;
+            p_perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        chunk->prev = arena->chunks;
+        chunk->size = bytes;
+        arena->chunks = chunk;
+        arena->base = (uint8_t*) chunk->data;
+        arena->used = 0;
+        arena->size = bytes;
+    }
+    void* ptr = arena->base + arena->used;
+    arena->used += size;
+    arena->bytes += size;
+    if (arena->bytes > arena->peak) { arena->peak = arena->bytes; }
+    return ptr;
+}
+
+/**
+ * @brief Remember how far `arena` is used.
+ *
+ * @return A mark to pass to `arena_reset`.
+ * @param arena The arena.
+ */
+ArenaMark arena_mark(Arena* arena) {
+    return (ArenaMark) { arena->chunks, arena->used, arena->bytes };
+}
+
+/**
+ * @brief Free everything allocated from `arena` since `mark` was taken.
+ *
+ * Chunks obtained since are freed, so that memory is only kept for as long as it is used.
+ *
+ * @param arena The arena.
+ * @param mark A mark of this arena, not taken before an earlier reset to a mark taken before it.
+ */
+void arena_reset(Arena* arena, ArenaMark mark) {
+    while (arena->chunks != mark.chunk) {
+        ArenaChunk* prev = arena->chunks->prev;
+        free(arena->chunks);
+        arena->chunks = prev;
+    }
+    if (mark.chunk == NULL) {
+        arena->base = arena->space;
+        arena->size = arena->space_size;
+    } else {
+        arena->base = (uint8_t*) mark.chunk->data;
+        arena->size = mark.chunk->size;
+    }
+    arena->used = mark.used;
+    arena->bytes = mark.bytes;
+}
+
+/**
+ * @brief Free everything allocated from `arena`.
+ *
+ * With `ARENA_DEBUG` defined also prints the most the arena held at once.
+ *
+ * @param arena The arena.
+ */
+void arena_release(Arena* arena) {
+#ifdef ARENA_DEBUG
+    fprintf(stderr, "%s: peak scratch %zu bytes\n", arena->owner, arena->peak);
+#endif
+    arena_reset(arena, (ArenaMark) { NULL, 0, 0 });
+}
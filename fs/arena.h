@@ -0,0 +1,116 @@
+#ifndef ARENA
+#define ARENA
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @file arena.h
+ * @brief Scratch memory for temporaries which live no longer than the call that needs them.
+ */
+
+/**
+ * @brief Bytes of scratch kept on the stack by `SCRATCH`, enough for a few paths.
+ */
+#define SCRATCH_BYTES 1024
+
+/**
+ * @brief A block of scratch memory obtained from malloc once the stack space runs out.
+ */
+typedef struct arena_chunk {
+    /**
+    * @brief The chunk obtained before this one, or NULL.
+    */
+    struct arena_chunk* prev;
+    /**
+    * @brief Bytes in `data`.
+    */
+    size_t size;
+    /**
+    * @brief The chunk's memory.
+    */
+    max_align_t data[];
+} ArenaChunk;
+
+/**
+ * @brief A bump allocator, everything in it being released at once or back to a mark.
+ */
+typedef struct arena {
+    /**
+    * @brief Memory currently allocated from.
+    */
+    uint8_t* base;
+    /**
+    * @brief Bytes of `base` in use.
+    */
+    size_t used;
+    /**
+    * @brief Bytes in `base`.
+    */
+    size_t size;
+    /**
+    * @brief The chunk `base` belongs to, or NULL while still in the initial space.
+    */
+    ArenaChunk* chunks;
+    /**
+    * @brief The initial space.
+    */
+    uint8_t* space;
+    /**
+    * @brief Bytes in the initial space.
+    */
+    size_t space_size;
+    /**
+    * @brief Bytes handed out and not yet reset, counting alignment.
+    */
+    size_t bytes;
+    /**
+    * @brief Most `bytes` has been.
+    */
+    size_t peak;
+    /**
+    * @brief Name of the function the arena belongs to, for `ARENA_DEBUG`.
+    */
+    const char* owner;
+} Arena;
+
+/**
+ * @brief A point in an arena to go back to, see `arena_mark`.
+ */
+typedef struct arena_mark {
+    /**
+    * @brief The chunk in use, or NULL for the initial space.
+    */
+    ArenaChunk* chunk;
+    /**
+    * @brief Bytes of it in use.
+    */
+    size_t used;
+    /**
+    * @brief The arena's `bytes`.
+    */
+    size_t bytes;
+} ArenaMark;
+
+/**
+ * @brief Declare an arena `name` starting out in `SCRATCH_BYTES` of stack, released when it goes out of scope.
+ *
+ * Every call gets its own, so neither threads nor PennOS processes switched on one thread share scratch.
+ * Build with `-DARENA_DEBUG` to have each arena print its peak use when released.
+ */
+#define SCRATCH(name) \
+    max_align_t name##_space[SCRATCH_BYTES / sizeof(max_align_t)]; \
+    Arena name __attribute__((cleanup(arena_release))) = arena_start(name##_space, sizeof(name##_space), __func__)
+
+// Documentation in arena.c
+
+Arena arena_start(void* space, size_t size, const char* owner);
+
+void* arena_alloc(Arena* arena, size_t size);
+
+ArenaMark arena_mark(Arena* arena);
+
+void arena_reset(Arena* arena, ArenaMark mark);
+
+void arena_release(Arena* arena);
+
+#endif
@@ -0,0 +1,728 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include "cache.h"
+#include "../error.h"
+
+/**
+ * @file cache.c
+ * @brief An implementation of the block cache.
+ *
+ * Blocks are keyed by their FAT block number and kept in a hash table for lookup
+ * and a doubly linked list for LRU ordering. The cache is write-through: every write
+ * reaches the host file immediately so durability is unaffected, but reads of
+ * cached blocks never touch the host.
+ *
+ * Transfers spanning several physically consecutive blocks are done with one vectored
+ * host call per run of uncached blocks. Whole blocks in such a run go straight between
+ * the host and the caller's buffer without being cached, so streaming a large file
+ * doesn't flush the cache, while partial blocks at either end are read in full and cached.
+ *
+ * Blocks expected to be read soon can be prefetched, again with one vectored call per run.
+ * Prefetched blocks are tagged until first read so the readahead counters can tell whether
+ * they were worth fetching.
+ *
+ * Range transfers can join an I/O batch instead of happening immediately. A block being
+ * read into the cache by a batch is pinned until the batch is finished: it is never evicted,
+ * and anyone else using it first waits for the batch's reads.
+ *
+ * The cache may be used by several host threads at once. Its lists and counters are guarded
+ * by a mutex, which is never held during host I/O or while copying out: a block being read
+ * into a slot is pinned first, and a thread other than the one loading it reads the host itself
+ * rather than wait. Cached blocks are marked as being copied out of, which also stops their
+ * eviction but doesn't stop other threads reading them.
+ * Writes must not run alongside anything else, which the filesystem's own lock ensures, so
+ * cached blocks can't change under a reader.
+ */
+
+/**
+ * @brief A cached block.
+ */
+typedef struct cache_slot {
+    /**
+    * @brief FAT block number held in this slot.
+    */
+    int block;
+    /**
+    * @brief Contents of the block, `block_size` bytes.
+    */
+    uint8_t* data;
+    /**
+    * @brief More recently used neighbour in the LRU list.
+    */
+    struct cache_slot* prev;
+    /**
+    * @brief Less recently used neighbour in the LRU list.
+    */
+    struct cache_slot* next;
+    /**
+    * @brief Next slot in the same hash bucket or in the free list.
+    */
+    struct cache_slot* chain;
+    /**
+    * @brief Was the block prefetched and not yet read?
+    */
+    bool prefetched;
+    /**
+    * @brief Number of unfinished batches or reads copying out of this slot, which can't be evicted while nonzero.
+    */
+    atomic_int pins;
+    /**
+    * @brief Number of reads copying out of this slot with `cache_lock` released, which can't be evicted while nonzero.
+    */
+    atomic_int copying;
+    /**
+    * @brief The batch reading the block into this slot, or NULL if read without one. Valid while `pins` is nonzero.
+    */
+    IoBatch* loading;
+    /**
+    * @brief The thread reading the block into this slot, valid while `pins` is nonzero.
+    */
+    pthread_t loader;
+} CacheSlot;
+
+/**
+ * @brief Maximum number of blocks read by one preadv in `cache_prefetch`.
+ */
+#define PREFETCH_IOV 64
+
+/**
+ * @brief Maximum number of cached blocks `cache_read_range` copies out per release of `cache_lock`.
+ */
+#define RANGE_HITS 16
+
+/**
+ * @brief Host file descriptor blocks are read from and written to.
+ */
+static int cache_fd;
+
+/**
+ * @brief Host offset of block zero, so that block `b` lives at `cache_base + b * cache_block_size`.
+ */
+static off_t cache_base;
+
+/**
+ * @brief Block size in bytes.
+ */
+static int cache_block_size;
+
+/**
+ * @brief All slots, allocated once per capacity.
+ */
+static CacheSlot* slots;
+
+/**
+ * @brief Backing memory for every slot's data.
+ */
+static uint8_t* pool;
+
+/**
+ * @brief Hash buckets, a power of two in number.
+ */
+static CacheSlot** buckets;
+
+/**
+ * @brief Number of hash buckets minus one.
+ */
+static int bucket_mask;
+
+/**
+ * @brief Most recently used slot.
+ */
+static CacheSlot* lru_head;
+
+/**
+ * @brief Least recently used slot, the next to be evicted.
+ */
+static CacheSlot* lru_tail;
+
+/**
+ * @brief Slots not currently holding a block.
+ */
+static CacheSlot* free_slots;
+
+/**
+ * @brief Running counters and configured capacity.
+ */
+static CacheStats stats;
+
+/**
+ * @brief Held while the slots, lists and counters are touched.
+ *
+ * Only taken through `lock_cache`, so that PennOS can't switch processes while it is held.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Block every signal, saving the old mask in `old`, and take `cache_lock`.
+ *
+ * @param old Where to save the old signal mask.
+ */
+static void lock_cache(sigset_t* old) {
+    io_block_signals(old);
+    pthread_mutex_lock(&cache_lock);
+}
+
+/**
+ * @brief Release `cache_lock` and restore the signal mask saved by `lock_cache`.
+ *
+ * @param old The saved signal mask.
+ */
+static void unlock_cache(sigset_t* old) {
+    pthread_mutex_unlock(&cache_lock);
+    io_restore_signals(old);
+}
+
+/**
+ * @brief Remove `slot` from the LRU list.
+ *
+ * @param slot The slot to unlink.
+ */
+static void lru_unlink(CacheSlot* slot) {
+    if (slot->prev) { slot->prev->next = slot->next; } else { lru_head = slot->next; }
+    if (slot->next) { slot->next->prev = slot->prev; } else { lru_tail = slot->prev; }
+    slot->prev = NULL;
+    slot->next = NULL;
+}
+
+/**
+ * @brief Insert `slot` at the most recently used end of the LRU list.
+ *
+ * @param slot The slot to insert.
+ */
+static void lru_push(CacheSlot* slot) {
+    slot->prev = NULL;
+    slot->next = lru_head;
+    if (lru_head) { lru_head->prev = slot; } else { lru_tail = slot; }
+    lru_head = slot;
+}
+
+/**
+ * @brief Find the slot holding `block`.
+ *
+ * @return The slot or NULL if the block is not cached.
+ * @param block The FAT block number.
+ */
+static CacheSlot* lookup(int block) {
+    if (stats.capacity == 0) { return NULL; }
+    CacheSlot* slot = buckets[block & bucket_mask];
+    while (slot && slot->block != block) {
+        slot = slot->chain;
+    }
+    return slot;
+}
+
+/**
+ * @brief Remove `slot` from its hash bucket.
+ *
+ * @param slot The slot to remove.
+ */
+static void unhash(CacheSlot* slot) {
+    CacheSlot** link = &buckets[slot->block & bucket_mask];
+    while (*link != slot) {
+        link = &(*link)->chain;
+    }
+    *link = slot->chain;
+    slot->chain = NULL;
+}
+
+/**
+ * @brief Get a slot for `block`, evicting the least recently used unpinned block if full.
+ *
+ * The returned slot is hashed and at the front of the LRU list but its data is stale.
+ *
+ * @return A slot now keyed by `block`, or NULL if every slot is pinned.
+ * @param block The FAT block number.
+ */
+static CacheSlot* take_slot(int block) {
+    CacheSlot* slot = free_slots;
+    if (slot) {
+        free_slots = slot->chain;
+    } else {
+        slot = lru_tail;
+        while (slot && (atomic_load(&slot->pins) > 0 || atomic_load(&slot->copying) > 0)) {
+            slot = slot->prev;
+        }
+        if (slot == NULL) { return NULL; }
+        lru_unlink(slot);
+        // Invalidated while pinned, so no longer hashed
+        if (slot->block != -1) { unhash(slot); }
+        stats.evictions++;
+    }
+    slot->block = block;
+    slot->prefetched = false;
+    slot->chain = buckets[block & bucket_mask];
+    buckets[block & bucket_mask] = slot;
+    lru_push(slot);
+    return slot;
+}
+
+/**
+ * @brief Pin `slot` while the calling thread reads its block into it.
+ *
+ * @param slot The slot.
+ * @param batch The batch doing the read, or NULL.
+ */
+static void pin_slot(CacheSlot* slot, IoBatch* batch) {
+    atomic_fetch_add(&slot->pins, 1);
+    slot->loading = batch;
+    slot->loader = pthread_self();
+}
+
+/**
+ * @brief Wait until any batch of the calling thread still reading into `slot` is done.
+ *
+ * @return False if another thread is still reading the block in, so the slot can't be used yet.
+ * @param slot The slot.
+ */
+static bool settle_slot(CacheSlot* slot) {
+    if (atomic_load(&slot->pins) == 0) { return true; }
+    if (!pthread_equal(slot->loader, pthread_self())) { return false; }
+    if (slot->loading) { io_wait(slot->loading); }
+    return true;
+}
+
+/**
+ * @brief Find the slot holding `block`, if its contents can be used now.
+ *
+ * @return The slot or NULL if the block is not cached or is being read in by another thread.
+ * @param block The FAT block number.
+ */
+static CacheSlot* lookup_settled(int block) {
+    CacheSlot* slot = lookup(block);
+    return slot && settle_slot(slot) ? slot : NULL;
+}
+
+/**
+ * @brief Move `slot` to the front of the LRU list after a read hit, counting readahead hits.
+ *
+ * The slot must be settled.
+ *
+ * @param slot The slot which was read.
+ */
+static void touch(CacheSlot* slot) {
+    stats.hits++;
+    if (slot->prefetched) {
+        stats.readahead_hits++;
+        slot->prefetched = false;
+    }
+    lru_unlink(slot);
+    lru_push(slot);
+}
+
+/**
+ * @brief Read `size` bytes at `offset` in `block` directly from the host.
+ *
+ * Bytes past the end of the host file read as zeroes.
+ *
+ * @param block The FAT block number.
+ * @param offset Offset within the block.
+ * @param buf Buffer to read into.
+ * @param size Number of bytes to read.
+ */
+static void host_read(int block, int offset, uint8_t* buf, int size) {
+    int n = pread(cache_fd, buf, size, cache_base + (off_t) block * cache_block_size + offset);
+    if (n == -1) {
+        cur_errno = ERR_PERM;
+        p_perror("pread");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf + n, 0, size - n);
+}
+
+/**
+ * @brief Write `size` bytes at `offset` in `block` directly to the host.
+ *
+ * @param batch The batch to join, or NULL to write now.
+ * @param block The FAT block number.
+ * @param offset Offset within the block.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
+ * @param copy Copy `buf` rather than require it to outlive the batch?
+ */
+static void host_write(IoBatch* batch, int block, int offset, uint8_t* buf, int size, bool copy) {
+    io_write(batch, cache_fd, cache_base + (off_t) block * cache_block_size + offset, buf, size, copy);
+}
+
+/**
+ * @brief Allocate slots, data and buckets for `capacity` blocks.
+ *
+ * @param capacity Maximum number of cached blocks, 0 disables caching.
+ */
+static void cache_alloc(int capacity) {
+    stats.capacity = capacity;
+    lru_head = NULL;
+    lru_tail = NULL;
+    free_slots = NULL;
+    if (capacity == 0) { return; }
+    int nbuckets = 1;
+    while (nbuckets < 2 * capacity) { nbuckets <<= 1; }
+    bucket_mask = nbuckets - 1;
+    buckets = (CacheSlot**) calloc(nbuckets, sizeof(CacheSlot*));
+    slots = (CacheSlot*) calloc(capacity, sizeof(CacheSlot));
+    pool = (uint8_t*) malloc((size_t) capacity * cache_block_size);
+    if (buckets == NULL || slots == NULL || pool == NULL) {
+        cur_errno = ERR_PERM;
+        p_perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = capacity - 1; i >= 0; i--) {
+        slots[i].block = -1;
+        slots[i].data = pool + (size_t) i * cache_block_size;
+        slots[i].chain = free_slots;
+        free_slots = &slots[i];
+    }
+}
+
+/**
+ * @brief Release all memory held by the cache.
+ */
+static void cache_release() {
+    free(buckets);
+    free(slots);
+    free(pool);
+    buckets = NULL;
+    slots = NULL;
+    pool = NULL;
+}
+
+/**
+ * @brief Set up an empty cache over the host file `fd`.
+ *
+ * Block `b` lives at host offset `base + b * new_block_size`.
+ * Counters are reset.
+ *
+ * @param fd Host file descriptor of the filesystem.
+ * @param base Host offset of (the nonexistent) block zero.
+ * @param new_block_size Block size in bytes.
+ * @param capacity Maximum number of cached blocks, 0 disables caching.
+ */
+void cache_init(int fd, off_t base, int new_block_size, int capacity) {
+    sigset_t old;
+    lock_cache(&old);
+    cache_fd = fd;
+    cache_base = base;
+    cache_block_size = new_block_size;
+    stats = (CacheStats) { 0, 0, 0, 0, 0, 0 };
+    cache_alloc(capacity);
+    unlock_cache(&old);
+}
+
+/**
+ * @brief Drop every cached block and release the cache's memory.
+ *
+ * Nothing needs flushing since the cache is write-through.
+ */
+void cache_close() {
+    sigset_t old;
+    lock_cache(&old);
+    cache_release();
+    cache_alloc(0);
+    unlock_cache(&old);
+}
+
+/**
+ * @brief Change the maximum number of cached blocks.
+ *
+ * All currently cached blocks are dropped. Counters are kept.
+ *
+ * @param capacity Maximum number of cached blocks, 0 disables caching.
+ */
+void cache_resize(int capacity) {
+    sigset_t old;
+    lock_cache(&old);
+    cache_release();
+    cache_alloc(capacity);
+    unlock_cache(&old);
+}
+
+/**
+ * @brief Read `size` bytes at `offset` within `block`.
+ *
+ * The range must not cross a block boundary.
+ * On a miss the whole block is read from the host and cached.
+ * A block another thread is still reading in is read from the host without the cache.
+ *
+ * @param block The FAT block number.
+ * @param offset Offset within the block.
+ * @param buf Buffer to read into.
+ * @param size Number of bytes to read.
+ */
+void cache_read(int block, int offset, uint8_t* buf, int size) {
+    sigset_t old;
+    lock_cache(&old);
+    CacheSlot* slot = lookup(block);
+    if (slot && settle_slot(slot)) {
+        touch(slot);
+        atomic_fetch_add(&slot->copying, 1);
+        unlock_cache(&old);
+        memcpy(buf, slot->data + offset, size);
+        atomic_fetch_sub(&slot->copying, 1);
+        return;
+    }
+    stats.misses++;
+    if (slot == NULL && stats.capacity > 0) {
+        slot = take_slot(block);
+        if (slot) { pin_slot(slot, NULL); }
+    } else {
+        slot = NULL;
+    }
+    unlock_cache(&old);
+    if (slot == NULL) {
+        host_read(block, offset, buf, size);
+        return;
+    }
+    host_read(block, 0, slot->data, cache_block_size);
+    memcpy(buf, slot->data + offset, size);
+    atomic_fetch_sub(&slot->pins, 1);
+}
+
+/**
+ * @brief Write `size` bytes at `offset` within `block`.
+ *
+ * The range must not cross a block boundary.
+ * The host is always written. A cached copy is updated in place,
+ * and an uncached block is only cached if it is written in full.
+ * `buf` may be reused as soon as this returns, even if the write joins a batch.
+ *
+ * @param batch The batch to join, or NULL to write now.
+ * @param block The FAT block number.
+ * @param offset Offset within the block.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
+ */
+void cache_write(IoBatch* batch, int block, int offset, uint8_t* buf, int size) {
+    host_write(batch, block, offset, buf, size, true);
+    sigset_t old;
+    lock_cache(&old);
+    CacheSlot* slot = lookup(block);
+    if (slot == NULL) {
+        if (stats.capacity == 0 || offset != 0 || size != cache_block_size) {
+            unlock_cache(&old);
+            return;
+        }
+        slot = take_slot(block);
+    } else {
+        settle_slot(slot);
+        lru_unlink(slot);
+        lru_push(slot);
+    }
+    if (slot) { memcpy(slot->data + offset, buf, size); }
+    unlock_cache(&old);
+}
+
+/**
+ * @brief Read `size` bytes at `offset` within `block`, continuing into `block + 1` and so on.
+ *
+ * The range may cross block boundaries but must lie in physically consecutive blocks.
+ * Cached blocks are copied from memory once `cache_lock` is released. Each run of uncached blocks costs one preadv:
+ * whole blocks are read directly into `buf`, and a partially requested block at either end
+ * of the range is read in full into the cache.
+ * If the reads join a batch `buf` is only filled once the batch is finished.
+ * Blocks another thread is still reading in are read from the host as if uncached.
+ *
+ * @param batch The batch to join, or NULL to read now.
+ * @param block The FAT block number of the first block.
+ * @param offset Offset within the first block.
+ * @param buf Buffer to read into.
+ * @param size Number of bytes to read.
+ */
+void cache_read_range(IoBatch* batch, int block, int offset, uint8_t* buf, int size) {
+    sigset_t old;
+    lock_cache(&old);
+    while (size > 0) {
+        // Mark a run of cached blocks as being copied out of, then copy them unlocked
+        CacheSlot* hit[RANGE_HITS];
+        uint8_t* hit_buf[RANGE_HITS];
+        int hit_offset[RANGE_HITS];
+        int hit_size[RANGE_HITS];
+        int hits = 0;
+        int n;
+        CacheSlot* slot;
+        while (size > 0 && hits < RANGE_HITS && (slot = lookup_settled(block)) != NULL) {
+            n = size < cache_block_size - offset ? size : cache_block_size - offset;
+            touch(slot);
+            atomic_fetch_add(&slot->copying, 1);
+            hit[hits] = slot;
+            hit_buf[hits] = buf;
+            hit_offset[hits] = offset;
+            hit_size[hits++] = n;
+            buf += n;
+            size -= n;
+            block++;
+            offset = 0;
+        }
+        if (hits > 0) {
+            unlock_cache(&old);
+            for (int i = 0; i < hits; i++) {
+                memcpy(hit_buf[i], hit[i]->data + hit_offset[i], hit_size[i]);
+                atomic_fetch_sub(&hit[i]->copying, 1);
+            }
+            lock_cache(&old);
+            continue;
+        }
+        // Gather the run of uncached blocks starting here: at most a partial block,
+        // a stretch of whole blocks and another partial block
+        struct iovec iov[3];
+        int count = 0;
+        off_t at = cache_base + (off_t) block * cache_block_size + offset;
+        CacheSlot* partial[2];
+        uint8_t* partial_buf[2];
+        int partial_offset[2];
+        int partial_size[2];
+        int partials = 0;
+        do {
+            n = size < cache_block_size - offset ? size : cache_block_size - offset;
+            stats.misses++;
+            // Partial blocks are read whole into the cache if a slot is free of pins
+            slot = n < cache_block_size && stats.capacity > 0 && lookup(block) == NULL ? take_slot(block) : NULL;
+            if (slot) {
+                pin_slot(slot, batch);
+                if (count == 0) { at -= offset; }
+                iov[count++] = (struct iovec) { slot->data, cache_block_size };
+                partial[partials] = slot;
+                partial_buf[partials] = buf;
+                partial_offset[partials] = offset;
+                partial_size[partials++] = n;
+            } else if (count > 0 && (uint8_t*) iov[count - 1].iov_base + iov[count - 1].iov_len == buf) {
+                iov[count - 1].iov_len += n;
+            } else {
+                iov[count++] = (struct iovec) { buf, n };
+            }
+            buf += n;
+            size -= n;
+            block++;
+            offset = 0;
+        } while (size > 0 && lookup_settled(block) == NULL);
+        // The partial slots are pinned, so nothing else can touch them while unlocked
+        unlock_cache(&old);
+        io_read(batch, cache_fd, at, iov, count);
+        for (int i = 0; i < partials; i++) {
+            io_copy(batch, partial_buf[i], partial[i]->data + partial_offset[i], partial_size[i], &partial[i]->pins);
+        }
+        lock_cache(&old);
+    }
+    unlock_cache(&old);
+}
+
+/**
+ * @brief Write `size` bytes at `offset` within `block`, continuing into `block + 1` and so on.
+ *
+ * The range may cross block boundaries but must lie in physically consecutive blocks.
+ * The host is written with a single pwrite. Cached copies of the blocks are updated,
+ * but blocks not already cached are left uncached.
+ * If the write joins a batch `buf` must stay valid until the batch is finished.
+ *
+ * @param batch The batch to join, or NULL to write now.
+ * @param block The FAT block number of the first block.
+ * @param offset Offset within the first block.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
+ */
+void cache_write_range(IoBatch* batch, int block, int offset, uint8_t* buf, int size) {
+    if (size <= 0) { return; }
+    host_write(batch, block, offset, buf, size, false);
+    sigset_t old;
+    lock_cache(&old);
+    while (size > 0 && stats.capacity > 0) {
+        int n = size < cache_block_size - offset ? size : cache_block_size - offset;
+        CacheSlot* slot = lookup(block);
+        if (slot) {
+            settle_slot(slot);
+            memcpy(slot->data + offset, buf, n);
+        }
+        buf += n;
+        size -= n;
+        block++;
+        offset = 0;
+    }
+    unlock_cache(&old);
+}
+
+/**
+ * @brief Read blocks `block` to `block + count - 1` into the cache ahead of their use.
+ *
+ * The blocks must be physically consecutive. Blocks already cached are skipped,
+ * and each run of the rest is read with one preadv. At most half the cache is used
+ * so that a prefetch never evicts its own blocks, and prefetching stops early if
+ * every other slot is pinned.
+ *
+ * @param block The FAT block number of the first block.
+ * @param count Number of blocks.
+ */
+void cache_prefetch(int block, int count) {
+    sigset_t old;
+    lock_cache(&old);
+    if (count > stats.capacity / 2) { count = stats.capacity / 2; }
+    struct iovec iov[PREFETCH_IOV];
+    while (count > 0) {
+        if (lookup(block)) {
+            block++;
+            count--;
+            continue;
+        }
+        off_t at = cache_base + (off_t) block * cache_block_size;
+        CacheSlot* taken[PREFETCH_IOV];
+        int n = 0;
+        while (n < count && n < PREFETCH_IOV && lookup(block + n) == NULL) {
+            CacheSlot* slot = take_slot(block + n);
+            if (slot == NULL) { break; }
+            slot->prefetched = true;
+            pin_slot(slot, NULL);
+            taken[n] = slot;
+            iov[n++] = (struct iovec) { slot->data, cache_block_size };
+        }
+        if (n == 0) { break; }
+        unlock_cache(&old);
+        io_read(NULL, cache_fd, at, iov, n);
+        for (int i = 0; i < n; i++) {
+            atomic_fetch_sub(&taken[i]->pins, 1);
+        }
+        lock_cache(&old);
+        stats.readahead += n;
+        block += n;
+        count -= n;
+    }
+    unlock_cache(&old);
+}
+
+/**
+ * @brief Forget any cached copy of `block`.
+ *
+ * @param block The FAT block number.
+ */
+void cache_invalidate(int block) {
+    sigset_t old;
+    lock_cache(&old);
+    CacheSlot* slot = lookup(block);
+    if (slot != NULL) {
+        unhash(slot);
+        slot->block = -1;
+        // A pinned slot stays in the LRU list until everyone is done copying out of it
+        if (atomic_load(&slot->pins) == 0 && atomic_load(&slot->copying) == 0) {
+            lru_unlink(slot);
+            slot->chain = free_slots;
+            free_slots = slot;
+        }
+    }
+    unlock_cache(&old);
+}
+
+/**
+ * @brief Get the cache's counters and capacity.
+ *
+ * @return A copy of the current counters.
+ */
+CacheStats cache_stats() {
+    sigset_t old;
+    lock_cache(&old);
+    CacheStats copy = stats;
+    unlock_cache(&old);
+    return copy;
+}
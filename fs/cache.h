@@ -0,0 +1,69 @@
+#ifndef CACHE
+#define CACHE
+#include <stdint.h>
+#include <sys/types.h>
+#include "io.h"
+
+/**
+ * @file cache.h
+ * @brief An LRU cache of filesystem blocks sitting between the filesystem and the host file.
+ */
+
+/**
+ * @brief Number of blocks cached when no capacity is given at mount time.
+ */
+#define DEFAULT_CACHE_BLOCKS 256
+
+/**
+ * @brief Counters describing how well the block cache is doing.
+ */
+typedef struct cache_stats {
+    /**
+    * @brief Number of block lookups served from memory.
+    */
+    long hits;
+    /**
+    * @brief Number of block lookups which had to go to the host file.
+    */
+    long misses;
+    /**
+    * @brief Number of blocks dropped to make room for others.
+    */
+    long evictions;
+    /**
+    * @brief Maximum number of blocks held in memory.
+    */
+    int capacity;
+    /**
+    * @brief Number of blocks read by `cache_prefetch`.
+    */
+    long readahead;
+    /**
+    * @brief Number of prefetched blocks which were read before being evicted.
+    */
+    long readahead_hits;
+} CacheStats;
+
+// Documentation in cache.c
+
+void cache_init(int fd, off_t base, int new_block_size, int capacity);
+
+void cache_close();
+
+void cache_resize(int capacity);
+
+void cache_read(int block, int offset, uint8_t* buf, int size);
+
+void cache_write(IoBatch* batch, int block, int offset, uint8_t* buf, int size);
+
+void cache_read_range(IoBatch* batch, int block, int offset, uint8_t* buf, int size);
+
+void cache_write_range(IoBatch* batch, int block, int offset, uint8_t* buf, int size);
+
+void cache_prefetch(int block, int count);
+
+void cache_invalidate(int block);
+
+CacheStats cache_stats();
+
+#endif
@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "crc.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/**
+ * @file crc.c
+ * @brief An implementation of CRC32C.
+ *
+ * On x86-64 processors with SSE4.2 the `crc32` instruction does 8 bytes at a time.
+ * Elsewhere a portable slicing-by-8 version looks up 8 tables per 8 bytes instead.
+ * Which one is used is decided once, on the first call from any thread.
+ */
+
+/**
+ * @brief The CRC32C polynomial, bit reversed.
+ */
+#define CRC_POLY 0x82F63B78
+
+/**
+ * @brief Lookup tables for the portable version, `table[k][b]` being the CRC of byte `b` followed by `k` zero bytes.
+ */
+static uint32_t table[8][256];
+
+/**
+ * @brief Makes sure the choice of implementation is made exactly once.
+ */
+static pthread_once_t ready = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Is the SSE4.2 version used?
+ */
+static bool hardware = false;
+
+/**
+ * @brief Work done so far, added to atomically.
+ */
+static CrcStats stats = { 0, 0 };
+
+/**
+ * @brief Fill `table` for the portable version.
+ */
+static void build_table() {
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; i++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+        }
+        table[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+        }
+    }
+}
+
+/**
+ * @brief Portable CRC32C of `size` bytes from `buf`, continuing from `crc`.
+ *
+ * @return The updated CRC, before the final inversion.
+ * @param crc The CRC so far.
+ * @param buf Bytes to add.
+ * @param size Number of bytes.
+ */
+static uint32_t crc_portable(uint32_t crc, const uint8_t* buf, size_t size) {
+    for (; size >= 8; size -= 8, buf += 8) {
+        // Assembled byte by byte so that the order is right whatever the host's endianness
+        uint32_t lo = (buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t) buf[3] << 24) ^ crc;
+        uint32_t hi = buf[4] | buf[5] << 8 | buf[6] << 16 | (uint32_t) buf[7] << 24;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24]
+            ^ table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+    }
+    for (; size > 0; size--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *buf++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief CRC32C of `size` bytes from `buf` using SSE4.2, continuing from `crc`.
+ *
+ * @return The updated CRC, before the final inversion.
+ * @param crc The CRC so far.
+ * @param buf Bytes to add.
+ * @param size Number of bytes.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc_hardware(uint32_t crc, const uint8_t* buf, size_t size) {
+    uint64_t c = crc;
+    for (; size >= 8; size -= 8, buf += 8) {
+        uint64_t v;
+        memcpy(&v, buf, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    for (; size > 0; size--) {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * @brief Pick the implementation to use.
+ */
+static void crc_init() {
+#if defined(__x86_64__)
+    hardware = __builtin_cpu_supports("sse4.2");
+#endif
+    if (!hardware) { build_table(); }
+}
+
+/**
+ * @brief Compute the CRC32C of `size` bytes from `buf`.
+ *
+ * @return The checksum.
+ * @param buf Bytes to checksum.
+ * @param size Number of bytes.
+ */
+uint32_t crc32c(const uint8_t* buf, size_t size) {
+    pthread_once(&ready, crc_init);
+    struct timespec t0;
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint32_t crc;
+#if defined(__x86_64__)
+    crc = hardware ? crc_hardware(0xFFFFFFFF, buf, size) : crc_portable(0xFFFFFFFF, buf, size);
+#else
+    crc = crc_portable(0xFFFFFFFF, buf, size);
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    __atomic_fetch_add(&stats.bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.ns, (t1.tv_sec - t0.tv_sec) * 1000000000L + t1.tv_nsec - t0.tv_nsec, __ATOMIC_RELAXED);
+    return ~crc;
+}
+
+/**
+ * @brief Get the name of the implementation in use.
+ *
+ * @return "sse4.2" or "portable".
+ */
+const char* crc32c_impl_name() {
+    pthread_once(&ready, crc_init);
+    return hardware ? "sse4.2" : "portable";
+}
+
+/**
+ * @brief Get the checksum counters.
+ *
+ * @return The work done and time taken so far.
+ */
+CrcStats crc_stats() {
+    return (CrcStats) { __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED), __atomic_load_n(&stats.ns, __ATOMIC_RELAXED) };
+}
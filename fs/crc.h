@@ -0,0 +1,33 @@
+#ifndef CRC
+#define CRC
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @file crc.h
+ * @brief CRC32C (Castagnoli) checksums, used to catch corrupted blocks.
+ */
+
+/**
+ * @brief Counters describing how much has been checksummed and how long it took.
+ */
+typedef struct crc_stats {
+    /**
+    * @brief Number of bytes checksummed.
+    */
+    long bytes;
+    /**
+    * @brief Time spent checksumming in nanoseconds.
+    */
+    long ns;
+} CrcStats;
+
+// Documentation in crc.c
+
+uint32_t crc32c(const uint8_t* buf, size_t size);
+
+const char* crc32c_impl_name();
+
+CrcStats crc_stats();
+
+#endif
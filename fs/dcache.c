@@ -0,0 +1,378 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include "dcache.h"
+#include "io.h"
+
+/**
+ * @file dcache.c
+ * @brief An implementation of the directory entry cache.
+ *
+ * Entries are keyed by the first block of the directory containing them and their name,
+ * so resolving a path costs one hash lookup per component. Each entry is also hashed by
+ * its position in fs_fd so that writes to a directory slot can keep the cache coherent
+ * without knowing which directory or name the slot belonged to.
+ * Only entries that were found are cached; misses always go to the directory.
+ *
+ * Changes are made under a mutex, while lookups take no lock at all. The name table is read
+ * under a sequence count instead: a writer makes it odd before touching the table and even
+ * again afterwards, and a lookup that saw it odd or changed retries. Everything a lookup reads
+ * is loaded and stored word by word with atomics, so a lookup racing a writer may see a mix
+ * of old and new, but never a torn word, and throws it away.
+ */
+
+/**
+ * @brief Number of hash buckets in each of the two tables, a power of two.
+ */
+#define DCACHE_BUCKETS (2 * DCACHE_ENTRIES)
+
+/**
+ * @brief A cached directory entry.
+ */
+typedef struct dentry {
+    /**
+    * @brief First block of the directory containing the entry.
+    */
+    int dir_block;
+    union {
+        /**
+        * @brief The entry's file metadata as last read or written.
+        */
+        File file;
+        /**
+        * @brief The same metadata as words, for lookups to copy without a lock.
+        */
+        uint64_t words[sizeof(File) / sizeof(uint64_t)];
+    };
+    /**
+    * @brief Physical offset of the entry in fs_fd.
+    */
+    off_t position;
+    /**
+    * @brief Next entry in the same name bucket.
+    */
+    struct dentry* name_next;
+    /**
+    * @brief Next entry in the same position bucket, or in the free list.
+    */
+    struct dentry* pos_next;
+} Dentry;
+
+/**
+ * @brief Storage for all entries.
+ */
+static Dentry pool[DCACHE_ENTRIES];
+
+/**
+ * @brief Buckets keyed by directory block and name.
+ */
+static Dentry* name_buckets[DCACHE_BUCKETS];
+
+/**
+ * @brief Buckets keyed by position.
+ */
+static Dentry* pos_buckets[DCACHE_BUCKETS];
+
+/**
+ * @brief Entries not currently in use.
+ */
+static Dentry* free_list;
+
+/**
+ * @brief Has the free list been built yet?
+ */
+static bool ready = false;
+
+/**
+ * @brief Held while the tables or the free list are touched.
+ *
+ * Only taken through `lock_dcache`, so that PennOS can't switch processes while it is held.
+ */
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Sequence count of the name table, odd while a change is being made.
+ */
+static unsigned seq = 0;
+
+/**
+ * @brief Depth of changes being made, with `dcache_lock` held.
+ */
+static int writing = 0;
+
+/**
+ * @brief Block every signal, saving the old mask in `old`, and take `dcache_lock`.
+ *
+ * @param old Where to save the old signal mask.
+ */
+static void lock_dcache(sigset_t* old) {
+    io_block_signals(old);
+    pthread_mutex_lock(&dcache_lock);
+}
+
+/**
+ * @brief Release `dcache_lock` and restore the signal mask saved by `lock_dcache`.
+ *
+ * @param old The saved signal mask.
+ */
+static void unlock_dcache(sigset_t* old) {
+    pthread_mutex_unlock(&dcache_lock);
+    io_restore_signals(old);
+}
+
+/**
+ * @brief Start a change to the tables, with `dcache_lock` held.
+ */
+static void begin_write() {
+    if (writing++ > 0) { return; }
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Finish a change to the tables begun with `begin_write`.
+ */
+static void end_write() {
+    if (--writing > 0) { return; }
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Replace the metadata of `d`, a word at a time.
+ *
+ * @param d The entry to change.
+ * @param f The new metadata.
+ */
+static void store_file(Dentry* d, File f) {
+    uint64_t words[sizeof(File) / sizeof(uint64_t)];
+    memcpy(words, &f, sizeof(File));
+    for (size_t i = 0; i < sizeof(File) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&d->words[i], words[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Hash a directory block and name (FNV-1a).
+ *
+ * @return A bucket index.
+ * @param dir_block First block of the directory.
+ * @param name Null terminated file name.
+ */
+static int name_hash(int dir_block, char* name) {
+    uint32_t h = 2166136261u ^ (uint32_t) dir_block;
+    for (int i = 0; i < 32 && name[i] != '\0'; i++) {
+        h = (h ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return h & (DCACHE_BUCKETS - 1);
+}
+
+/**
+ * @brief Hash a directory slot position.
+ *
+ * @return A bucket index.
+ * @param position Physical offset of the slot in fs_fd.
+ */
+static int pos_hash(off_t position) {
+    return (position / 64) & (DCACHE_BUCKETS - 1);
+}
+
+/**
+ * @brief Find the cached entry at `position`.
+ *
+ * @return The entry or NULL if the slot is not cached.
+ * @param position Physical offset of the slot in fs_fd.
+ */
+static Dentry* find_position(off_t position) {
+    Dentry* d = pos_buckets[pos_hash(position)];
+    while (d && d->position != position) {
+        d = d->pos_next;
+    }
+    return d;
+}
+
+/**
+ * @brief Unlink `d` from both tables and return it to the free list.
+ *
+ * @param d The entry to drop.
+ */
+static void drop(Dentry* d) {
+    Dentry** link = &name_buckets[name_hash(d->dir_block, d->file.name)];
+    while (*link != d) { link = &(*link)->name_next; }
+    __atomic_store_n(link, d->name_next, __ATOMIC_RELAXED);
+    link = &pos_buckets[pos_hash(d->position)];
+    while (*link != d) { link = &(*link)->pos_next; }
+    *link = d->pos_next;
+    __atomic_store_n(&d->name_next, NULL, __ATOMIC_RELAXED);
+    d->pos_next = free_list;
+    free_list = d;
+}
+
+/**
+ * @brief Empty the cache, with `dcache_lock` held.
+ */
+static void reset() {
+    begin_write();
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        __atomic_store_n(&name_buckets[i], NULL, __ATOMIC_RELAXED);
+    }
+    memset(pos_buckets, 0, sizeof(pos_buckets));
+    free_list = NULL;
+    for (int i = DCACHE_ENTRIES - 1; i >= 0; i--) {
+        __atomic_store_n(&pool[i].name_next, NULL, __ATOMIC_RELAXED);
+        pool[i].pos_next = free_list;
+        free_list = &pool[i];
+    }
+    __atomic_store_n(&ready, true, __ATOMIC_RELAXED);
+    end_write();
+}
+
+/**
+ * @brief Empty the cache.
+ *
+ * Called on mount and unmount, and whenever the cache fills up.
+ */
+void dcache_clear() {
+    sigset_t old;
+    lock_dcache(&old);
+    reset();
+    unlock_dcache(&old);
+}
+
+/**
+ * @brief Search the name table once, without a lock.
+ *
+ * The result is only meaningful if `seq` did not change meanwhile. A chain being changed
+ * may loop, so the search gives up after visiting as many entries as there are.
+ *
+ * @return True and fills `f` and `position` if the entry was found.
+ * @param dir_block First block of the directory.
+ * @param name Null terminated file name.
+ * @param f Set to a copy of the cached file metadata.
+ * @param position Set to the physical offset of the entry.
+ */
+static bool search(int dir_block, char* name, File* f, off_t* position) {
+    if (!__atomic_load_n(&ready, __ATOMIC_RELAXED)) { return false; }
+    Dentry* d = __atomic_load_n(&name_buckets[name_hash(dir_block, name)], __ATOMIC_RELAXED);
+    for (int steps = 0; d != NULL && steps < DCACHE_ENTRIES; steps++) {
+        if (__atomic_load_n(&d->dir_block, __ATOMIC_RELAXED) == dir_block) {
+            uint64_t words[sizeof(File) / sizeof(uint64_t)];
+            for (size_t i = 0; i < sizeof(File) / sizeof(uint64_t); i++) {
+                words[i] = __atomic_load_n(&d->words[i], __ATOMIC_RELAXED);
+            }
+            memcpy(f, words, sizeof(File));
+            if (strncmp(f->name, name, 32) == 0) {
+                *position = __atomic_load_n(&d->position, __ATOMIC_RELAXED);
+                return true;
+            }
+        }
+        d = __atomic_load_n(&d->name_next, __ATOMIC_RELAXED);
+    }
+    return false;
+}
+
+/**
+ * @brief Look up file `name` in the directory beginning at `dir_block`.
+ *
+ * Links are not followed; the link entry itself is returned.
+ * Takes no lock, retrying if the cache was changed during the lookup.
+ *
+ * @return True and fills `f` and `position` on a hit, false on a miss.
+ * @param dir_block First block of the directory.
+ * @param name Null terminated file name.
+ * @param f Set to the cached file metadata on a hit.
+ * @param position Set to the physical offset of the entry on a hit.
+ */
+bool dcache_lookup(int dir_block, char* name, File* f, off_t* position) {
+    File found;
+    off_t found_position;
+    while (true) {
+        unsigned start = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+        if (start & 1) {
+            sched_yield();
+            continue;
+        }
+        bool hit = search(dir_block, name, &found, &found_position);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&seq, __ATOMIC_RELAXED) != start) { continue; }
+        if (hit) {
+            *f = found;
+            *position = found_position;
+        }
+        return hit;
+    }
+}
+
+/**
+ * @brief Remember that file `f` lives at `position` in the directory beginning at `dir_block`.
+ *
+ * Deleted and EOD entries are never cached.
+ *
+ * @param dir_block First block of the directory.
+ * @param f The file metadata found in the slot.
+ * @param position Physical offset of the slot in fs_fd.
+ */
+void dcache_insert(int dir_block, File f, off_t position) {
+    if (f.name[0] == EOD_FLAG || f.name[0] == CLEANED_FLAG || f.name[0] == REMOVED_FLAG) { return; }
+    sigset_t old;
+    lock_dcache(&old);
+    begin_write();
+    if (!ready) { reset(); }
+    Dentry* d = find_position(position);
+    if (d) { drop(d); }
+    if (free_list == NULL) { reset(); }
+    d = free_list;
+    free_list = d->pos_next;
+    __atomic_store_n(&d->dir_block, dir_block, __ATOMIC_RELAXED);
+    store_file(d, f);
+    __atomic_store_n(&d->position, position, __ATOMIC_RELAXED);
+    int h = name_hash(dir_block, f.name);
+    __atomic_store_n(&d->name_next, name_buckets[h], __ATOMIC_RELAXED);
+    __atomic_store_n(&name_buckets[h], d, __ATOMIC_RELAXED);
+    h = pos_hash(position);
+    d->pos_next = pos_buckets[h];
+    pos_buckets[h] = d;
+    end_write();
+    unlock_dcache(&old);
+}
+
+/**
+ * @brief Keep the cache coherent after file `f` is written to the slot at `position`.
+ *
+ * If the slot is cached under the same name its metadata is replaced,
+ * otherwise (deleted or renamed) the cached entry is dropped.
+ *
+ * @param position Physical offset of the slot in fs_fd.
+ * @param f The file metadata now in the slot.
+ */
+void dcache_update(off_t position, File f) {
+    sigset_t old;
+    lock_dcache(&old);
+    begin_write();
+    Dentry* d = ready ? find_position(position) : NULL;
+    if (d && strncmp(d->file.name, f.name, 32) == 0) {
+        store_file(d, f);
+    } else if (d) {
+        drop(d);
+    }
+    end_write();
+    unlock_dcache(&old);
+}
+
+/**
+ * @brief Forget whatever is cached for the slot at `position`.
+ *
+ * @param position Physical offset of the slot in fs_fd.
+ */
+void dcache_invalidate(off_t position) {
+    sigset_t old;
+    lock_dcache(&old);
+    begin_write();
+    Dentry* d = ready ? find_position(position) : NULL;
+    if (d) { drop(d); }
+    end_write();
+    unlock_dcache(&old);
+}
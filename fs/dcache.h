@@ -0,0 +1,28 @@
+#ifndef DCACHE
+#define DCACHE
+#include <stdbool.h>
+#include "filesys.h"
+
+/**
+ * @file dcache.h
+ * @brief A cache of directory entries used to resolve paths without touching directory blocks.
+ */
+
+/**
+ * @brief Maximum number of cached directory entries before the cache is emptied.
+ */
+#define DCACHE_ENTRIES 1024
+
+// Documentation in dcache.c
+
+bool dcache_lookup(int dir_block, char* name, File* f, off_t* position);
+
+void dcache_insert(int dir_block, File f, off_t position);
+
+void dcache_update(off_t position, File f);
+
+void dcache_invalidate(off_t position);
+
+void dcache_clear();
+
+#endif
@@ -0,0 +1,172 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "dedup.h"
+#include "../error.h"
+
+/**
+ * @file dedup.c
+ * @brief An implementation of the dedup index.
+ *
+ * Blocks are kept in a hash table chained through arrays indexed by block number, so the index
+ * takes 12 bytes per block and 4 per bucket and never allocates after `dedup_init`.
+ * The chains are doubly linked so that a block can be dropped in O(1) when it is rewritten,
+ * however many blocks share its hash. Block 0 doesn't exist, so 0 ends a chain.
+ *
+ * A hash only says blocks might be equal. Callers compare the contents before relying on a match.
+ */
+
+/**
+ * @brief First block in each bucket, or 0.
+ */
+static int* heads = NULL;
+
+/**
+ * @brief Next block in the same bucket as block `b`, or 0.
+ */
+static int* next = NULL;
+
+/**
+ * @brief Previous block in the same bucket as block `b`, or 0 if it is first.
+ */
+static int* prev = NULL;
+
+/**
+ * @brief Hash of block `b`'s contents when it was indexed.
+ */
+static uint32_t* hashes = NULL;
+
+/**
+ * @brief Is block `b` in the index?
+ */
+static bool* indexed = NULL;
+
+/**
+ * @brief Number of buckets less one, the number of buckets being a power of two.
+ */
+static uint32_t mask;
+
+/**
+ * @brief Number of blocks in the index.
+ */
+static int count = 0;
+
+/**
+ * @brief Start an empty index for blocks 1 to `new_data_blocks`.
+ *
+ * @param new_data_blocks Number of data blocks.
+ */
+void dedup_init(int new_data_blocks) {
+    dedup_close();
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t) new_data_blocks) { buckets <<= 1; }
+    mask = buckets - 1;
+    heads = (int*) calloc(buckets, sizeof(int));
+    next = (int*) calloc(new_data_blocks + 1, sizeof(int));
+    prev = (int*) calloc(new_data_blocks + 1, sizeof(int));
+    hashes = (uint32_t*) calloc(new_data_blocks + 1, sizeof(uint32_t));
+    indexed = (bool*) calloc(new_data_blocks + 1, sizeof(bool));
+    if (heads == NULL || next == NULL || prev == NULL || hashes == NULL || indexed == NULL) {
+        cur_errno = ERR_PERM;
+        p_perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Drop the index and release its memory.
+ */
+void dedup_close() {
+    free(heads);
+    free(next);
+    free(prev);
+    free(hashes);
+    free(indexed);
+    heads = NULL;
+    next = NULL;
+    prev = NULL;
+    hashes = NULL;
+    indexed = NULL;
+    count = 0;
+}
+
+/**
+ * @brief Index `block` under `hash`, replacing whatever it was indexed under before.
+ *
+ * @param block The FAT block number.
+ * @param hash Hash of the block's contents.
+ */
+void dedup_add(int block, uint32_t hash) {
+    if (indexed[block] && hashes[block] == hash) { return; }
+    dedup_remove(block);
+    uint32_t bucket = hash & mask;
+    next[block] = heads[bucket];
+    prev[block] = 0;
+    if (heads[bucket] != 0) { prev[heads[bucket]] = block; }
+    heads[bucket] = block;
+    hashes[block] = hash;
+    indexed[block] = true;
+    count++;
+}
+
+/**
+ * @brief Drop `block` from the index if it is in it.
+ *
+ * @param block The FAT block number.
+ */
+void dedup_remove(int block) {
+    if (!indexed[block]) { return; }
+    if (prev[block] != 0) {
+        next[prev[block]] = next[block];
+    } else {
+        heads[hashes[block] & mask] = next[block];
+    }
+    if (next[block] != 0) { prev[next[block]] = prev[block]; }
+    indexed[block] = false;
+    count--;
+}
+
+/**
+ * @brief Is `block` in the index?
+ *
+ * @return True if it was added and not removed since.
+ * @param block The FAT block number.
+ */
+bool dedup_indexed(int block) {
+    return indexed[block];
+}
+
+/**
+ * @brief Get the hash `block` is indexed under.
+ *
+ * @return The hash, only meaningful if the block is indexed.
+ * @param block The FAT block number.
+ */
+uint32_t dedup_hash(int block) {
+    return hashes[block];
+}
+
+/**
+ * @brief Find a block indexed under `hash`.
+ *
+ * Pass 0 to get the first and then each block returned to get the next.
+ *
+ * @return The FAT block number, or 0 if there are no more.
+ * @param hash Hash of the contents wanted.
+ * @param after The block last returned, or 0.
+ */
+int dedup_find(uint32_t hash, int after) {
+    int b = after != 0 ? next[after] : heads[hash & mask];
+    while (b != 0 && hashes[b] != hash) { b = next[b]; }
+    return b;
+}
+
+/**
+ * @brief Get the number of blocks in the index.
+ *
+ * @return The number of blocks.
+ */
+int dedup_count() {
+    return count;
+}
@@ -0,0 +1,29 @@
+#ifndef DEDUP
+#define DEDUP
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file dedup.h
+ * @brief An in-memory index of data blocks by a hash of their contents, used to find duplicates.
+ */
+
+// Documentation in dedup.c
+
+void dedup_init(int new_data_blocks);
+
+void dedup_close();
+
+void dedup_add(int block, uint32_t hash);
+
+void dedup_remove(int block);
+
+bool dedup_indexed(int block);
+
+uint32_t dedup_hash(int block);
+
+int dedup_find(uint32_t hash, int after);
+
+int dedup_count();
+
+#endif
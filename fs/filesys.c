@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/mman.h>
@@ -9,12 +10,34 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <signal.h>
+#include <pthread.h>
 #include "filesys.h"
+#include "cache.h"
+#include "dcache.h"
+#include "alloc.h"
+#include "journal.h"
+#include "io.h"
+#include "lz.h"
+#include "crc.h"
+#include "dedup.h"
+#include "arena.h"
 #include "../error.h"
 
 /**
  * @file filesys.c
  * @brief An implementation of the filesystem API.
+ *
+ * The API may be called from several host threads at once. Calls which only look at the
+ * filesystem hold `fs_lock` shared and run in parallel, while calls which change it hold it
+ * exclusively: they all touch the FAT, the free block index and the open transaction, so
+ * finer locks would buy little. Everything readers still change (the block cache, the directory
+ * entry cache, the I/O queues and a few counters) is locked or atomic on its own, and host I/O
+ * uses offsets rather than the descriptor's file position.
+ *
+ * Lookups of paths whose every component is in the directory entry cache don't take `fs_lock`
+ * at all, see `lookup_cached`. Instead each exclusive call counts `fs_seq` up on the way in and
+ * out, publishing what it changed, and a lookup which overlapped one is thrown away.
  */
 
 /**
@@ -24,8 +47,94 @@
 
 /**
  * @brief Indicates the last block of a file in the FAT.
+ *
+ * Stored as 0xFFFF in the original format's 16-bit FAT and directory slots.
+ */
+#define LAST_BLOCK 0xFFFFFFFF
+
+/**
+ * @brief Set in the 32-bit FAT entry of a hole node, which stands for a run of blocks that read as zeroes.
+ *
+ * The rest of the entry is the next block as usual, or `HOLE_END` if the hole ends the chain,
+ * and `get_fat` strips the flag. The node's own block holds just the length of the run, so a hole
+ * takes one block however long it is, see `seek_data`. Block numbers stay below 2^30.
+ */
+#define HOLE_FLAG 0x80000000
+
+/**
+ * @brief Next block of a hole node which ends its chain, as `LAST_BLOCK` would lose the flag.
+ *
+ * With the flag it isn't `LAST_BLOCK` either.
+ */
+#define HOLE_END 0x7FFFFFFE
+
+/**
+ * @brief Set in a chain position which falls inside a hole run, see `walk_data`.
+ *
+ * No block and offset name such a position, so it holds the hole node from bit 32
+ * and the offset into the run below.
+ */
+#define HOLE_POSITION ((off_t) 1 << 62)
+
+/**
+ * @brief Marks the superblock at the start of a filesystem in the 32-bit format.
+ *
+ * Its low byte can't be a block size byte of the original format, where `fat[0]` starts the file.
+ */
+#define SUPER_MAGIC 0x54414650
+
+/**
+ * @brief Version of the 32-bit format written by `init_fs`.
+ *
+ * Version 3 added hole nodes. Version 2 images are still mounted, but never get holes.
+ */
+#define SUPER_VERSION 3
+
+/**
+ * @brief Offset within the superblock's block of the snapshot table, which fills the rest of the block.
+ */
+#define SNAPSHOT_TABLE 32
+
+/**
+ * @brief Largest image in the 32-bit format, 256 GiB.
+ *
+ * Directory indexes store slot positions divided by 64 in 32 bits.
+ */
+#define WIDE_MAX_BYTES ((off_t) 1 << 38)
+
+/**
+ * @brief Set in the block size byte of `fat[0]` when the filesystem has a journal.
+ *
+ * The journal region, `JOURNAL_SIZE` bytes, follows the last data block.
+ */
+#define JOURNAL_FLAG 0x80
+
+/**
+ * @brief Set in the block size byte of `fat[0]` when the filesystem has a checksum table.
+ *
+ * The table follows the journal, a 4-byte CRC32C for each block counting the nonexistent block 0.
+ */
+#define CHECKSUM_FLAG 0x40
+
+/**
+ * @brief Chain blocks `find_duplicate` may look at per block of data before giving up.
+ */
+#define DEDUP_BUDGET 8
+
+/**
+ * @brief Bytes read from the host at a time by `scrub_fs`.
+ */
+#define SCRUB_CHUNK (1 << 20)
+
+/**
+ * @brief Blocks read ahead once reads through a cursor are seen to be sequential.
+ */
+#define READAHEAD_MIN_BLOCKS 4
+
+/**
+ * @brief Largest readahead window, the window doubles up to this while reads stay sequential.
  */
-#define LAST_BLOCK 0xFFFF
+#define READAHEAD_MAX_BLOCKS 32
 
 /**
  * @brief Indicates that links should not be followed.
@@ -42,6 +151,64 @@
  */
 #define SKIP_ALL 0x02
 
+/**
+ * @brief Marks a directory index, both where the directory points to it and in its header.
+ */
+#define INDEX_MAGIC 0x58444950
+
+/**
+ * @brief Directories are given an index once they grow to this many slots.
+ */
+#define INDEX_MIN_SLOTS 256
+
+/**
+ * @brief Bucket value left behind by a removed entry.
+ *
+ * Slots come after the FAT, which takes at least 256 bytes, so slot numbers are at least 4
+ * and can't be confused with it, nor with an empty bucket's 0.
+ */
+#define INDEX_TOMBSTONE 1
+
+/**
+ * @brief Offset within a slot of `Slot.link`.
+ */
+#define SLOT_LINK 48
+
+/**
+ * @brief Offset within a slot of `Slot.first_block_hi`.
+ */
+#define SLOT_BLOCK_HI 52
+
+/**
+ * @brief Offset within the first slot of a directory of its index magic and first index block.
+ */
+#define SLOT_INDEX 56
+
+/**
+ * @brief Offset within a slot of `Slot.tail`.
+ */
+#define SLOT_TAIL 54
+
+/**
+ * @brief Marks a tail block in its header.
+ */
+#define TAIL_MAGIC 0x4C494154
+
+/**
+ * @brief Marks the header at the start of a compressed file's chain.
+ */
+#define COMPRESS_MAGIC 0x5A4C4650
+
+/**
+ * @brief Number of bytes of a compressed file which are compressed together.
+ */
+#define CLUSTER_SIZE 8192
+
+/**
+ * @brief Fewest entries in the cluster table of a compressed file.
+ */
+#define CLUSTER_MIN_ENTRIES 16
+
 
 /**
  * @brief Filesystem file descriptor on host.
@@ -49,9 +216,26 @@
 int fs_fd;
 
 /**
- * @brief Memory-mapped FAT.
+ * @brief Memory-mapped FAT, of `uint16_t` entries or `uint32_t` entries if `wide`.
+ *
+ * Use `get_fat` and `set_fat` rather than indexing it.
+ */
+void* fat;
+
+/**
+ * @brief Is the mounted filesystem in the 32-bit format?
  */
-uint16_t* fat;
+bool wide = false;
+
+/**
+ * @brief May chains of the mounted filesystem hold hole nodes? Only from version 3 of the 32-bit format.
+ */
+bool sparse = false;
+
+/**
+ * @brief Host offset of `fat[0]`: 0 in the original format, one block in after the superblock otherwise.
+ */
+int fat_offset = 0;
 
 /**
  * @brief Block size in bytes.
@@ -59,18 +243,210 @@ uint16_t* fat;
 int block_size;
 
 /**
- * @brief Number of blocks in FAT.
+ * @brief Number of blocks before the data region: the FAT, and the superblock in the 32-bit format.
  */
 int fat_blocks;
 
 /**
  * @brief Number of data blocks. 
  *
- * 1-indexed in FAT as `fat[0]` stores filesystem configuration information.
- * Maximum index is `LAST_BLOCK - 1 = 0xfffe`.
+ * 1-indexed in FAT as `fat[0]` stores filesystem configuration information or is unused.
+ * Maximum index is `0xfffe` in the original format, and in the 32-bit format
+ * whatever keeps the image within `WIDE_MAX_BYTES`.
  */
 int data_blocks;
 
+/**
+ * @brief Incremented whenever blocks are freed, invalidating every cursor.
+ *
+ * A freed block may be reused by another chain, so a cursor set before
+ * the free can no longer be trusted to lie on the chain it was set on.
+ */
+int chain_generation = 0;
+
+/**
+ * @brief When changes are committed to disk, see the `DURABILITY_` macros in filesys.h.
+ */
+int durability = DURABILITY_STRICT;
+
+/**
+ * @brief First FAT entry changed since the last commit.
+ */
+int fat_dirty_lo;
+
+/**
+ * @brief One past the last FAT entry changed since the last commit, equal to `fat_dirty_lo` if none.
+ */
+int fat_dirty_hi;
+
+/**
+ * @brief Have data blocks been written since the last commit?
+ */
+bool data_dirty = false;
+
+/**
+ * @brief Number of operations since the last commit.
+ */
+int pending_ops = 0;
+
+/**
+ * @brief Time of the last commit.
+ */
+time_t last_commit;
+
+/**
+ * @brief Does the mounted filesystem have a journal?
+ *
+ * If so metadata writes (FAT entries and directory slots) are logged and only reach their
+ * home locations once committed, and the FAT is mapped privately so that it never reaches
+ * the host behind the journal's back.
+ */
+bool journaled = false;
+
+/**
+ * @brief Number of `begin_txn` calls not yet matched by `end_txn`.
+ */
+int txn_depth = 0;
+
+/**
+ * @brief Read-only shared mapping of the data region, or NULL if it isn't mapped.
+ *
+ * Block `b` starts at `data_map + (b - 1) * block_size`. Writes still go through the
+ * block cache to the host file, whose pages the mapping shares, so it never goes stale.
+ */
+uint8_t* data_map = NULL;
+
+/**
+ * @brief A block of zeroes which `borrow_file` lends for holes, allocated while `data_map` is.
+ */
+uint8_t* hole_zeroes = NULL;
+
+/**
+ * @brief Tail block which small files are currently packed into, or 0 if a new one is needed.
+ */
+int tail_block = 0;
+
+/**
+ * @brief FAT entries set by the current operation, see `abort_op`.
+ *
+ * Each is the entry's number followed by its old value, both 32 bits.
+ */
+uint8_t* fat_undo = NULL;
+
+/**
+ * @brief Bytes used in `fat_undo`.
+ */
+int fat_undo_len = 0;
+
+/**
+ * @brief Bytes allocated for `fat_undo`.
+ */
+int fat_undo_cap = 0;
+
+/**
+ * @brief Old contents of the metadata written by the current operation, without a journal only.
+ *
+ * Each write is the bytes it replaced followed by its 8 byte position and 4 byte length,
+ * so that `abort_op` can walk the writes backwards.
+ */
+uint8_t* slot_undo = NULL;
+
+/**
+ * @brief Bytes used in `slot_undo`.
+ */
+int slot_undo_len = 0;
+
+/**
+ * @brief Bytes allocated for `slot_undo`.
+ */
+int slot_undo_cap = 0;
+
+/**
+ * @brief `tail_block` when the current operation began.
+ */
+int op_tail_block = 0;
+
+/**
+ * @brief Is `abort_op` putting things back? Its own writes aren't recorded.
+ */
+bool aborting = false;
+
+/**
+ * @brief Is a snapshot mounted, see `mount_snapshot`? If so nothing may be changed.
+ */
+bool read_only = false;
+
+/**
+ * @brief Shared mapping of the checksum table, or NULL if the filesystem has none.
+ *
+ * `checksums[b]` is the CRC32C of the whole of block `b`, or 0 if it has no checksum,
+ * which is also the case for the odd block whose checksum comes out as 0.
+ * The table isn't journaled, so a crash can leave the checksums of blocks written since
+ * the last commit out of date.
+ */
+uint32_t* checksums = NULL;
+
+/**
+ * @brief Offset of the checksum table from the page boundary its mapping starts at.
+ */
+int checksum_offset;
+
+/**
+ * @brief Checksum of a block of zeroes.
+ */
+uint32_t zero_checksum;
+
+/**
+ * @brief Number of blocks read since mount which didn't match their checksums.
+ */
+long checksum_errors = 0;
+
+/**
+ * @brief Are identical file blocks shared, see `set_dedup`?
+ */
+bool dedup = false;
+
+/**
+ * @brief Number of blocks since mount which weren't written because identical ones were shared instead.
+ */
+long dedup_shared = 0;
+
+/**
+ * @brief Held shared by calls which only look at the filesystem and exclusively by calls which change it.
+ *
+ * Writers are preferred so that a stream of readers can't starve them.
+ */
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+/**
+ * @brief Number of calls holding `fs_lock` the calling thread is inside.
+ *
+ * Calls made from within others, or between `begin_txn` and `end_txn`, don't take it again.
+ * Counting per thread is safe because PennOS can't switch to another process on the thread
+ * while it holds the lock: signals are blocked, and I/O is waited for without yielding.
+ */
+__thread int fs_lock_depth = 0;
+
+/**
+ * @brief Signal mask of the calling thread to restore once it releases `fs_lock`.
+ */
+__thread sigset_t fs_lock_mask;
+
+/**
+ * @brief Does the calling thread hold `fs_lock` exclusively?
+ */
+__thread bool fs_lock_exclusive = false;
+
+/**
+ * @brief Counted up when `fs_lock` is taken and released exclusively, so odd while the filesystem is changing.
+ */
+unsigned fs_seq = 0;
+
+/**
+ * @brief First block of the root directory as of the last exclusive call, for lookups without `fs_lock`.
+ */
+int root_block = 0;
+
 /**
  * @brief A directory entry struct type.
  */
@@ -82,7 +458,7 @@ typedef struct entry {
     /**
     * @brief Physical offset of file in fs_fd.
     */
-    int position;
+    off_t position;
 } Entry;
 
 /**
@@ -96,215 +472,2128 @@ Entry root;
 Entry eod = (Entry) { (File) { "", 0, 0, UNKNOWN_FILE, 0, 0 }, -1 };
 
 /**
- * @brief An absolute path struct type.
+ * @brief Bytes needed for a path component as compared with file names, 32 and a null.
+ */
+#define NAME_BUFFER 33
+
+/**
+ * @brief An absolute path struct type, pointing into the path string.
  */
 typedef struct path {
     /**
-    * @brief Sequence of nested directories leading to file location.
+    * @brief The nested directories leading to file location, the path string up to `name`.
     *
-    * A NULL pointer follows the last entry.
-    * In particular, if the first entry is NULL we are in the root directory.
+    * Has no components if we are in the root directory.
     */
-    char** dir;
+    PathView dir;
     /**
     * @brief File name.
     *
-    * Only NULL to indicate the empty path, i.e. the path to the root directory.
+    * Only empty to indicate the empty path, i.e. the path to the root directory.
     */
-    char* name;
+    PathView name;
 } Path;
 
 /**
- * @brief Split a parsed absolute path string into a Path struct type.
+ * @brief Header of a directory index.
  *
- * Dot and dot-dot are not supported.
- * @return A path struct.
- * @param name A parsed absolute path string.
+ * An index is a physically contiguous run of blocks holding this header followed by an
+ * open addressing hash table of slot numbers (slot positions divided by 64) keyed by name. It also tracks where the
+ * next entry can go: the directory's deleted slots are chained together through their
+ * spare bytes, and after those the EOD slot is used.
  */
-Path split_path(char* path_str) {
-    // Compute number of tokens
-    char tmp[strlen(path_str) + 1];
-    strcpy(tmp, path_str);
-    int argc = 0;
-    if (strtok(tmp, "/")) { argc++; }
-    while (strtok(NULL, "/")) { argc++; }
-    // Copy to not change original
-    char* copy_str = (char*) malloc(strlen(path_str) + 1);
-    strcpy(copy_str, path_str);
-    // Build token sequence
-    char** dir = malloc(sizeof(char*) * argc);
-    dir[0] = strtok(copy_str, "/");
-    for (int i = 1; i < argc; i++) { 
-        dir[i] = strtok(NULL, "/");
-    }
-    char* name;
-    if (argc > 0) {
-        name = dir[argc-1];
-        dir[argc-1] = NULL;
-    } else {
-        name = NULL;
-    }
-    return (Path) { dir, name };
-}
+typedef struct dir_index {
+    /**
+    * @brief Always `INDEX_MAGIC`.
+    */
+    uint32_t magic;
+    /**
+    * @brief Number of buckets, a power of two.
+    */
+    uint32_t buckets;
+    /**
+    * @brief Buckets holding a position or a tombstone.
+    */
+    uint32_t used;
+    /**
+    * @brief Buckets holding a position.
+    */
+    uint32_t live;
+    /**
+    * @brief Slot number (position / 64) of the directory's EOD slot.
+    */
+    uint32_t eod;
+    /**
+    * @brief Slot number of the first deleted slot, or 0 if there are none.
+    */
+    uint32_t free_slot;
+    /**
+    * @brief Number of blocks in the index.
+    */
+    uint32_t blocks;
+    /**
+    * @brief Unused, keeps the header a multiple of the bucket size.
+    */
+    uint32_t reserved;
+} DirIndex;
 
 /**
- * @brief Reserve and return a block to follow `block` in the FAT.
+ * @brief Header of a tail block.
  *
- * If block is nonzero sets `fat[block] = new_block`.
- * Zeroes out any newly allocated memory (directory assumes this!)
- * Note: need to call fsync(fs_fd) after any fat write.
- * Throws an error if no space left.
- *  
- * @return The new block on success or -1 on failure.
- * @param block The block to extend a file from or 0 to simply reserve a block.
+ * A tail block is a single block holding the data of several small files one after another,
+ * each file's slot giving the block and the offset of its data. New data only goes at the top
+ * of the block, and the space of data which is dropped is only reclaimed with the whole block.
  */
-int extend_data(int block) {
-    for (int i = 1; i <= data_blocks; ++i) {
-        if (fat[i] == FREE_BLOCK) {
-            if (block != 0) {
-                fat[block] = i;
-            }
-            fat[i] = LAST_BLOCK;
-            fsync(fs_fd);
-            if (lseek(fs_fd, (i + fat_blocks - 1) * block_size, SEEK_SET) == -1) {
-                cur_errno = ERR_PERM;
-                p_perror("lseek");
-                exit(EXIT_FAILURE);
-            }
-            uint8_t* zeroes = (uint8_t*) calloc(block_size, 1);
-            if (write(fs_fd, zeroes, block_size) == -1) {
-                cur_errno = ERR_PERM;
-                p_perror("write");
-                exit(EXIT_FAILURE);
-            }
-            return i;
-        }
-    }
-    errno = ENOSPC;
-    return 0;
-}
+typedef struct tail_header {
+    /**
+    * @brief Always `TAIL_MAGIC`.
+    */
+    uint32_t magic;
+    /**
+    * @brief Number of files with data in the block, the block is freed when it drops to 0.
+    */
+    uint16_t live;
+    /**
+    * @brief Offset of the free space after the last data in the block.
+    */
+    uint16_t top;
+} TailHeader;
 
 /**
- * @brief Get position which is logical offset bytes ahead of input position.
+ * @brief Header at the start of the chain of a compressed file, see `COMPRESSED_PERM`.
  *
- * Terminology: position => physical location in fs_fd, offset => number of logical bytes.
- * If the end of the current file is reached seek_data extends the file.
- * Input logical offset must be non-negative.
- * Throws an error if no space left.
- *  
- * @return The position which is reached or -1 on failure.
- * @param position The position to begin from.
- * @param offset Logical offset size.
+ * The file is split into clusters of `CLUSTER_SIZE` bytes, each compressed on its own.
+ * The header is followed by a table of entries locating each cluster's data within the chain,
+ * and then the data area. A cluster which grows is moved to the end of the data area unless it
+ * is already there, leaving dead space behind, and the file is compacted once that outweighs the
+ * live data. Offsets are logical offsets in the chain.
  */
-int seek_data(int position, int offset) {
+typedef struct compress_header {
+    /**
+    * @brief Always `COMPRESS_MAGIC`.
+    */
+    uint32_t magic;
+    /**
+    * @brief Number of entries in the cluster table.
+    */
+    uint32_t entries;
+    /**
+    * @brief Offset of the end of the data area.
+    */
+    uint32_t end;
+    /**
+    * @brief Number of bytes in the data area no cluster uses.
+    */
+    uint32_t dead;
+} CompressHeader;
+
+/**
+ * @brief Entry in the cluster table of a compressed file.
+ */
+typedef struct cluster {
+    /**
+    * @brief Offset of the cluster's data, or 0 if the cluster is all zeroes.
+    */
+    uint32_t offset;
+    /**
+    * @brief Number of bytes of data.
+    */
+    uint16_t length;
+    /**
+    * @brief Is the data stored as is because it didn't compress?
+    */
+    uint16_t raw;
+} Cluster;
+
+/**
+ * @brief The first bytes of a filesystem in the 32-bit format.
+ *
+ * It starts block 0, the rest of which holds the snapshot table, and is followed by a FAT
+ * of `uint32_t` entries, then the data region and the journal. Data block `b` is still at `(b + fat_blocks - 1) * block_size`,
+ * with `fat_blocks` counting the superblock.
+ */
+typedef struct superblock {
+    /**
+    * @brief Always `SUPER_MAGIC`.
+    */
+    uint32_t magic;
+    /**
+    * @brief Format version, `SUPER_VERSION`.
+    */
+    uint32_t version;
+    /**
+    * @brief Block size config, block size is `2^(8 + config)`, with `JOURNAL_FLAG` if there is a journal.
+    */
+    uint32_t config;
+    /**
+    * @brief Number of FAT blocks, not counting the superblock.
+    */
+    uint32_t fat_blocks;
+    /**
+    * @brief Number of data blocks.
+    */
+    uint32_t data_blocks;
+} Superblock;
+
+/**
+ * @brief On-disk layout of a directory slot.
+ *
+ * The first 48 bytes are laid out as a `File` with a 16-bit first block, as in the original format.
+ * The rest is spare bytes put to other uses.
+ */
+typedef struct slot {
+    /**
+    * @brief As in `File`.
+    */
+    char name[32];
+    /**
+    * @brief As in `File`.
+    */
+    uint32_t size;
+    /**
+    * @brief Low 16 bits of the first block, 0xFFFF for `LAST_BLOCK` in the original format.
+    */
+    uint16_t first_block;
+    /**
+    * @brief As in `File`.
+    */
+    uint8_t type;
+    /**
+    * @brief As in `File`.
+    */
+    uint8_t perm;
+    /**
+    * @brief As in `File`.
+    */
+    time_t mtime;
+    /**
+    * @brief In a deleted slot of an indexed directory, slot number (position / 64) of the next deleted slot.
+    */
+    uint32_t link;
+    /**
+    * @brief High 16 bits of the first block, in the 32-bit format only.
+    */
+    uint16_t first_block_hi;
+    /**
+    * @brief As in `File`.
+    */
+    uint16_t tail;
+} Slot;
+
+/**
+ * @brief A file found by `walk_tree`.
+ */
+typedef struct tree_file {
+    /**
+    * @brief Absolute path of the file, allocated with malloc.
+    */
+    char* path;
+    /**
+    * @brief The file's metadata.
+    */
+    File file;
+} TreeFile;
+
+/**
+ * @brief Start recording what the current operation changes, so that `abort_op` can undo it.
+ *
+ * Called whenever `fs_lock` is taken exclusively, and once changes are committed.
+ */
+void begin_op() {
+    fat_undo_len = 0;
+    slot_undo_len = 0;
+    op_tail_block = tail_block;
+    alloc_begin_op();
+    if (journaled) { journal_begin_op(); }
+}
+
+/**
+ * @brief Make room for `size` more bytes at the end of an undo log and return where they go.
+ *
+ * @return Where the bytes go.
+ * @param log The log, reallocated as needed.
+ * @param len Bytes used in the log, increased by `size`.
+ * @param cap Bytes allocated for the log.
+ * @param size Number of bytes to add.
+ */
+uint8_t* undo_reserve(uint8_t** log, int* len, int* cap, int size) {
+    if (*len + size > *cap) {
+        while (*len + size > *cap) { *cap = *cap ? 2 * *cap : 4096; }
+        *log = (uint8_t*) realloc(*log, *cap);
+        if (*log == NULL) {
+            cur_errno = ERR_PERM;
+            p_perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    *len += size;
+    return *log + *len - size;
+}
+
+/**
+ * @brief Take `fs_lock` unless the calling thread already holds it.
+ *
+ * Every signal is blocked first, so that PennOS doesn't switch processes until it is released.
+ * Taking it exclusively starts an operation, see `begin_op`.
+ *
+ * @return 0, so that `SHARED_CALL` and `EXCLUSIVE_CALL` can use it as an initializer.
+ * @param exclusive Take it exclusively?
+ */
+int hold_fs(bool exclusive) {
+    if (fs_lock_depth++ == 0) {
+        io_block_signals(&fs_lock_mask);
+        if (exclusive) {
+            pthread_rwlock_wrlock(&fs_lock);
+            fs_lock_exclusive = true;
+            __atomic_store_n(&fs_seq, fs_seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            begin_op();
+        } else {
+            pthread_rwlock_rdlock(&fs_lock);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Undo a `hold_fs`, releasing `fs_lock` once the outermost call is done.
+ *
+ * An exclusive holder publishes the root directory and makes `fs_seq` even again first.
+ * The signal mask is restored last.
+ *
+ * @param held The variable going out of scope, unused.
+ */
+void release_fs(int* held) {
+    if (--fs_lock_depth > 0) { return; }
+    if (fs_lock_exclusive) {
+        fs_lock_exclusive = false;
+        __atomic_store_n(&root_block, root.file.first_block, __ATOMIC_RELAXED);
+        __atomic_store_n(&fs_seq, fs_seq + 1, __ATOMIC_RELEASE);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    io_restore_signals(&fs_lock_mask);
+}
+
+/**
+ * @brief Hold `fs_lock` shared until the enclosing function returns.
+ */
+#define SHARED_CALL int fs_held __attribute__((cleanup(release_fs), unused)) = hold_fs(false)
+
+/**
+ * @brief Hold `fs_lock` exclusively until the enclosing function returns.
+ */
+#define EXCLUSIVE_CALL int fs_held __attribute__((cleanup(release_fs), unused)) = hold_fs(true)
+
+/**
+ * @brief Take the next component off the front of `rest`.
+ *
+ * Components are separated by any number of slashes. Nothing is copied or allocated,
+ * so a path is walked by calling this until it returns false.
+ *
+ * @return True and sets `name` if there was a component, false once only slashes are left.
+ * @param rest What is left of the path, advanced past the component.
+ * @param name Set to the component.
+ */
+bool next_name(PathView* rest, PathView* name) {
+    while (rest->len > 0 && rest->ptr[0] == '/') {
+        rest->ptr++;
+        rest->len--;
+    }
+    if (rest->len == 0) { return false; }
+    int len = 0;
+    while (len < rest->len && rest->ptr[len] != '/') { len++; }
+    *name = (PathView) { rest->ptr, len };
+    rest->ptr += len;
+    rest->len -= len;
+    return true;
+}
+
+/**
+ * @brief Write the parsed absolute path to the file located at `name` from directory `dir` into `out`.
+ *
+ * If `name` is an absolute path (begins with '/') `dir` is ignored.
+ * If `name` is a relative path it is appended to `dir`.
+ * "Parsed" means that all dots are removed from the path.
+ * Single dots '.' do nothing.
+ * Double dots '..' go up one directory (unless at root).
+ * The path is built in one pass over the components, without any allocation.
+ *
+ * @param out At least `strlen(dir) + strlen(name) + 2` bytes.
+ * @param dir A parsed absolute path to the directory `name` is relative to.
+ * @param name The location of the file.
+ */
+void join_path(char* out, char* dir, char* name) {
+    int len = 0;
+    out[0] = '\0';
+    char* parts[2] = { name[0] == '/' ? "" : dir, name };
+    for (int i = 0; i < 2; i++) {
+        PathView rest = { parts[i], strlen(parts[i]) };
+        PathView part;
+        while (next_name(&rest, &part)) {
+            if (part.len == 2 && part.ptr[0] == '.' && part.ptr[1] == '.') {
+                while (len > 0 && out[--len] != '/') {}
+            } else if (part.len != 1 || part.ptr[0] != '.') {
+                out[len++] = '/';
+                memcpy(out + len, part.ptr, part.len);
+                len += part.len;
+            }
+            out[len] = '\0';
+        }
+    }
+}
+
+/**
+ * @brief Copy path component `name` into `buf` as a null terminated string.
+ *
+ * No more than the 32 characters compared with file names are copied.
+ *
+ * @return `buf`.
+ * @param name The component.
+ * @param buf At least `NAME_BUFFER` bytes.
+ */
+char* name_string(PathView name, char* buf) {
+    int len = name.len < NAME_BUFFER - 1 ? name.len : NAME_BUFFER - 1;
+    memcpy(buf, name.ptr, len);
+    buf[len] = '\0';
+    return buf;
+}
+
+/**
+ * @brief Split a parsed absolute path string into a Path struct type.
+ *
+ * The path struct points into `path_str`, which must outlive it, and nothing is allocated.
+ * Dot and dot-dot are not supported.
+ * @return A path struct.
+ * @param name A parsed absolute path string.
+ */
+Path split_path(char* path_str) {
+    PathView rest = { path_str, strlen(path_str) };
+    PathView name = { path_str, 0 };
+    PathView next;
+    while (next_name(&rest, &next)) { name = next; }
+    return (Path) { (PathView) { path_str, name.ptr - path_str }, name };
+}
+
+/**
+ * @brief Convert a physical position in fs_fd to the FAT block containing it.
+ *
+ * @return The FAT block number.
+ * @param position Physical offset in fs_fd.
+ */
+int position_to_block(off_t position) {
+    return position / block_size - fat_blocks + 1;
+}
+
+/**
+ * @brief Get the physical offset in fs_fd of FAT block `block`.
+ *
+ * @return Physical offset in fs_fd.
+ * @param block The FAT block number.
+ */
+off_t block_position(int block) {
+    return (off_t) (block + fat_blocks - 1) * block_size;
+}
+
+/**
+ * @brief Get the size of the checksum table for `blocks` data blocks.
+ *
+ * @return Size in bytes, with an unused entry for block 0.
+ * @param blocks Number of data blocks.
+ */
+size_t checksum_bytes(off_t blocks) {
+    return (size_t) (blocks + 1) * sizeof(uint32_t);
+}
+
+/**
+ * @brief Get the whole of `block` as it is on the host.
+ *
+ * @return `buf`, or a pointer into the data region if it is mapped.
+ * @param block The FAT block number.
+ * @param buf Buffer of `block_size` bytes, which is only filled if the data region isn't mapped.
+ */
+uint8_t* whole_block(int block, uint8_t* buf) {
+    if (data_map) { return data_map + (size_t) (block - 1) * block_size; }
+    cache_read(block, 0, buf, block_size);
+    return buf;
+}
+
+/**
+ * @brief Bring the checksums and dedup index entries of blocks just written up to date.
+ *
+ * The write was of `size` bytes from `buf` at `offset` within `block`, continuing into `block + 1`
+ * and so on, and must have finished. Blocks it covered whole are checksummed from `buf`, and the
+ * others are read back whole, normally from the block cache. The checksum doubles as the hash
+ * the dedup index uses, so only file data is indexed and other blocks are dropped from it,
+ * which keeps metadata from ever being shared, see `find_duplicate`.
+ *
+ * @param block The FAT block number of the first block.
+ * @param offset Offset within the first block.
+ * @param buf Buffer which was written.
+ * @param size Number of bytes written.
+ * @param data Is it file data?
+ */
+void checksum_extent(int block, int offset, uint8_t* buf, int size, bool data) {
+    if (checksums == NULL && !dedup) { return; }
+    uint8_t* tmp = NULL;
+    while (size > 0) {
+        int n = block_size - offset < size ? block_size - offset : size;
+        if (dedup && !data) { dedup_remove(block); }
+        uint32_t crc = 0;
+        if (checksums || (dedup && data)) {
+            if (n == block_size) {
+                crc = crc32c(buf, block_size);
+            } else {
+                if (tmp == NULL) { tmp = (uint8_t*) malloc(block_size); }
+                crc = crc32c(whole_block(block, tmp), block_size);
+            }
+        }
+        if (checksums) { checksums[block] = crc; }
+        if (dedup && data) { dedup_add(block, crc); }
+        buf += n;
+        size -= n;
+        block++;
+        offset = 0;
+    }
+    free(tmp);
+}
+
+/**
+ * @brief Check blocks just read against their checksums.
+ *
+ * The read was of `size` bytes into `buf` from `offset` within `block`, continuing into `block + 1`
+ * and so on, and must have finished. Blocks it covered whole are checked from `buf`, and the others
+ * are read whole, normally from the block cache. Unwritten blocks and blocks without a checksum are skipped.
+ * If a block doesn't match throws an `EIO` error.
+ *
+ * @return -1 if a block is corrupt and 0 otherwise.
+ * @param block The FAT block number of the first block.
+ * @param offset Offset within the first block.
+ * @param buf Buffer which was read into.
+ * @param size Number of bytes read.
+ */
+int verify_extent(int block, int offset, uint8_t* buf, int size) {
+    if (checksums == NULL) { return 0; }
+    uint8_t* tmp = NULL;
+    int ret = 0;
+    while (size > 0) {
+        int n = block_size - offset < size ? block_size - offset : size;
+        if (checksums[block] != 0 && !alloc_unwritten(block)) {
+            uint8_t* data = buf;
+            if (n < block_size) {
+                if (tmp == NULL) { tmp = (uint8_t*) malloc(block_size); }
+                data = whole_block(block, tmp);
+            }
+            if (crc32c(data, block_size) != checksums[block]) {
+                __atomic_fetch_add(&checksum_errors, 1, __ATOMIC_RELAXED);
+                errno = EIO;
+                ret = -1;
+            }
+        }
+        buf += n;
+        size -= n;
+        block++;
+        offset = 0;
+    }
+    free(tmp);
+    return ret;
+}
+
+/**
+ * @brief Read `size` bytes at physical `position` in fs_fd through the block cache.
+ *
+ * The range must lie within a single data block.
+ *
+ * @param position Physical offset in fs_fd.
+ * @param buf Buffer to read into.
+ * @param size Number of bytes to read.
+ */
+void read_position(off_t position, void* buf, int size) {
+    cache_read(position_to_block(position), position % block_size, (uint8_t*) buf, size);
+    if (journaled) { journal_overlay(position, buf, size); }
+}
+
+/**
+ * @brief Write `size` bytes at physical `position` in fs_fd through the block cache.
+ *
+ * The range must lie within a single data block.
+ * Used for metadata only, so on a journaled filesystem the write is logged instead.
+ *
+ * @param position Physical offset in fs_fd.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
+ */
+void write_position(off_t position, void* buf, int size) {
+    if (journaled) {
+        journal_log(position, buf, size);
+        return;
+    }
+    if (!aborting) {
+        uint8_t* old = undo_reserve(&slot_undo, &slot_undo_len, &slot_undo_cap, size + 12);
+        int64_t at = position;
+        read_position(position, old, size);
+        memcpy(old + size, &at, 8);
+        memcpy(old + size + 8, &size, 4);
+    }
+    data_dirty = true;
+    cache_write(NULL, position_to_block(position), position % block_size, (uint8_t*) buf, size);
+    checksum_extent(position_to_block(position), position % block_size, (uint8_t*) buf, size, false);
+}
+
+/**
+ * @brief Decode a stored 32-bit FAT entry, stripping `HOLE_FLAG`.
+ *
+ * Also used on the FAT copies of snapshots.
+ *
+ * @return The next block in the chain, `LAST_BLOCK` or `FREE_BLOCK`.
+ * @param entry The entry as stored.
+ */
+uint32_t fat_next(uint32_t entry) {
+    if (entry == LAST_BLOCK || (entry & HOLE_FLAG) == 0) { return entry; }
+    entry &= ~HOLE_FLAG;
+    return entry == HOLE_END ? LAST_BLOCK : entry;
+}
+
+/**
+ * @brief Get FAT entry `block`.
+ *
+ * @return The next block in the chain, `LAST_BLOCK` or `FREE_BLOCK`.
+ * @param block The FAT entry to get.
+ */
+uint32_t get_fat(int block) {
+    if (wide) { return fat_next(((uint32_t*) fat)[block]); }
+    uint16_t value = ((uint16_t*) fat)[block];
+    return value == 0xFFFF ? LAST_BLOCK : value;
+}
+
+/**
+ * @brief Is `block` a hole node, see `HOLE_FLAG`?
+ *
+ * @return True for a hole node, never in the original format.
+ * @param block The FAT block number, not `LAST_BLOCK`.
+ */
+bool is_hole(int block) {
+    if (!wide) { return false; }
+    uint32_t entry = ((uint32_t*) fat)[block];
+    return entry != LAST_BLOCK && (entry & HOLE_FLAG) != 0;
+}
+
+/**
+ * @brief Store `entry` in FAT entry `block` as it is and remember that it needs committing.
+ *
+ * Also keeps the count of links to each block, see `alloc_refs`, up to date,
+ * and records the old entry for `abort_op`.
+ *
+ * @param block The FAT entry to set.
+ * @param entry The entry, with `HOLE_FLAG` for a hole node.
+ */
+void put_fat(int block, uint32_t entry) {
+    void* slot;
+    int size;
+    if (!aborting) {
+        uint32_t undo[2] = { block, wide ? ((uint32_t*) fat)[block] : get_fat(block) };
+        memcpy(undo_reserve(&fat_undo, &fat_undo_len, &fat_undo_cap, sizeof(undo)), undo, sizeof(undo));
+    }
+    alloc_unref(get_fat(block));
+    alloc_ref(fat_next(entry));
+    if (wide) {
+        slot = (uint32_t*) fat + block;
+        size = sizeof(uint32_t);
+        *(uint32_t*) slot = entry;
+    } else {
+        slot = (uint16_t*) fat + block;
+        size = sizeof(uint16_t);
+        *(uint16_t*) slot = entry; // LAST_BLOCK becomes 0xFFFF
+    }
+    if (journaled) {
+        journal_log(fat_offset + (off_t) block * size, slot, size);
+        return;
+    }
+    if (fat_dirty_lo == fat_dirty_hi) {
+        fat_dirty_lo = block;
+        fat_dirty_hi = block + 1;
+    } else if (block < fat_dirty_lo) {
+        fat_dirty_lo = block;
+    } else if (block >= fat_dirty_hi) {
+        fat_dirty_hi = block + 1;
+    }
+}
+
+/**
+ * @brief Set FAT entry `block` to `value` and remember that it needs committing.
+ *
+ * A hole node stays one unless it is freed.
+ *
+ * @param block The FAT entry to set.
+ * @param value The next block in the chain, `LAST_BLOCK` or `FREE_BLOCK`.
+ */
+void set_fat(int block, uint32_t value) {
+    if (value != FREE_BLOCK && is_hole(block)) { value = HOLE_FLAG | (value == LAST_BLOCK ? HOLE_END : value); }
+    put_fat(block, value);
+}
+
+/**
+ * @brief Get the number of logical blocks `block` stands for in its chain.
+ *
+ * @return The length of the run for a hole node, 1 for any other block.
+ * @param block The FAT block number, not `LAST_BLOCK`.
+ */
+int node_blocks(int block) {
+    if (!is_hole(block)) { return 1; }
+    uint32_t count;
+    read_position(block_position(block), &count, sizeof(count));
+    return count;
+}
+
+/**
+ * @brief Set the length of the run hole node `block` stands for.
+ *
+ * @param block The hole node.
+ * @param count Number of logical blocks, at least 1.
+ */
+void set_hole_blocks(int block, int count) {
+    uint32_t n = count;
+    write_position(block_position(block), &n, sizeof(n));
+}
+
+/**
+ * @brief Write a committed journal record to its home location.
+ *
+ * FAT entries are written straight to the host, directory slots through the block cache,
+ * which also brings the checksums of their blocks up to date. Also used to replay the journal.
+ * Consecutive writes are merged into one record, so a record may span several blocks.
+ *
+ * @param position Physical offset in fs_fd.
+ * @param buf Bytes to write.
+ * @param size Number of bytes.
+ */
+void apply_record(off_t position, uint8_t* buf, int size) {
+    if (position >= (off_t) fat_blocks * block_size) {
+        cache_write_range(NULL, position_to_block(position), position % block_size, buf, size);
+        checksum_extent(position_to_block(position), position % block_size, buf, size, false);
+        return;
+    }
+    if (pwrite(fs_fd, buf, size, position) == -1) {
+        cur_errno = ERR_PERM;
+        p_perror("pwrite");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Zero `count` blocks beginning at `block` on the host.
+ *
+ * Punches the range out of the image file so that it reads as zeroes and takes no space
+ * on the host, which leaves holes in sparse files as holes on the host too.
+ * Falls back to having the kernel zero the range and then to writing zeroes.
+ * Cached copies are dropped, the checksums become those of zeroed blocks and the blocks leave the dedup index.
+ *
+ * @param block The first FAT block number.
+ * @param count Number of consecutive blocks.
+ */
+void zero_blocks(int block, int count) {
+    off_t at = block_position(block);
+    off_t size = (off_t) count * block_size;
+    data_dirty = true;
+    for (int i = 0; i < count; i++) {
+        cache_invalidate(block + i);
+        if (checksums) { checksums[block + i] = zero_checksum; }
+        if (dedup) { dedup_remove(block + i); }
+    }
+    if (fallocate(fs_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, size) == 0) { return; }
+    if (fallocate(fs_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, at, size) == 0) { return; }
+    uint8_t* zeroes = (uint8_t*) calloc(block_size, 1);
+    for (int i = 0; i < count; i++) {
+        cache_write(NULL, block + i, 0, zeroes, block_size);
+    }
+    free(zeroes);
+}
+
+/**
+ * @brief Give the host storage of `count` free blocks beginning at `block` back to the host.
+ *
+ * Punches the range out of the image file. Only an optimization, so nothing
+ * happens if the host filesystem can't punch holes. The blocks lose their checksums.
+ *
+ * @param block The first FAT block number.
+ * @param count Number of consecutive blocks.
+ */
+void release_blocks(int block, int count) {
+    for (int i = 0; i < count; i++) {
+        cache_invalidate(block + i);
+        if (checksums) { checksums[block + i] = 0; }
+    }
+    fallocate(fs_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, block_position(block), (off_t) count * block_size);
+}
+
+/**
+ * @brief Write zeroes to `size` bytes at `offset` within `block`.
+ *
+ * @param block The FAT block number.
+ * @param offset Offset within the block.
+ * @param size Number of bytes, at most to the end of the block.
+ */
+void zero_range(int block, int offset, int size) {
+    uint8_t* zeroes = (uint8_t*) calloc(size, 1);
+    cache_write(NULL, block, offset, zeroes, size);
+    checksum_extent(block, offset, zeroes, size, false);
+    free(zeroes);
+    data_dirty = true;
+}
+
+/**
+ * @brief Flush everything written since the last commit to disk.
+ *
+ * Blocks still unwritten are zeroed first so that no committed file can expose stale data.
+ * Data blocks are written with write(2) so a single fdatasync covers them and the FAT pages.
+ * When only the FAT changed just the dirty pages of the mapping are synced.
+ * On a journaled filesystem the logged metadata is committed as one transaction instead,
+ * whose flush also covers the data, and blocks freed by it become available.
+ * Once nothing durable points at them any more, freed blocks are given back to the host.
+ *
+ * @return -1 on failure and 0 on success.
+ */
+int commit() {
+    int ret = 0;
+    alloc_zero_unwritten(zero_blocks);
+    if (journaled && journal_pending()) {
+        ret = journal_commit(apply_record);
+        alloc_commit_frees();
+    } else if (data_dirty) {
+        ret = fdatasync(fs_fd);
+    } else if (fat_dirty_lo != fat_dirty_hi) {
+        // Offsets are from the start of the mapping, which is page aligned
+        long page = sysconf(_SC_PAGESIZE);
+        long entry = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+        long lo = (fat_offset + fat_dirty_lo * entry) / page * page;
+        long hi = fat_offset + fat_dirty_hi * entry;
+        ret = msync((uint8_t*) fat - fat_offset + lo, hi - lo, MS_SYNC);
+    }
+    alloc_release_freed(release_blocks);
+    fat_dirty_lo = fat_dirty_hi = 0;
+    data_dirty = false;
+    pending_ops = 0;
+    time(&last_commit);
+    // What is committed can't be undone any more
+    begin_op();
+    return ret;
+}
+
+/**
+ * @brief Mark the end of a mutating operation and commit it as the durability level requires.
+ *
+ * Strict commits every operation, group commits once `GROUP_COMMIT_OPS` operations are pending
+ * or the oldest is `GROUP_COMMIT_SECONDS` old, and none leaves it to unmount.
+ * Whatever the level, a journal transaction is committed once it fills half the journal.
+ * Does nothing inside `begin_txn` and `end_txn`, which end the whole group as one operation.
+ */
+void end_op() {
+    if (txn_depth > 0) { return; }
+    if (pending_ops == 0) { time(&last_commit); }
+    ++pending_ops;
+    if (durability == DURABILITY_STRICT ||
+        (durability == DURABILITY_GROUP && (
+            pending_ops >= GROUP_COMMIT_OPS || time(NULL) - last_commit >= GROUP_COMMIT_SECONDS
+        )) ||
+        (journaled && journal_pending_bytes() > JOURNAL_SIZE / 2)) {
+        commit();
+    }
+}
+
+/**
+ * @brief Start a group of operations which are committed together, atomically if journaled.
+ *
+ * Groups nest. Every call must be matched by `end_txn`, from the same thread,
+ * which holds `fs_lock` exclusively in between so no other thread's changes join the group.
+ */
+void begin_txn() {
+    hold_fs(true);
+    ++txn_depth;
+}
+
+/**
+ * @brief End a group of operations started by `begin_txn`.
+ *
+ * The outermost call ends the group as a single operation.
+ */
+void end_txn() {
+    if (--txn_depth == 0) { end_op(); }
+    release_fs(NULL);
+}
+
+/**
+ * @brief Forget the contents of `block`, which a failed operation took and `abort_op` gave back.
+ *
+ * @param block The FAT block number.
+ */
+void forget_block(int block) {
+    if (dedup) { dedup_remove(block); }
+}
+
+/**
+ * @brief Undo the changes of an operation which failed part way, so that none of them is committed.
+ *
+ * Metadata writes are dropped from the journal or, without one, their old bytes are written back.
+ * FAT entries get their old values, and blocks taken or freed go back to how they were.
+ * Data written over blocks the file already had stays written.
+ * Between `begin_txn` and `end_txn` every operation of the group so far is undone.
+ * Call it on every failure after the first change, `errno` is kept.
+ *
+ * @return -1, for the failing operation to return.
+ */
+int abort_op() {
+    int saved = errno;
+    aborting = true;
+    int i = slot_undo_len;
+    while (i > 0) {
+        int64_t at;
+        int size;
+        memcpy(&at, slot_undo + i - 12, 8);
+        memcpy(&size, slot_undo + i - 4, 4);
+        i -= 12 + size;
+        write_position(at, slot_undo + i, size);
+    }
+    for (i = fat_undo_len - 8; i >= 0; i -= 8) {
+        uint32_t undo[2];
+        memcpy(undo, fat_undo + i, sizeof(undo));
+        put_fat(undo[0], undo[1]);
+    }
+    if (journaled) { journal_abort_op(); }
+    alloc_abort_op(forget_block);
+    aborting = false;
+    tail_block = op_tail_block;
+    // Cursors and cached entries may have seen the undone changes
+    chain_generation++;
+    dcache_clear();
+    begin_op();
+    errno = saved;
+    return -1;
+}
+
+/**
+ * @brief Read the file metadata in the directory slot at `position`.
+ *
+ * @param position Physical offset of the slot in fs_fd.
+ * @param f Set to the file metadata.
+ */
+void read_slot(off_t position, File* f) {
+    Slot slot;
+    read_position(position, &slot, SLOT_TAIL + sizeof(uint16_t));
+    memcpy(f->name, slot.name, sizeof(f->name));
+    f->size = slot.size;
+    if (wide) {
+        f->first_block = slot.first_block | (uint32_t) slot.first_block_hi << 16;
+    } else {
+        f->first_block = slot.first_block == 0xFFFF ? LAST_BLOCK : slot.first_block;
+    }
+    f->type = slot.type;
+    f->perm = slot.perm;
+    f->mtime = slot.mtime;
+    f->tail = slot.tail;
+}
+
+/**
+ * @brief Write the file metadata of `e` to its directory slot.
+ *
+ * Keeps the directory entry cache coherent with the slot.
+ * The spare bytes of the slot are left alone, except for the high half of the first block and the tail offset.
+ *
+ * @param e The entry to write, `e.position` must be a directory slot.
+ */
+void write_entry(Entry e) {
+    Slot slot;
+    memcpy(slot.name, e.file.name, sizeof(slot.name));
+    slot.size = e.file.size;
+    slot.first_block = e.file.first_block; // LAST_BLOCK becomes 0xFFFF
+    slot.type = e.file.type;
+    slot.perm = e.file.perm;
+    slot.mtime = e.file.mtime;
+    write_position(e.position, &slot, SLOT_LINK);
+    slot.first_block_hi = e.file.first_block >> 16;
+    slot.tail = e.file.tail;
+    if (wide) {
+        write_position(e.position + SLOT_BLOCK_HI, &slot.first_block_hi, 2 * sizeof(uint16_t));
+    } else {
+        write_position(e.position + SLOT_TAIL, &slot.tail, sizeof(uint16_t));
+    }
+    dcache_update(e.position, e.file);
+}
+
+/**
+ * @brief Reserve and return a block to follow `block` in the FAT.
+ *
+ * The block is taken from the free block index rather than found by scanning the FAT,
+ * preferring `block + 1` or the closest free block after it to keep the file contiguous.
+ * If block is nonzero sets `fat[block] = new_block`.
+ * If `zero` is true zeroes out the newly allocated block (directory assumes this!)
+ * Otherwise the block is only marked unwritten: it reads as zeroes, and is zeroed
+ * on disk by the first write to it or at the next commit, whichever comes first.
+ * FAT writes go through set_fat and are committed at the end of the operation.
+ * Throws an error if no space left.
+ *  
+ * @return The new block on success or -1 on failure.
+ * @param block The block to extend a file from or 0 to simply reserve a block.
+ * @param zero Should the block be zeroed right away?
+ */
+int extend_data(int block, bool zero) {
+    int i = alloc_block(block);
+    if (i == 0) {
+        errno = ENOSPC;
+        return 0;
+    }
+    if (block != 0) {
+        set_fat(block, i);
+    }
+    set_fat(i, LAST_BLOCK);
+    if (zero) {
+        zero_range(i, 0, block_size);
+    } else {
+        alloc_mark_unwritten(i);
+    }
+    return i;
+}
+
+/**
+ * @brief Free a single block, returning it to the free block index.
+ *
+ * If journaled the block only becomes available once the freeing is committed.
+ * It leaves the dedup index right away so that nothing new is linked to it.
+ * @param block The FAT block number.
+ */
+void free_block(int block) {
+    set_fat(block, FREE_BLOCK);
+    if (dedup) { dedup_remove(block); }
+    alloc_mark_written(block);
+    if (journaled) {
+        alloc_defer_free(block);
+    } else {
+        alloc_mark_free(block);
+    }
+}
+
+/**
+ * @brief Take a hole node standing for `count` blocks and linking to `next`.
+ *
+ * Nothing links to it yet. Throws an error if no space left.
+ *
+ * @return The hole node on success or 0 on failure.
+ * @param near The block the hole node will follow.
+ * @param count Number of logical blocks in the run, at least 1.
+ * @param next The next block in the chain or `LAST_BLOCK`.
+ */
+int new_hole(int near, int count, uint32_t next) {
+    int hole = alloc_block(near);
+    if (hole == 0) {
+        errno = ENOSPC;
+        return 0;
+    }
+    put_fat(hole, HOLE_FLAG | (next == LAST_BLOCK ? HOLE_END : next));
+    set_hole_blocks(hole, count);
+    return hole;
+}
+
+/**
+ * @brief Give logical block `k` of the run of hole node `hole` a block of its own.
+ *
+ * The new block is unwritten, and what is left of the run on either side stays a hole.
+ * A hole node is never reused for data, since a pending write of its length could land on the data.
+ * Cursors are invalidated when the run no longer starts where it did.
+ * Throws an error if no space left.
+ *
+ * @return The new block on success or 0 on failure.
+ * @param prev The block linking to `hole`. Only needed when `k` is 0, a chain never starts with a hole.
+ * @param hole The hole node.
+ * @param k Logical block within the run.
+ */
+int fill_hole(int prev, int hole, int k) {
+    int count = node_blocks(hole);
+    int block = alloc_block(k > 0 ? hole : prev);
+    if (block == 0) {
+        errno = ENOSPC;
+        return 0;
+    }
+    alloc_mark_unwritten(block);
+    if (k == 0) {
+        chain_generation++;
+        if (count > 1) {
+            set_fat(block, hole);
+            set_hole_blocks(hole, count - 1);
+        } else {
+            uint32_t next = get_fat(hole);
+            free_block(hole);
+            set_fat(block, next);
+        }
+        set_fat(prev, block);
+        return block;
+    }
+    uint32_t next = get_fat(hole);
+    if (k < count - 1) {
+        next = new_hole(block, count - k - 1, next);
+        if (next == 0) { return 0; }
+    }
+    set_fat(block, next);
+    set_fat(hole, block);
+    set_hole_blocks(hole, k);
+    return block;
+}
+
+/**
+ * @brief Make sure the chain beginning at `block` is at least `count` blocks long.
+ *
+ * Missing blocks are reserved as a single physically contiguous run following the
+ * current last block when there is one, and one at a time near it otherwise.
+ * New blocks are marked unwritten rather than zeroed, as they are about to be written.
+ * Throws an error if no space left.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param block The first block of the chain.
+ * @param count The number of blocks the chain should have.
+ */
+int reserve_data(int block, int count) {
+    count -= node_blocks(block);
+    while (get_fat(block) != LAST_BLOCK) {
+        block = get_fat(block);
+        count -= node_blocks(block);
+    }
+    if (count <= 0) { return 0; }
+    int start = alloc_run(block, count);
+    if (start == 0) {
+        for (; count > 0; --count) {
+            block = extend_data(block, false);
+            if (block == 0) { return -1; }
+        }
+        return 0;
+    }
+    for (int i = start; i < start + count; ++i) {
+        set_fat(block, i);
+        set_fat(i, LAST_BLOCK);
+        alloc_mark_unwritten(i);
+        block = i;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get position which is logical offset bytes ahead of input position.
+ *
+ * Terminology: position => physical location in fs_fd, offset => number of logical bytes.
+ * If the end of the current file is reached seek_data extends the file,
+ * so it is only for writers, which hold `fs_lock` exclusively. Readers use walk_data.
+ * Where the chains may hold holes, blocks skipped to reach a position further than a block
+ * past the end become one hole node, so a write far past the end takes O(1) blocks,
+ * and a position inside a hole gets a block of its own, see `fill_hole`.
+ * Input logical offset must be non-negative.
+ * Throws an error if no space left.
+ *  
+ * @return The position which is reached or -1 on failure.
+ * @param position The position to begin from, not inside a hole.
+ * @param offset Logical offset size.
+ */
+off_t seek_data(off_t position, int offset) {
     int block = position / block_size;
-    offset += position % block_size;
+    off_t at = offset + position % block_size;
+    int prev = 0;
     while (1) {
-        if (offset < block_size) {
-            return block * block_size + offset;
+        off_t span = (off_t) node_blocks(block) * block_size;
+        if (at < span) {
+            if (is_hole(block)) {
+                block = fill_hole(prev, block, at / block_size);
+                if (block == 0) { return -1; }
+                at %= block_size;
+            }
+            return (off_t) block * block_size + at;
         }
-        offset -= block_size;
-        if (fat[block] == LAST_BLOCK) {
-            block = extend_data(block);
+        at -= span;
+        prev = block;
+        if (get_fat(block) != LAST_BLOCK) {
+            block = get_fat(block);
+        } else if (sparse && at >= 2 * block_size) {
+            int hole = new_hole(block, at / block_size, LAST_BLOCK);
+            if (hole == 0) { return -1; }
+            set_fat(block, hole);
+            block = extend_data(hole, false);
             if (block == 0) { return -1; }
+            at %= block_size;
+        } else {
+            block = extend_data(block, false);
+            if (block == 0) { return -1; }
+        }
+    }
+}
+
+/**
+ * @brief Like seek_data, but stops at the end of the chain instead of extending it.
+ *
+ * Changes nothing, so it is safe for readers holding `fs_lock` shared.
+ * A position inside a hole has no block, so `HOLE_POSITION` is returned for it instead.
+ *
+ * @return The position which is reached, or the position of `LAST_BLOCK` if the chain ends first,
+ * which read_data reads nothing from.
+ * @param position The position to begin from, not inside a hole.
+ * @param offset Logical offset size.
+ */
+off_t walk_data(off_t position, int offset) {
+    uint32_t block = position / block_size;
+    off_t at = offset + position % block_size;
+    while (block != LAST_BLOCK) {
+        off_t span = (off_t) node_blocks(block) * block_size;
+        if (at < span) { break; }
+        at -= span;
+        block = get_fat(block);
+    }
+    if (block == LAST_BLOCK) { return (off_t) LAST_BLOCK * block_size; }
+    if (is_hole(block)) { return HOLE_POSITION | (off_t) block << 32 | at; }
+    return (off_t) block * block_size + at;
+}
+
+/**
+ * @brief Split a position returned by walk_data into a block and an offset.
+ *
+ * @return The FAT block number, the hole node for a position inside a hole, or `LAST_BLOCK`.
+ * @param position The position.
+ * @param offset Set to the offset within the block, or within the whole run of a hole node.
+ */
+int position_node(off_t position, off_t* offset) {
+    if (position & HOLE_POSITION) {
+        *offset = position & 0xFFFFFFFF;
+        return (position & ~HOLE_POSITION) >> 32;
+    }
+    *offset = position % block_size;
+    return position / block_size;
+}
+
+/**
+ * @brief Get the position of logical `offset` in the file beginning at `first_block`.
+ *
+ * Like seek_data from the start of the file, or walk_data if `extend` is false, but walks
+ * the FAT from `cursor` when it is valid and not past `offset`, so a sequence of forward
+ * accesses costs O(1) each. On success the cursor is moved to the block containing the
+ * returned position, or the hole node whose run does, unless the chain ended first.
+ * Throws an error if no space left.
+ *
+ * @return The position which is reached or -1 on failure.
+ * @param first_block The first block of the file.
+ * @param offset Logical offset from the start of the file.
+ * @param cursor Cursor to start from and update, or NULL.
+ * @param extend Should the chain be extended to reach `offset`? Only for writers.
+ */
+off_t seek_cursor(int first_block, int offset, Cursor* cursor, bool extend) {
+    off_t (*seek)(off_t, int) = extend ? seek_data : walk_data;
+    int index = offset / block_size;
+    if (cursor == NULL) {
+        return seek((off_t) first_block * block_size, offset);
+    }
+    off_t position;
+    // A writer filling the front of a hole needs the block before it
+    if (cursor->generation == chain_generation && cursor->first_block == first_block && cursor->index <= index &&
+        !(extend && is_hole(cursor->block))) {
+        position = seek((off_t) cursor->block * block_size, offset - cursor->index * block_size);
+    } else {
+        position = seek((off_t) first_block * block_size, offset);
+        // Whatever was read ahead may belong to an old chain
+        cursor->ahead = 0;
+    }
+    if (position == -1) { return position; }
+    off_t at;
+    int block = position_node(position, &at);
+    if (block == LAST_BLOCK) { return position; }
+    cursor->first_block = first_block;
+    cursor->index = index - at / block_size;
+    cursor->block = block;
+    cursor->generation = chain_generation;
+    return position;
+}
+
+/**
+ * @brief Write `size` bytes at `offset` within unwritten `block` as a whole block padded with zeroes.
+ *
+ * @param batch The batch to join, or NULL to write now.
+ * @param block The FAT block number.
+ * @param offset Offset within the block.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes, at most to the end of the block.
+ */
+void write_padded(IoBatch* batch, int block, int offset, uint8_t* buf, int size) {
+    uint8_t* padded = (uint8_t*) calloc(block_size, 1);
+    memcpy(padded + offset, buf, size);
+    cache_write(batch, block, 0, padded, block_size);
+    checksum_extent(block, 0, padded, block_size, true);
+    free(padded);
+    alloc_mark_written(block);
+}
+
+/**
+ * @brief Write `size` bytes at `offset` within `block`, continuing into `block + 1` and so on.
+ *
+ * The blocks are no longer unwritten afterwards, so an unwritten block which `buf`
+ * only partly covers is written whole with the rest zeroed.
+ * If the writes join a batch `buf` must stay valid until the batch is finished, and the caller
+ * brings the checksums up to date afterwards, see `checksum_chain`.
+ *
+ * @param batch The batch to join, or NULL to write now.
+ * @param block The FAT block number of the first block.
+ * @param offset Offset within the first block.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
+ */
+void write_extent(IoBatch* batch, int block, int offset, uint8_t* buf, int size) {
+    if (size <= 0) { return; }
+    int n = block_size - offset;
+    if (alloc_unwritten(block) && (offset > 0 || size < n)) {
+        if (n > size) { n = size; }
+        write_padded(batch, block, offset, buf, n);
+        write_extent(batch, block + 1, 0, buf + n, size - n);
+        return;
+    }
+    int last = block + (offset + size - 1) / block_size;
+    int end = (offset + size - 1) % block_size + 1;
+    if (end < block_size && alloc_unwritten(last)) {
+        write_padded(batch, last, 0, buf + size - end, end);
+        size -= end;
+    }
+    for (int b = block; b < block + (offset + size + block_size - 1) / block_size; b++) {
+        alloc_mark_written(b);
+    }
+    cache_write_range(batch, block, offset, buf, size);
+    if (batch == NULL) { checksum_extent(block, offset, buf, size, true); }
+}
+
+/**
+ * @brief Bring checksums up to date after a write of `size` bytes from `buf` at `position`, or check them after a read.
+ *
+ * Walks the chain from `position` like read_data and write_data, see `checksum_extent` and `verify_extent`.
+ *
+ * @return -1 if checking and a block is corrupt and 0 otherwise.
+ * @param position The position the transfer began at.
+ * @param buf Buffer which was transferred.
+ * @param size Number of bytes transferred.
+ * @param verify Check the blocks rather than checksum them?
+ */
+int checksum_chain(off_t position, uint8_t* buf, int size, bool verify) {
+    if (checksums == NULL) { return 0; }
+    off_t offset;
+    int block = position_node(position, &offset);
+    int ret = 0;
+    while (size > 0) {
+        off_t span = (off_t) node_blocks(block) * block_size;
+        int n = span - offset < size ? span - offset : size;
+        if (is_hole(block)) {
+            // Holes have nothing stored to check
+        } else if (verify) {
+            if (verify_extent(block, offset, buf, n) == -1) { ret = -1; }
+        } else {
+            checksum_extent(block, offset, buf, n, true);
+        }
+        buf += n;
+        size -= n;
+        offset = 0;
+        if (size > 0) { block = get_fat(block); }
+    }
+    return ret;
+}
+
+/**
+ * @brief Write `size` data from `buf` beginning at `position`.
+ *
+ * Written in logically contiguous manner beginning at position.
+ * The chain is walked first and each physically contiguous extent is written with one host call,
+ * all of them submitted together as one batch, and waited for without switching out the calling process,
+ * which holds `fs_lock`.
+ * Will extend file if `LAST_BLOCK` is reached, and fills holes on the way.
+ * If `cursor` is not NULL it must hold the block containing `position`,
+ * and is advanced to the block containing the last byte written.
+ * Throws an error if no space left.
+ *  
+ * @return -1 on failure and 0 on success.
+ * @param position The position to begin from.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
+ * @param cursor Cursor to advance, or NULL.
+ */
+int write_data(off_t position, uint8_t* buf, int size, Cursor* cursor) {
+    int block = position / block_size;
+    int offset = position % block_size;
+    data_dirty = true;
+    IoBatch batch;
+    io_batch_init(&batch);
+    // Current extent starts at `offset` in `start` and holds `buf[done]` onwards
+    int start = block;
+    int done = 0;
+    int i = block_size - offset;
+    while (i < size) {
+        int next = get_fat(block);
+        if (next == LAST_BLOCK) {
+            next = extend_data(block, false);
+        } else if (is_hole(next)) {
+            next = fill_hole(block, next, 0);
+        }
+        if (next == 0) {
+            write_extent(&batch, start, offset, &buf[done], i - done);
+            io_finish(&batch);
+            checksum_chain(position, buf, i, false);
+            return -1;
+        }
+        if (next != block + 1) {
+            write_extent(&batch, start, offset, &buf[done], i - done);
+            start = next;
+            offset = 0;
+            done = i;
+        }
+        block = next;
+        if (cursor) {
+            cursor->index++;
+            cursor->block = block;
+            // Filling a hole only moves other cursors
+            cursor->generation = chain_generation;
+        }
+        i += block_size;
+    }
+    write_extent(&batch, start, offset, &buf[done], size - done);
+    io_finish(&batch);
+    checksum_chain(position, buf, size, false);
+    return 0;
+}
+
+/**
+ * @brief Read `size` bytes at `offset` within `block`, continuing into `block + 1` and so on.
+ *
+ * Copies straight from the mapped data region if there is one, otherwise goes through the block cache.
+ * Unwritten blocks read as zeroes without touching either, and so does a hole node's run.
+ * If the reads join a batch `buf` is only filled once the batch is finished, and the caller
+ * checks the blocks against their checksums afterwards, see `checksum_chain`.
+ * Otherwise they are checked here, and if one doesn't match throws an `EIO` error.
+ *
+ * @return -1 if a block is corrupt and 0 otherwise.
+ * @param batch The batch to join, or NULL to read now.
+ * @param block The FAT block number of the first block.
+ * @param offset Offset within the first block, or within the run of a hole node.
+ * @param buf Buffer to read into.
+ * @param size Number of bytes to read.
+ */
+int read_extent(IoBatch* batch, int block, int offset, uint8_t* buf, int size) {
+    if (is_hole(block)) {
+        memset(buf, 0, size);
+        return 0;
+    }
+    int first = block;
+    int first_offset = offset;
+    uint8_t* start = buf;
+    int total = size;
+    while (size > 0) {
+        // Take the run of blocks which are all unwritten or all not
+        bool unwritten = alloc_unwritten(block);
+        int last = block;
+        int n = block_size - offset;
+        while (n < size && alloc_unwritten(last + 1) == unwritten) {
+            last++;
+            n += block_size;
+        }
+        if (n > size) { n = size; }
+        if (unwritten) {
+            memset(buf, 0, n);
+        } else if (data_map) {
+            memcpy(buf, data_map + (size_t) (block - 1) * block_size + offset, n);
         } else {
-            block = fat[block];
+            cache_read_range(batch, block, offset, buf, n);
+        }
+        buf += n;
+        size -= n;
+        block = last + 1;
+        offset = 0;
+    }
+    return batch == NULL ? verify_extent(first, first_offset, start, total) : 0;
+}
+
+/**
+ * @brief Reads `size` bytes into `buf`.
+ *
+ * Read in logically contiguous manner beginning at position.
+ * The chain is walked first and each physically contiguous extent is read with one host call
+ * (cached blocks aside), all of them submitted together as one batch.
+ * They are waited for without switching out the calling process, which holds `fs_lock`.
+ * The blocks read are then checked against their checksums, and if one doesn't match throws an `EIO` error.
+ * If `cursor` is not NULL it must hold the block containing `position`, or the hole node whose run does,
+ * and is advanced to the last block read from.
+ *  
+ * @return Number of bytes read on success and -1 on failure.
+ * @param position The position to begin from.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
+ * @param cursor Cursor to advance, or NULL.
+ */
+int read_data(off_t position, uint8_t* buf, int size, Cursor* cursor) {
+    off_t at;
+    int block = position_node(position, &at);
+    int offset = at;
+    if (block == LAST_BLOCK) { return 0; }
+    IoBatch batch;
+    io_batch_init(&batch);
+    // Current extent starts at `offset` in `start` and fills `buf[done]` onwards
+    int start = block;
+    int done = 0;
+    off_t i = (off_t) node_blocks(block) * block_size - offset;
+    while (i < size) {
+        int next = get_fat(block);
+        if (next == LAST_BLOCK) {
+            size = i;
+            break;
+        }
+        if (next != block + 1 || is_hole(block) || is_hole(next)) {
+            read_extent(&batch, start, offset, &buf[done], i - done);
+            start = next;
+            offset = 0;
+            done = i;
+        }
+        if (cursor) {
+            cursor->index += node_blocks(block);
+            cursor->block = next;
+        }
+        block = next;
+        i += (off_t) node_blocks(block) * block_size;
+    }
+    read_extent(&batch, start, offset, &buf[done], size - done);
+    io_finish(&batch);
+    if (checksum_chain(position, buf, size, true) == -1) { return -1; }
+    return size;
+}
+
+/**
+ * @brief Read ahead of a sequential reader through `cursor`.
+ *
+ * Called after each read. While reads carry on where the previous one stopped the blocks
+ * after the last one read are prefetched into the block cache, `READAHEAD_MIN_BLOCKS` at first
+ * and twice as many each time the reader gets within half a window of the end of what was
+ * read ahead, up to `READAHEAD_MAX_BLOCKS`. A read anywhere else stops readahead until
+ * reads are sequential again. Unwritten blocks and holes are skipped since they read as zeroes anyway,
+ * and nothing is prefetched while the data region is mapped.
+ *
+ * @param offset Logical offset the read began at.
+ * @param size Number of bytes read.
+ * @param file_blocks Number of blocks in the file.
+ * @param cursor The open file's cursor, at the last block read.
+ */
+void read_ahead(int offset, int size, int file_blocks, Cursor* cursor) {
+    bool sequential = offset == cursor->next_offset;
+    cursor->next_offset = offset + size;
+    if (!sequential || data_map != NULL) {
+        cursor->window = 0;
+        cursor->ahead = 0;
+        return;
+    }
+    int index = cursor->index;
+    if (cursor->ahead > index + cursor->window / 2) { return; }
+    cursor->window = cursor->window == 0 ? READAHEAD_MIN_BLOCKS : 2 * cursor->window;
+    if (cursor->window > READAHEAD_MAX_BLOCKS) { cursor->window = READAHEAD_MAX_BLOCKS; }
+    int from = cursor->ahead > index + 1 ? cursor->ahead : index + 1;
+    int to = index + 1 + cursor->window;
+    if (to > file_blocks) { to = file_blocks; }
+    if (from >= to) { return; }
+    cursor->ahead = to;
+    int block = cursor->block;
+    while (block != LAST_BLOCK && index + node_blocks(block) <= from) {
+        index += node_blocks(block);
+        block = get_fat(block);
+    }
+    // Prefetch each physically contiguous run with one call
+    while (index < to && block != LAST_BLOCK) {
+        int start = block;
+        int count = 0;
+        while (index < to && block == start + count && !alloc_unwritten(block) && !is_hole(block)) {
+            block = get_fat(block);
+            index++;
+            count++;
+        }
+        if (count > 0) {
+            cache_prefetch(start, count);
+        } else {
+            index += node_blocks(block);
+            block = get_fat(block);
+        }
+    }
+}
+
+/**
+ * @brief Free data blocks in logically contiguous manner beginning at block.
+ *
+ * Freed blocks are returned to the free block index and all cursors are invalidated.
+ * Freeing stops at a block which other chains still link to, as the rest is shared with a clone.
+ * @param block The block to begin freeing from.
+ */
+void truncate_data(int block) {
+    if (block != LAST_BLOCK) { chain_generation++; }
+    while (block != LAST_BLOCK) {
+        int tmp = block;
+        block = get_fat(block);
+        free_block(tmp);
+        if (alloc_refs(block) > 0) { break; }
+    }
+}
+
+/**
+ * @brief Copy the data of `block` to `copy`, which is unwritten.
+ *
+ * An unwritten block reads as zeroes, so for one the copy is just left unwritten.
+ *
+ * @param block The FAT block number to copy from.
+ * @param copy The FAT block number to copy to.
+ */
+void copy_block(int block, int copy) {
+    if (alloc_unwritten(block)) { return; }
+    uint8_t* buf = (uint8_t*) malloc(block_size);
+    read_extent(NULL, block, 0, buf, block_size);
+    write_extent(NULL, copy, 0, buf, block_size);
+    free(buf);
+}
+
+/**
+ * @brief Make sure a write of `size` bytes at `offset` only changes blocks of the chain beginning at `first_block`.
+ *
+ * A clone links to the chain of the file it was cloned from after its own first block, so past
+ * the first block with more than one link the rest of a chain is shared. Every block from there
+ * up to the last one the write touches is replaced by a copy, the copy of the last linking to
+ * the rest of the shared chain. Blocks the write covers whole are not copied, just left unwritten.
+ * A write reaching past the end of the chain makes the whole chain the file's own, so it can be extended.
+ * Snapshots have FATs of their own, so a block a snapshot holds is only replaced if the write touches it,
+ * and is then dropped from the chain. That may replace the first block too.
+ * Copying invalidates all cursors.
+ * If a block would get too many links throws an `EMLINK` error.
+ * Also throws an error if no space left.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param first_block The first block of the file, which is never shared. Updated if it is replaced.
+ * @param offset Logical offset the write begins at.
+ * @param size Number of bytes to be written.
+ */
+int unshare_data(uint32_t* first_block, int offset, int size) {
+    if ((!alloc_shared() && !alloc_any_pinned()) || *first_block == LAST_BLOCK) { return 0; }
+    int first = offset / block_size;
+    int last = (size > 0 ? offset + size - 1 : offset) / block_size;
+    bool shared = false;
+    bool copied = false;
+    int prev = 0;
+    int block = *first_block;
+    for (int index = 0; index <= last && block != LAST_BLOCK; ) {
+        shared = shared || alloc_refs(block) > 1;
+        int next = get_fat(block);
+        int span = node_blocks(block);
+        if (shared || (index + span > first && alloc_pinned(block))) {
+            if (alloc_refs(next) >= ALLOC_MAX_REFS) { errno = EMLINK; return -1; }
+            // A hole is copied as a hole node of its own, never the first block
+            int copy = is_hole(block) ? new_hole(prev, span, next) : alloc_block(prev != 0 ? prev : block);
+            if (copy == 0) { errno = ENOSPC; return -1; }
+            if (!is_hole(block)) {
+                alloc_mark_unwritten(copy);
+                bool whole = (off_t) index * block_size >= offset && (off_t) (index + 1) * block_size <= offset + size;
+                if (!whole) { copy_block(block, copy); }
+                set_fat(copy, next);
+            }
+            if (prev != 0) {
+                set_fat(prev, copy);
+            } else {
+                *first_block = copy;
+            }
+            // Nothing links to a block only a snapshot still holds
+            if (alloc_refs(block) == 0) { free_block(block); }
+            block = copy;
+            copied = true;
+        }
+        prev = block;
+        block = next;
+        index += span;
+    }
+    if (copied) { chain_generation++; }
+    return 0;
+}
+
+/**
+ * @brief Does the chain from `block` hold blocks `k` to `n - 1` of new data exactly?
+ *
+ * Hashes are compared first, from the dedup index, then the data itself.
+ * Blocks which aren't indexed or which a snapshot holds never match.
+ *
+ * @return True if the chain has the same number of blocks with the same data.
+ * @param block The first block of the chain.
+ * @param buf The new data.
+ * @param last The last block of the new data, padded with zeroes.
+ * @param hashes Hashes of the blocks of the new data.
+ * @param k The first block of the new data to compare.
+ * @param n Number of blocks of new data.
+ * @param budget Chain blocks which may still be looked at, decreased, a match fails once it runs out.
+ */
+bool duplicate_chain(int block, uint8_t* buf, uint8_t* last, uint32_t* hashes, int k, int n, int* budget) {
+    int b = block;
+    for (int i = k; i < n; i++) {
+        if (b == LAST_BLOCK || b == FREE_BLOCK || --*budget < 0) { return false; }
+        if (!dedup_indexed(b) || dedup_hash(b) != hashes[i] || alloc_pinned(b)) { return false; }
+        b = get_fat(b);
+    }
+    if (b != LAST_BLOCK) { return false; }
+    uint8_t* tmp = (uint8_t*) malloc(block_size);
+    bool same = true;
+    b = block;
+    for (int i = k; i < n && same; i++) {
+        uint8_t* want = i == n - 1 ? last : buf + (size_t) i * block_size;
+        same = read_extent(NULL, b, 0, tmp, block_size) == 0 && memcmp(tmp, want, block_size) == 0;
+        b = get_fat(b);
+    }
+    free(tmp);
+    return same;
+}
+
+/**
+ * @brief Find a chain already holding the same data as the end of `buf`, which is to be the whole of a file.
+ *
+ * A file can share the rest of its chain from any block on but its first, as clones do, so each
+ * block from the second on is looked up in the dedup index and the first to begin an identical
+ * chain wins, sharing the most blocks. The chain found must be linked to by at least one FAT entry,
+ * so it is never the start of another file. Looking is given up after `DEDUP_BUDGET` chain blocks per
+ * block of data, which bounds the time spent on data which almost but doesn't quite match.
+ *
+ * @return The first block of the identical chain, or 0 if there is none.
+ * @param buf The new data.
+ * @param size Number of bytes, more than one block.
+ * @param keep Set to the number of bytes before the shared part, which still have to be written.
+ */
+int find_duplicate(uint8_t* buf, int size, int* keep) {
+    int n = (size + block_size - 1) / block_size;
+    uint8_t* last = (uint8_t*) calloc(block_size, 1);
+    memcpy(last, buf + (size_t) (n - 1) * block_size, size - (n - 1) * block_size);
+    uint32_t* hashes = (uint32_t*) malloc(n * sizeof(uint32_t));
+    for (int i = 0; i < n; i++) {
+        hashes[i] = crc32c(i == n - 1 ? last : buf + (size_t) i * block_size, block_size);
+    }
+    int budget = DEDUP_BUDGET * n;
+    int found = 0;
+    for (int k = 1; k < n && found == 0 && budget > 0; k++) {
+        for (int c = dedup_find(hashes[k], 0); c != 0 && found == 0; c = dedup_find(hashes[k], c)) {
+            if (alloc_refs(c) == 0 || alloc_refs(c) >= ALLOC_MAX_REFS) { continue; }
+            if (duplicate_chain(c, buf, last, hashes, k, n, &budget)) {
+                found = c;
+                *keep = k * block_size;
+            }
         }
     }
+    free(last);
+    free(hashes);
+    return found;
 }
 
 /**
- * @brief Write `size` data from `buf` beginning at `position`.
+ * @brief Replace the whole of file `f`'s data with `size` bytes from `buf`, whose end chain `duplicate` holds.
  *
- * Written in logically contiguous manner beginning at position.
- * Will extend file if `LAST_BLOCK` is reached.
+ * The first `keep` bytes are written to a new chain, which is then linked to `duplicate`.
+ * The old chain is only freed after that, since the new data may match blocks on it, and a
+ * block the new chain links to is not freed with the rest.
+ * `f.first_block` and `f.size` are set but not written to the slot.
+ * Throws an error if no space left, in which case nothing has been freed.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param f The file, which must have no packed or compressed data.
+ * @param buf The new data.
+ * @param size Number of bytes.
+ * @param keep Number of bytes before the shared part, a whole number of blocks, see `find_duplicate`.
+ * @param duplicate First block of the chain to share.
+ */
+int write_duplicate(File* f, uint8_t* buf, int size, int keep, int duplicate) {
+    int first = extend_data(0, false);
+    if (first == 0) { return -1; }
+    if (reserve_data(first, keep / block_size) == -1) { return -1; }
+    if (write_data((off_t) first * block_size, buf, keep, NULL) == -1) { return -1; }
+    int last = first;
+    for (int i = 1; i < keep / block_size; i++) { last = get_fat(last); }
+    set_fat(last, duplicate);
+    truncate_data(f->first_block);
+    chain_generation++;
+    f->first_block = first;
+    f->size = size;
+    dedup_shared += (size - keep + block_size - 1) / block_size;
+    return 0;
+}
+
+/**
+ * @brief Pack `size` bytes from `buf` into a tail block as the data of `f`.
+ *
+ * The data goes at the top of the current tail block, or of a new one if it doesn't fit there.
+ * `f.first_block` and `f.tail` are set but not written to the slot.
  * Throws an error if no space left.
- *  
+ *
  * @return -1 on failure and 0 on success.
- * @param position The position to begin from.
+ * @param f The file, which is given the data.
+ * @param buf Buffer to pack from.
+ * @param size Number of bytes, at most `block_size / TAIL_FRACTION`.
+ */
+int pack_tail(File* f, uint8_t* buf, int size) {
+    TailHeader h;
+    if (tail_block != 0) { read_position(block_position(tail_block), &h, sizeof(h)); }
+    if (tail_block == 0 || h.top + size > block_size) {
+        int block = extend_data(0, true);
+        if (block == 0) { return -1; }
+        tail_block = block;
+        h = (TailHeader) { TAIL_MAGIC, 0, sizeof(TailHeader) };
+    }
+    write_extent(NULL, tail_block, h.top, buf, size);
+    f->first_block = tail_block;
+    f->tail = h.top;
+    h.live++;
+    h.top += size;
+    write_position(block_position(tail_block), &h, sizeof(h));
+    return 0;
+}
+
+/**
+ * @brief Drop the packed data of `f` from its tail block, freeing the block if nothing else is in it.
+ *
+ * The space is given back right away when the data is the last in the block.
+ *
+ * @param f A file whose data is packed.
+ */
+void release_tail(File f) {
+    TailHeader h;
+    read_position(block_position(f.first_block), &h, sizeof(h));
+    if (--h.live == 0) {
+        if (f.first_block == tail_block) { tail_block = 0; }
+        truncate_data(f.first_block);
+        return;
+    }
+    if (f.tail + f.size == h.top) { h.top = f.tail; }
+    write_position(block_position(f.first_block), &h, sizeof(h));
+}
+
+/**
+ * @brief Write `size` bytes from `buf` at `offset` in a file which is packed or empty.
+ *
+ * The file stays packed while it is at most `block_size / TAIL_FRACTION` bytes. Its data is
+ * overwritten in place, and grows in place while it is the last in its tail block; otherwise,
+ * or if a snapshot holds its tail block, it is packed again as a whole. A file outgrowing the limit gets a block of its own holding
+ * its old data, and the write is left to the caller. `f.size` is not updated.
+ * Throws an error if no space left.
+ *
+ * @return 1 if the data was written, 0 if the caller still has to write it and -1 on failure.
+ * @param f The file, its `first_block` and `tail` are updated.
+ * @param offset Logical offset to begin writing into the file from.
  * @param buf Buffer to write from.
  * @param size Number of bytes to write.
  */
-int write_data(int position, uint8_t* buf, int size) {
-    int block = position / block_size;
-    int offset = position % block_size;
-    int i = 0;
-    while (1) {
-        lseek(fs_fd, (block + fat_blocks - 1) * block_size + offset, SEEK_SET);
-        if (size - i <= block_size - offset) {
-            if (write(fs_fd, &buf[i], size - i) == -1) {
-                cur_errno = ERR_PERM;
-                p_perror("write");
-                exit(EXIT_FAILURE);
+int write_tail(File* f, int offset, uint8_t* buf, int size) {
+    int old_size = f->tail != 0 ? (int) f->size : 0;
+    int new_size = offset + size > old_size ? offset + size : old_size;
+    if (new_size > block_size / TAIL_FRACTION) {
+        if (f->tail == 0) { return 0; }
+        int block = extend_data(0, false);
+        if (block == 0) { return -1; }
+        uint8_t* data = (uint8_t*) malloc(old_size);
+        read_extent(NULL, f->first_block, f->tail, data, old_size);
+        write_extent(NULL, block, 0, data, old_size);
+        free(data);
+        release_tail(*f);
+        f->first_block = block;
+        f->tail = 0;
+        return 0;
+    }
+    if (f->tail != 0) {
+        TailHeader h;
+        read_position(block_position(f->first_block), &h, sizeof(h));
+        bool last = f->tail + old_size == h.top;
+        bool in_place = new_size == old_size || (last && f->tail + new_size <= block_size);
+        if (in_place && !alloc_pinned(f->first_block)) {
+            if (offset > old_size) { zero_range(f->first_block, f->tail + old_size, offset - old_size); }
+            write_extent(NULL, f->first_block, f->tail + offset, buf, size);
+            if (last && new_size > old_size) {
+                h.top = f->tail + new_size;
+                write_position(block_position(f->first_block), &h, sizeof(h));
             }
-            fsync(fs_fd);
-            return 0;
-        }
-        if (write(fs_fd, &buf[i], block_size - offset) == -1) {
-            cur_errno = ERR_PERM;
-            p_perror("write");
-            exit(EXIT_FAILURE);
-        }
-        i += block_size - offset;
-        offset = 0;
-        if (fat[block] != LAST_BLOCK) {
-            block = fat[block];
-        } else {
-            block = extend_data(block);
-            if (block == 0) { return -1; }
+            return 1;
         }
     }
+    uint8_t* data = (uint8_t*) calloc(new_size, 1);
+    if (f->tail != 0) { read_extent(NULL, f->first_block, f->tail, data, old_size); }
+    memcpy(data + offset, buf, size);
+    File old = *f;
+    int ret = pack_tail(f, data, new_size);
+    free(data);
+    if (ret == -1) { return -1; }
+    if (old.tail != 0) { release_tail(old); }
+    return 1;
 }
 
 /**
- * @brief Reads `size` bytes into `buf`.
+ * @brief Read `size` bytes at logical `offset` in the chain beginning at `first_block`.
  *
- * Read in logically contiguous manner beginning at position.
- *  
- * @return Number of bytes read on success and -1 on failure.
- * @param position The position to begin from.
+ * Stops at the end of the chain, which is never extended, so readers may call it.
+ * If a block read is corrupt throws an `EIO` error.
+ *
+ * @return -1 on failure and the number of bytes read on success.
+ * @param first_block The first block of the chain.
+ * @param offset Logical offset in the chain.
+ * @param buf Buffer to read into.
+ * @param size Number of bytes to read.
+ */
+int read_chain(int first_block, int offset, void* buf, int size) {
+    return read_data(walk_data((off_t) first_block * block_size, offset), (uint8_t*) buf, size, NULL);
+}
+
+/**
+ * @brief Write `size` bytes at logical `offset` in the chain beginning at `first_block`.
+ *
+ * The chain is extended as needed, and blocks it shares are copied first, see `unshare_data`.
+ * Throws an error if no space left.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param first_block The first block of the chain. Updated if it is replaced.
+ * @param offset Logical offset in the chain.
  * @param buf Buffer to write from.
  * @param size Number of bytes to write.
  */
-int read_data(int position, uint8_t* buf, int size) {
-    int block = position / block_size;
-    int offset = position % block_size;
-    int i = 0;
-    while (block != LAST_BLOCK) {
-        lseek(fs_fd, (block + fat_blocks - 1) * block_size + offset, SEEK_SET);
-        if (size - i <= block_size - offset) {
-            if (read(fs_fd, &buf[i], size - i) == -1) {
-                cur_errno = ERR_PERM;
-                p_perror("read");
-                exit(EXIT_FAILURE);
-            }
-            fsync(fs_fd);
-            return size;
+int write_chain(uint32_t* first_block, int offset, void* buf, int size) {
+    if (unshare_data(first_block, offset, size) == -1) { return -1; }
+    off_t position = seek_data((off_t) *first_block * block_size, offset);
+    if (position == -1) { return -1; }
+    return write_data(position, (uint8_t*) buf, size, NULL);
+}
+
+/**
+ * @brief Cut the chain beginning at `first_block` down to `count` blocks.
+ *
+ * The blocks cut off are freed, other than any which another chain still links to.
+ *
+ * @param first_block The first block of the chain.
+ * @param count The number of logical blocks to keep, at least 1. A hole reaching past them is kept whole.
+ */
+void trim_data(int first_block, int count) {
+    int block = first_block;
+    count -= node_blocks(block);
+    while (count > 0 && get_fat(block) != LAST_BLOCK) {
+        block = get_fat(block);
+        count -= node_blocks(block);
+    }
+    int next = get_fat(block);
+    if (next == LAST_BLOCK) { return; }
+    set_fat(block, LAST_BLOCK);
+    if (alloc_refs(next) == 0) { truncate_data(next); }
+}
+
+/**
+ * @brief Decompress the cluster of a compressed file with table entry `c` into `buf`.
+ *
+ * Bytes past the end of the cluster's data read as zeroes.
+ * If the data is corrupt throws an `EIO` error.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param first_block The first block of the file.
+ * @param c The cluster's entry in the cluster table.
+ * @param buf Buffer of `CLUSTER_SIZE` bytes to decompress into.
+ */
+int read_cluster(int first_block, Cluster c, uint8_t* buf) {
+    memset(buf, 0, CLUSTER_SIZE);
+    if (c.offset == 0) { return 0; }
+    if (c.length > CLUSTER_SIZE) { errno = EIO; return -1; }
+    if (c.raw) {
+        if (read_chain(first_block, c.offset, buf, c.length) == (int) c.length) { return 0; }
+        errno = EIO;
+        return -1;
+    }
+    uint8_t* data = (uint8_t*) malloc(c.length);
+    int n = read_chain(first_block, c.offset, data, c.length);
+    n = n == (int) c.length ? lz_decompress(data, c.length, buf, CLUSTER_SIZE) : -1;
+    free(data);
+    if (n == -1) { errno = EIO; return -1; }
+    return 0;
+}
+
+/**
+ * @brief Rewrite the chain of compressed file `f` with a cluster table of `entries` entries and no dead space.
+ *
+ * The data of the first `clusters` clusters is kept, and blocks the chain no longer needs are freed.
+ * An empty file is given a chain holding just the header and the table.
+ * Throws an error if no space left.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param f The file, its `first_block` is updated.
+ * @param clusters Number of clusters holding data, at most the number of entries in the current table.
+ * @param entries Number of entries in the new table.
+ */
+int pack_clusters(File* f, int clusters, int entries) {
+    Cluster* table = (Cluster*) calloc(entries, sizeof(Cluster));
+    if (f->first_block == LAST_BLOCK) {
+        int block = extend_data(0, false);
+        if (block == 0) { free(table); return -1; }
+        f->first_block = block;
+        clusters = 0;
+    }
+    if (clusters > 0) { read_chain(f->first_block, sizeof(CompressHeader), table, clusters * sizeof(Cluster)); }
+    CompressHeader h = { COMPRESS_MAGIC, entries, sizeof(CompressHeader) + entries * sizeof(Cluster), 0 };
+    int size = h.end;
+    for (int i = 0; i < clusters; i++) { size += table[i].length; }
+    // The data is gathered in table order, which drops the dead space between
+    uint8_t* image = (uint8_t*) malloc(size);
+    for (int i = 0; i < clusters; i++) {
+        if (table[i].offset == 0) { continue; }
+        read_chain(f->first_block, table[i].offset, image + h.end, table[i].length);
+        table[i].offset = h.end;
+        h.end += table[i].length;
+    }
+    memcpy(image, &h, sizeof(h));
+    memcpy(image + sizeof(h), table, entries * sizeof(Cluster));
+    int ret = write_chain(&f->first_block, 0, image, h.end);
+    free(image);
+    free(table);
+    if (ret == -1) { return -1; }
+    trim_data(f->first_block, (h.end + block_size - 1) / block_size);
+    return 0;
+}
+
+/**
+ * @brief Store cluster `i` of a compressed file, whose table entry is `c`, from `buf`.
+ *
+ * The data goes where the cluster's old data was if it fits there or that was at the end of the
+ * data area, and at the end of the data area otherwise. A cluster of zeroes gets no data at all.
+ * Throws an error if no space left.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param f The file, its `first_block` is updated if it is replaced.
+ * @param h The file's header, updated but not written.
+ * @param i The cluster number.
+ * @param c The cluster's entry in the cluster table.
+ * @param buf The cluster's data.
+ * @param size Number of bytes in the cluster, at most `CLUSTER_SIZE`.
+ */
+int store_cluster(File* f, CompressHeader* h, int i, Cluster c, uint8_t* buf, int size) {
+    bool last = c.offset != 0 && c.offset + c.length == h->end;
+    Cluster n = { 0, 0, 0 };
+    uint8_t* data = NULL;
+    int zero = 0;
+    while (zero < size && buf[zero] == 0) { zero++; }
+    if (zero < size) {
+        // Data which doesn't shrink by compressing is stored as is
+        data = (uint8_t*) malloc(size);
+        n.length = lz_compress(buf, size, data, size - 1);
+        if (n.length == 0) {
+            memcpy(data, buf, size);
+            n.length = size;
+            n.raw = 1;
         }
-        if (read(fs_fd, &buf[i], block_size - offset) == -1) {
-            cur_errno = ERR_PERM;
-            p_perror("read");
-            exit(EXIT_FAILURE);
+    }
+    if (c.offset != 0 && n.length > 0 && (n.length <= c.length || last)) {
+        n.offset = c.offset;
+    } else if (n.length > 0) {
+        n.offset = h->end;
+    }
+    // Account for the space the old data leaves behind
+    if (last && (n.offset == c.offset || n.length == 0)) {
+        h->end = c.offset;
+    } else if (c.offset != 0) {
+        h->dead += n.offset == c.offset ? c.length - n.length : c.length;
+    }
+    int ret = 0;
+    if (n.length > 0) {
+        ret = write_chain(&f->first_block, n.offset, data, n.length);
+        if (n.offset == h->end) { h->end += n.length; }
+    }
+    free(data);
+    if (ret == -1) { return -1; }
+    return write_chain(&f->first_block, sizeof(CompressHeader) + i * sizeof(Cluster), &n, sizeof(n));
+}
+
+/**
+ * @brief Read `size` bytes at `offset` in compressed file `f` into `buf`, stopping at the end of the file.
+ *
+ * Only the clusters the read touches are decompressed.
+ * If the data is corrupt throws an `EIO` error.
+ *
+ * @return The number of bytes read on success and -1 on failure.
+ * @param f The file.
+ * @param offset Logical offset to begin reading from.
+ * @param buf Buffer to read into.
+ * @param size Number of bytes to read.
+ */
+int read_compressed(File f, int offset, uint8_t* buf, int size) {
+    if (offset >= (int) f.size || size <= 0) { return 0; }
+    if (size > (int) f.size - offset) { size = f.size - offset; }
+    CompressHeader h;
+    int first = offset / CLUSTER_SIZE;
+    int last = (offset + size - 1) / CLUSTER_SIZE;
+    if (read_chain(f.first_block, 0, &h, sizeof(h)) != sizeof(h) || h.magic != COMPRESS_MAGIC || (int) h.entries <= last) { errno = EIO; return -1; }
+    int table_size = (last - first + 1) * sizeof(Cluster);
+    Cluster* table = (Cluster*) malloc(table_size);
+    if (read_chain(f.first_block, sizeof(h) + first * sizeof(Cluster), table, table_size) != table_size) {
+        free(table);
+        errno = EIO;
+        return -1;
+    }
+    uint8_t* data = (uint8_t*) malloc(CLUSTER_SIZE);
+    int done = 0;
+    for (int i = first; i <= last; i++) {
+        if (read_cluster(f.first_block, table[i - first], data) == -1) {
+            done = -1;
+            break;
         }
-        i += block_size - offset;
-        offset = 0;
-        block = fat[block];
+        int at = offset + done - i * CLUSTER_SIZE;
+        int n = CLUSTER_SIZE - at < size - done ? CLUSTER_SIZE - at : size - done;
+        memcpy(buf + done, data + at, n);
+        done += n;
     }
-    return i;
+    free(data);
+    free(table);
+    return done;
 }
 
 /**
- * @brief Free data blocks in logically contiguous manner beginning at block.
+ * @brief Write `size` bytes from `buf` at `offset` in compressed file `f`.
  *
- * @param block The block to begin freeing from.
+ * Each cluster the write touches is compressed again, see `store_cluster`. The table grows to twice
+ * the number of clusters needed when it runs out of entries, and the file is compacted once its dead
+ * space outweighs its live data, see `pack_clusters`. `f.size` is not updated.
+ * If the file's data is corrupt throws an `EIO` error.
+ * Also throws an error if no space left.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param f The file, its `first_block` is updated.
+ * @param offset Logical offset to begin writing into the file from.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
  */
-void truncate_data(int block) {
-    while (block != LAST_BLOCK) {
-        int tmp = block;
-        block = fat[block];
-        fat[tmp] = FREE_BLOCK;
-        fsync(fs_fd);
+int write_compressed(File* f, int offset, uint8_t* buf, int size) {
+    int old_size = f->first_block != LAST_BLOCK ? (int) f->size : 0;
+    int new_size = offset + size > old_size ? offset + size : old_size;
+    if (new_size == 0) { return 0; }
+    int clusters = (old_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int needed = (new_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    CompressHeader h;
+    if (f->first_block != LAST_BLOCK) {
+        read_chain(f->first_block, 0, &h, sizeof(h));
+        if (h.magic != COMPRESS_MAGIC || (int) h.entries < clusters) { errno = EIO; return -1; }
+    }
+    if (f->first_block == LAST_BLOCK || (int) h.entries < needed) {
+        int entries = 2 * needed > CLUSTER_MIN_ENTRIES ? 2 * needed : CLUSTER_MIN_ENTRIES;
+        if (pack_clusters(f, clusters, entries) == -1) { return -1; }
+        read_chain(f->first_block, 0, &h, sizeof(h));
+    }
+    uint8_t* data = (uint8_t*) malloc(CLUSTER_SIZE);
+    int ret = 0;
+    for (int i = offset / CLUSTER_SIZE; ret == 0 && size > 0 && i <= (offset + size - 1) / CLUSTER_SIZE; i++) {
+        int start = i * CLUSTER_SIZE;
+        int lo = offset > start ? offset - start : 0;
+        int hi = offset + size < start + CLUSTER_SIZE ? offset + size - start : CLUSTER_SIZE;
+        int old_length = old_size - start < CLUSTER_SIZE ? old_size - start : CLUSTER_SIZE;
+        int length = new_size - start < CLUSTER_SIZE ? new_size - start : CLUSTER_SIZE;
+        Cluster c;
+        read_chain(f->first_block, sizeof(h) + i * sizeof(Cluster), &c, sizeof(c));
+        // Old data is only needed if the write doesn't cover it all
+        if (old_length > 0 && (lo > 0 || hi < old_length)) {
+            ret = read_cluster(f->first_block, c, data);
+        } else {
+            memset(data, 0, CLUSTER_SIZE);
+        }
+        if (ret == 0) {
+            memcpy(data + lo, buf + start + lo - offset, hi - lo);
+            ret = store_cluster(f, &h, i, c, data, length);
+        }
     }
+    free(data);
+    if (ret == 0) { ret = write_chain(&f->first_block, 0, &h, sizeof(h)); }
+    if (ret == -1) { return -1; }
+    int live = h.end - sizeof(h) - h.entries * sizeof(Cluster) - h.dead;
+    if (h.dead >= CLUSTER_SIZE && (int) h.dead > live) { return pack_clusters(f, needed, h.entries); }
+    return 0;
 }
 
 /**
@@ -323,68 +2612,330 @@ int space_directory(int block) {
     int count = 0;
     while (1) { 
         for (int i = 0; i < files_per_block; i++) {
-            if (lseek(fs_fd, (block + fat_blocks - 1) * block_size + 64 * i, SEEK_SET) == -1) {
-                cur_errno = ERR_PERM;
-                p_perror("lseek");
-                exit(EXIT_FAILURE);
-            }
-            if (read(fs_fd, &f, sizeof(File)) == -1) {
-                cur_errno = ERR_PERM;
-                p_perror("read");
-                exit(EXIT_FAILURE);
-            }
+            read_slot(block_position(block) + 64 * i, &f);
             ++count;
             if (f.name[0] == EOD_FLAG) { 
                 return count;
             }
         }
-        block = fat[block];
+        block = get_fat(block);
     }
 }
 
 /**
  * @brief Enumerate all file slots in a directory beginning at `block`.
  *
- * File slots include deleted files.
+ * File slots include deleted files.
+ *
+ * @return A sequence of file slots terminated by an EOD file.
+ * @param block The first block containing directory entries.
+ */
+Entry* enum_directory(int block) {
+    File f;
+    Entry* entries = malloc(space_directory(block) * sizeof(Entry));
+    int files_per_block = block_size / 64;
+    int count = 0;
+    while (1) { 
+        for (int i = 0; i < files_per_block; i++) {
+            read_slot(block_position(block) + 64 * i, &f);
+            entries[count] = (Entry) { f, block_position(block) + 64 * i };
+            if (f.name[0] == EOD_FLAG) { 
+                return entries;
+            }
+            ++count;
+        }
+        block = get_fat(block);
+    }
+}
+
+/**
+ * @brief Hash a file name for a directory index (FNV-1a).
+ *
+ * @return The hash.
+ * @param name Null terminated file name.
+ */
+uint32_t index_hash(char* name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 32 && name[i] != '\0'; i++) {
+        h = (h ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Read the index of the directory beginning at `block`, if it has one.
+ *
+ * @return Physical offset of the index in fs_fd, or 0 if the directory isn't indexed.
+ * @param block The first block containing entries in the directory.
+ * @param ix Set to the index header.
+ */
+off_t index_open(int block, DirIndex* ix) {
+    uint32_t desc[2];
+    read_position(block_position(block) + SLOT_INDEX, desc, sizeof(desc));
+    if (desc[0] != INDEX_MAGIC || desc[1] == 0 || desc[1] > (uint32_t) data_blocks) { return 0; }
+    off_t at = block_position(desc[1]);
+    read_position(at, ix, sizeof(DirIndex));
+    if (ix->magic != INDEX_MAGIC) { return 0; }
+    return at;
+}
+
+/**
+ * @brief Write back the header of the index at `at`.
+ *
+ * @param at Physical offset of the index in fs_fd.
+ * @param ix The index header.
+ */
+void index_save(off_t at, DirIndex* ix) {
+    write_position(at, ix, sizeof(DirIndex));
+}
+
+/**
+ * @brief Read bucket `i` of the index at `at`.
+ *
+ * @return The slot number, `INDEX_TOMBSTONE` or 0 if the bucket is empty.
+ * @param at Physical offset of the index in fs_fd.
+ * @param i The bucket.
+ */
+uint32_t index_bucket(off_t at, uint32_t i) {
+    uint32_t value;
+    read_position(at + sizeof(DirIndex) + 4 * (off_t) i, &value, 4);
+    return value;
+}
+
+/**
+ * @brief Set bucket `i` of the index at `at` to `value`.
+ *
+ * @param at Physical offset of the index in fs_fd.
+ * @param i The bucket.
+ * @param value The slot number, `INDEX_TOMBSTONE` or 0.
+ */
+void index_set_bucket(off_t at, uint32_t i, uint32_t value) {
+    write_position(at + sizeof(DirIndex) + 4 * (off_t) i, &value, 4);
+}
+
+/**
+ * @brief Look up file `name` in the index at `at`.
+ *
+ * @return The entry or an EOD file if it is not found.
+ * @param at Physical offset of the index in fs_fd.
+ * @param ix The index header.
+ * @param name Nonempty file name.
+ */
+Entry index_lookup(off_t at, DirIndex* ix, char* name) {
+    uint32_t mask = ix->buckets - 1;
+    for (uint32_t i = index_hash(name) & mask;; i = (i + 1) & mask) {
+        uint32_t slot = index_bucket(at, i);
+        if (slot == 0) { return eod; }
+        if (slot == INDEX_TOMBSTONE) { continue; }
+        Entry e;
+        e.position = (off_t) slot * 64;
+        read_slot(e.position, &e.file);
+        if (strcmp(e.file.name, name) == 0) { return e; }
+    }
+}
+
+/**
+ * @brief Add the entry for file `name` at `position` to the index at `at`.
+ *
+ * The header is updated but not saved.
+ *
+ * @param at Physical offset of the index in fs_fd.
+ * @param ix The index header.
+ * @param name The file name.
+ * @param position Physical offset of the entry in fs_fd.
+ */
+void index_insert(off_t at, DirIndex* ix, char* name, off_t position) {
+    uint32_t mask = ix->buckets - 1;
+    uint32_t i = index_hash(name) & mask;
+    uint32_t value = index_bucket(at, i);
+    while (value != 0 && value != INDEX_TOMBSTONE) {
+        i = (i + 1) & mask;
+        value = index_bucket(at, i);
+    }
+    if (value == 0) { ix->used++; }
+    ix->live++;
+    index_set_bucket(at, i, position / 64);
+}
+
+/**
+ * @brief Remove the entry for file `name` at `position` from the index at `at`.
+ *
+ * The header is updated but not saved.
+ *
+ * @param at Physical offset of the index in fs_fd.
+ * @param ix The index header.
+ * @param name The file name the entry had when it was added.
+ * @param position Physical offset of the entry in fs_fd.
+ */
+void index_remove(off_t at, DirIndex* ix, char* name, off_t position) {
+    uint32_t mask = ix->buckets - 1;
+    for (uint32_t i = index_hash(name) & mask;; i = (i + 1) & mask) {
+        uint32_t value = index_bucket(at, i);
+        if (value == 0) { return; }
+        if (value == position / 64) {
+            index_set_bucket(at, i, INDEX_TOMBSTONE);
+            ix->live--;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Take a slot for a new entry in an indexed directory.
+ *
+ * Reuses the first deleted slot if there is one and otherwise takes the EOD slot,
+ * extending the directory when that was its last slot.
+ * The header is updated but not saved.
+ * Throws an error if no space left.
+ *
+ * @return Physical offset of the slot in fs_fd or -1 on failure.
+ * @param ix The index header.
+ */
+off_t index_take_slot(DirIndex* ix) {
+    if (ix->free_slot != 0) {
+        off_t position = (off_t) ix->free_slot * 64;
+        File f;
+        read_slot(position, &f);
+        // The chain is only a hint, a slot in use ends it
+        if (f.name[0] == CLEANED_FLAG || f.name[0] == REMOVED_FLAG) {
+            read_position(position + SLOT_LINK, &ix->free_slot, 4);
+            return position;
+        }
+        ix->free_slot = 0;
+    }
+    off_t position = (off_t) ix->eod * 64;
+    int block = position_to_block(position);
+    if ((position % block_size + 64) % block_size == 0) {
+        if (get_fat(block) == LAST_BLOCK && extend_data(block, true) == 0) { return -1; }
+        ix->eod = block_position(get_fat(block)) / 64;
+    } else {
+        ix->eod++;
+    }
+    return position;
+}
+
+/**
+ * @brief Remove the index of the directory beginning at `block`, if it has one, and free its blocks.
+ *
+ * @param block The first block containing entries in the directory.
+ */
+void index_drop(int block) {
+    off_t slot = block_position(block);
+    uint32_t desc[2];
+    read_position(slot + SLOT_INDEX, desc, sizeof(desc));
+    if (desc[0] != INDEX_MAGIC) { return; }
+    if (desc[1] != 0 && desc[1] <= (uint32_t) data_blocks) { truncate_data(desc[1]); }
+    memset(desc, 0, sizeof(desc));
+    write_position(slot + SLOT_INDEX, desc, sizeof(desc));
+}
+
+/**
+ * @brief Build a fresh index for the directory beginning at `block`, replacing any old one.
+ *
+ * The table is sized so that it is at most a quarter full. Its blocks must be
+ * physically contiguous; if no such run is free the directory is left unindexed,
+ * which only makes it slower.
+ *
+ * @return -1 if the directory was left unindexed and 0 on success.
+ * @param block The first block containing entries in the directory.
+ */
+int index_build(int block) {
+    index_drop(block);
+    Entry* entries = enum_directory(block);
+    int count;
+    uint32_t live = 0;
+    for (count = 0; entries[count].file.name[0] != EOD_FLAG; count++) {
+        uint8_t flag = entries[count].file.name[0];
+        if (flag != CLEANED_FLAG && flag != REMOVED_FLAG) { live++; }
+    }
+    uint32_t buckets = 64;
+    while (buckets < 4 * (live + 1)) { buckets *= 2; }
+    int blocks = (sizeof(DirIndex) + 4 * buckets + block_size - 1) / block_size;
+    int start = alloc_run(0, blocks);
+    if (start == 0) {
+        free(entries);
+        return -1;
+    }
+    for (int b = start; b < start + blocks; b++) {
+        if (b != start) { set_fat(b - 1, b); }
+        set_fat(b, LAST_BLOCK);
+    }
+    uint8_t* table = (uint8_t*) calloc(blocks, block_size);
+    DirIndex* ix = (DirIndex*) table;
+    uint32_t* bucket = (uint32_t*) (table + sizeof(DirIndex));
+    *ix = (DirIndex) { INDEX_MAGIC, buckets, live, live, entries[count].position / 64, 0, blocks, 0 };
+    // Walk backwards so the deleted slots end up chained in directory order
+    for (int i = count - 1; i >= 0; i--) {
+        uint8_t flag = entries[i].file.name[0];
+        if (flag == CLEANED_FLAG || flag == REMOVED_FLAG) {
+            write_position(entries[i].position + SLOT_LINK, &ix->free_slot, 4);
+            ix->free_slot = entries[i].position / 64;
+            continue;
+        }
+        uint32_t j = index_hash(entries[i].file.name) & (buckets - 1);
+        while (bucket[j] != 0) { j = (j + 1) & (buckets - 1); }
+        bucket[j] = entries[i].position / 64;
+    }
+    for (int b = 0; b < blocks; b++) {
+        write_position(block_position(start + b), table + b * block_size, block_size);
+    }
+    free(table);
+    free(entries);
+    uint32_t desc[2] = { INDEX_MAGIC, start };
+    write_position(block_position(block) + SLOT_INDEX, desc, sizeof(desc));
+    return 0;
+}
+
+// Declare here because find_file and find_directory call each other
+Entry find_directory(PathView dir);
+
+Entry find_name(PathView name, int block, int skip_flag);
+
+/**
+ * @brief Scan the directory beginning at `block` for file `name`.
+ *
+ * If name is empty we return the first deleted or EOD entry we encounter.
+ * If name is nonempty we search for a file with the given name,
+ * using the directory's index instead of reading every slot if it has one.
+ * Links are not followed. Found files are added to the directory entry cache.
  *
- * @return A sequence of file slots terminated by an EOD file.
- * @param block The first block containing directory entries.
+ * @return The requested file or an EOD file if it is not found.
+ * @param name The name of the file.
+ * @param block The first block containing entries in the directory to search.
  */
-Entry* enum_directory(int block) {
-    File f;
-    Entry* entries = malloc(space_directory(block) * sizeof(Entry));
-    int files_per_block = block_size / 64;
-    int count = 0;
-    while (1) { 
-        for (int i = 0; i < files_per_block; i++) {
-            if (lseek(fs_fd, (block + fat_blocks - 1) * block_size + 64 * i, SEEK_SET) == -1) {
-                cur_errno = ERR_PERM;
-                p_perror("lseek");
-                exit(EXIT_FAILURE);
-            }
-            if (read(fs_fd, &f, sizeof(File)) == -1) {
-                cur_errno = ERR_PERM;
-                p_perror("read");
-                exit(EXIT_FAILURE);
-            }
-            entries[count] = (Entry) { f, (block + fat_blocks - 1) * block_size + 64 * i };
-            if (f.name[0] == EOD_FLAG) { 
-                return entries;
-            }
-            ++count;
+Entry scan_directory(char* name, int block) {
+    DirIndex ix;
+    off_t at;
+    if (name[0] != EOD_FLAG && (at = index_open(block, &ix)) != 0) {
+        Entry e = index_lookup(at, &ix, name);
+        if (e.file.name[0] != EOD_FLAG) {
+            dcache_insert(block, e.file, e.position);
+        }
+        return e;
+    }
+    Entry* entries = enum_directory(block);
+    int i;
+    for (i = 0; entries[i].file.name[0] != EOD_FLAG; ++i) {
+        if (name[0] == EOD_FLAG && (
+            entries[i].file.name[0] == CLEANED_FLAG ||
+            entries[i].file.name[0] == REMOVED_FLAG
+        )) { break; }
+        if (name[0] != EOD_FLAG && strcmp(entries[i].file.name, name) == 0) {
+            dcache_insert(block, entries[i].file, entries[i].position);
+            break;
         }
-        block = fat[block];
     }
+    Entry e = entries[i];
+    free(entries);
+    return e;
 }
 
-// Declare here because find_file and find_directory call each other
-Entry find_directory(char** dir);
-
 /**
  * @brief Find file `name` in directory beginning at `block`.
  *
  * If name is empty we return the first deleted or EOD entry we encounter.
- * If name is nonempty we search for a file with the given name.
+ * If name is nonempty we search for a file with the given name,
+ * first in the directory entry cache and then in the directory itself.
  * Returns an EOD file if the file is not found.
  * If `skip_flag` is `SKIP_ALL` we recurse upon finding a link file.
  * If `skip_flag` is `SKIP_NONE` we return link files immedaitely.
@@ -397,31 +2948,39 @@ Entry find_directory(char** dir);
  */
 Entry find_file(char* name, int block, int skip_flag) {
     if (name == NULL) { return root; }
-    Entry* entries = enum_directory(block);
-    int i;
-    for (i = 0; entries[i].file.name[0] != EOD_FLAG; ++i) {
-        if (name[0] == EOD_FLAG && (
-            entries[i].file.name[0] == EOD_FLAG ||
-            entries[i].file.name[0] == CLEANED_FLAG ||
-            entries[i].file.name[0] == REMOVED_FLAG
-        )) { return entries[i]; }
-        if (name[0] != EOD_FLAG && strcmp(entries[i].file.name, name) == 0) { 
-            if (entries[i].file.type == LINK_FILE && skip_flag != SKIP_NONE) {
-                char* next_str = (char*) malloc(entries[i].file.size + 1);
-                read_data(block_size * entries[i].file.first_block, (uint8_t*) next_str, entries[i].file.size);
-                next_str[entries[i].file.size] = '\0';
-                Path path = split_path(next_str);
-                Entry d = find_directory(path.dir);
-                if (d.file.name[0] == EOD_FLAG || d.file.type != DIRECTORY_FILE) { return entries[i]; }
-                Entry e = find_file(path.name, d.file.first_block, skip_flag);
-                if (skip_flag == SKIP_ALL || e.file.name[0] != EOD_FLAG) {
-                    entries[i] = e;
-                }
-            }
-            return entries[i]; 
+    Entry entry;
+    if (name[0] == EOD_FLAG || !dcache_lookup(block, name, &entry.file, &entry.position)) {
+        entry = scan_directory(name, block);
+    }
+    if (name[0] != EOD_FLAG && entry.file.name[0] != EOD_FLAG &&
+        entry.file.type == LINK_FILE && skip_flag != SKIP_NONE) {
+        SCRATCH(scratch);
+        char* next_str = (char*) arena_alloc(&scratch, entry.file.size + 1);
+        read_data((off_t) entry.file.first_block * block_size + entry.file.tail, (uint8_t*) next_str, entry.file.size, NULL);
+        next_str[entry.file.size] = '\0';
+        Path path = split_path(next_str);
+        Entry d = find_directory(path.dir);
+        if (d.file.name[0] == EOD_FLAG || d.file.type != DIRECTORY_FILE) { return entry; }
+        Entry e = find_name(path.name, d.file.first_block, skip_flag);
+        if (skip_flag == SKIP_ALL || e.file.name[0] != EOD_FLAG) {
+            entry = e;
         }
     }
-    return entries[i];
+    return entry;
+}
+
+/**
+ * @brief Find the file named by path component `name` in directory beginning at `block`, see `find_file`.
+ *
+ * @return The requested file, `root` if `name` is empty, or an EOD file if it is not found.
+ * @param name The component naming the file.
+ * @param block The first block containing entries in the directory to search.
+ * @param skip_flag A macro indicating how to handle link files.
+ */
+Entry find_name(PathView name, int block, int skip_flag) {
+    if (name.len == 0) { return root; }
+    char buf[NAME_BUFFER];
+    return find_file(name_string(name, buf), block, skip_flag);
 }
 
 /**
@@ -447,11 +3006,12 @@ File init_file(char* name, uint8_t type) {
     // Set other fields
     f.size = 0;
     f.first_block = LAST_BLOCK;
+    f.tail = 0;
     f.type = type;
     f.perm = (type == DIRECTORY_FILE) ? EXECUTE_PERM | READ_PERM | WRITE_PERM : READ_PERM | WRITE_PERM;
     time(&f.mtime);
     if (f.type == DIRECTORY_FILE) {
-        f.first_block = extend_data(0);
+        f.first_block = extend_data(0, true);
         if (f.first_block == 0) { 
             return find_file("", root.file.first_block, SKIP_ALL).file;
         }
@@ -463,68 +3023,290 @@ File init_file(char* name, uint8_t type) {
  * @brief Add file `f` to the directory beginning at `block`.
  *
  * Important invariant: directory is always terminated by an EOD file.
+ * An indexed directory gets the slot and index entry in O(1) expected time, and the
+ * index is rebuilt larger once it is half full. A directory growing to `INDEX_MIN_SLOTS`
+ * slots is given an index.
  * Throws an error if no space left.
  *
  * @return Position of newly added file in fs_fd or -1 on failure.
  * @param f The file to add.
  * @param block The first block containing entries in the directory.
  */
-int add_file(File f, int block) {
+off_t add_file(File f, int block) {
+    int dir_block = block;
+    DirIndex ix;
+    off_t at = index_open(dir_block, &ix);
+    if (at != 0) {
+        Entry e;
+        e.position = index_take_slot(&ix);
+        if (e.position == -1) { return -1; }
+        e.file = f;
+        write_entry(e);
+        if (2 * (ix.used + 1) > ix.buckets) {
+            index_build(dir_block);
+        } else {
+            index_insert(at, &ix, f.name, e.position);
+            index_save(at, &ix);
+        }
+        return e.position;
+    }
     Entry e = find_file("", block, SKIP_ALL);
-    block = e.position / block_size;
+    block = position_to_block(e.position);
     int offset = e.position % block_size;
     // Push if filling last slot of last block
-    if ((offset + 64) % block_size == 0 && fat[block] == LAST_BLOCK) {
-        int b = extend_data(block);
+    bool pushed = false;
+    if ((offset + 64) % block_size == 0 && get_fat(block) == LAST_BLOCK) {
+        int b = extend_data(block, true);
         if (b == 0) { return -1; }
+        pushed = true;
     }
     //printf("writing file %s to %x\n", f.name, e.position);
-    if (lseek(fs_fd, e.position, SEEK_SET) == -1){
-        cur_errno = ERR_PERM;
-        p_perror("lseek");
-        exit(EXIT_FAILURE);
-    }
-    if (write(fs_fd, &f, sizeof(File)) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("write");
-        exit(EXIT_FAILURE);
+    e.file = f;
+    write_entry(e);
+    if (pushed) {
+        int slots = 0;
+        for (int b = dir_block; b != LAST_BLOCK; b = get_fat(b)) {
+            slots += block_size / 64;
+        }
+        if (slots >= INDEX_MIN_SLOTS) { index_build(dir_block); }
     }
-    fsync(fs_fd);
     return e.position;
 }
 
 /**
  * @brief Find entry corresponding to the sequence of nested directories `dir`.
  *
- * If `dir[0] = NULL` this indicates an empty path and we return `root`.
+ * If `dir` has no components this indicates an empty path and we return `root`.
  * Returns immediately on error if can't find entry, entry is not a directory,
  * or entry doesn't have execute permissions.
  * Sets errno appropriately.
  *
  * @return The entry of the directory or an EOD file on error.
- * @param dir A null terminated sequence of nested directories.
+ * @param dir Slash separated nested directories.
  */
-Entry find_directory(char** dir) {
-    if (dir[0] == NULL) { return root; }
-    int block = 1;
-    for (int i = 0;; ++i) {
-        Entry e = find_file(dir[i], block, SKIP_ALL);
+Entry find_directory(PathView dir) {
+    PathView name;
+    if (!next_name(&dir, &name)) { return root; }
+    int block = root.file.first_block;
+    while (true) {
+        Entry e = find_name(name, block, SKIP_ALL);
         if (e.file.name[0] == EOD_FLAG ) { errno = ENOENT; return eod; }
         if (e.file.type != DIRECTORY_FILE) { errno = ENOTDIR; return eod;}
         if ((e.file.perm & EXECUTE_PERM) == 0) { errno = EACCES; return eod; }
-        if (dir[i+1] == NULL) { return e; }
+        if (!next_name(&dir, &name)) { return e; }
         block = e.file.first_block;
     }
 }
 
+/**
+ * @brief Get the snapshot table of the mounted filesystem, which is in the 32-bit format.
+ *
+ * The table fills the superblock's block after the superblock, see `snapshot_slots`.
+ * Unused records have an empty name.
+ *
+ * @return Pointer to the first record in the mapped FAT region.
+ */
+Snapshot* snapshot_table() {
+    return (Snapshot*) ((uint8_t*) fat - fat_offset + SNAPSHOT_TABLE);
+}
+
+/**
+ * @brief Get the number of records in the snapshot table.
+ *
+ * @return How many snapshots the filesystem can hold.
+ */
+int snapshot_slots() {
+    return (block_size - SNAPSHOT_TABLE) / sizeof(Snapshot);
+}
+
+/**
+ * @brief Find the snapshot called `name`.
+ *
+ * @return Its index in the snapshot table or -1 if there is none.
+ * @param name The snapshot name.
+ */
+int find_snapshot(char* name) {
+    Snapshot* table = snapshot_table();
+    for (int i = 0; i < snapshot_slots(); i++) {
+        if (table[i].name[0] != '\0' && strncmp(table[i].name, name, sizeof(table[i].name)) == 0) { return i; }
+    }
+    return -1;
+}
+
+/**
+ * @brief Set record `i` of the snapshot table to `s`.
+ *
+ * Logged like a FAT entry on a journaled filesystem, otherwise the FAT's mapping carries it to the host.
+ *
+ * @param i Index in the snapshot table.
+ * @param s The new record.
+ */
+void write_snapshot(int i, Snapshot s) {
+    memcpy(&snapshot_table()[i], &s, sizeof(s));
+    if (journaled) {
+        journal_log(SNAPSHOT_TABLE + (off_t) i * sizeof(s), &s, sizeof(s));
+        return;
+    }
+    data_dirty = true;
+}
+
+/**
+ * @brief Read the copy of the FAT kept by snapshot `s`.
+ *
+ * @return The FAT, `data_blocks + 1` entries allocated with malloc.
+ * @param s The snapshot.
+ */
+uint32_t* load_snapshot(Snapshot s) {
+    int size = (data_blocks + 1) * sizeof(uint32_t);
+    uint32_t* view = (uint32_t*) malloc(size);
+    if (view == NULL) {
+        cur_errno = ERR_PERM;
+        p_perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    read_data((off_t) s.fat_block * block_size, (uint8_t*) view, size, NULL);
+    return view;
+}
+
+/**
+ * @brief Pin every block used by a snapshot's FAT, see `alloc_pin`.
+ */
+void pin_snapshots() {
+    Snapshot* table = snapshot_table();
+    for (int i = 0; i < snapshot_slots(); i++) {
+        if (table[i].name[0] == '\0') { continue; }
+        uint32_t* view = load_snapshot(table[i]);
+        for (int b = 1; b <= data_blocks; b++) {
+            if (view[b] != FREE_BLOCK) { alloc_pin(b); }
+        }
+        free(view);
+    }
+}
+
+/**
+ * @brief Add the data blocks of every file in the directory beginning at `block`, and below it, to the dedup index.
+ *
+ * Hashes come from the checksum table where it has them, and otherwise the blocks are read.
+ * Unwritten blocks are skipped, and a chain is left once it reaches a block already indexed,
+ * as the rest is shared with a file indexed before.
+ *
+ * @param block The first block containing entries in the directory.
+ * @param buf Buffer of `block_size` bytes to read blocks into.
+ */
+void index_tree(int block, uint8_t* buf) {
+    Entry* entries = enum_directory(block);
+    for (int i = 0; entries[i].file.name[0] != EOD_FLAG; i++) {
+        File f = entries[i].file;
+        if (f.name[0] == CLEANED_FLAG || f.name[0] == REMOVED_FLAG || f.tail != 0) { continue; }
+        if (f.type == DIRECTORY_FILE) {
+            index_tree(f.first_block, buf);
+            continue;
+        }
+        for (uint32_t b = f.first_block; b != LAST_BLOCK && b != FREE_BLOCK; b = get_fat(b)) {
+            if (dedup_indexed(b)) { break; }
+            if (alloc_unwritten(b) || is_hole(b)) { continue; }
+            bool known = checksums && checksums[b] != 0;
+            dedup_add(b, known ? checksums[b] : crc32c(whole_block(b, buf), block_size));
+        }
+    }
+    free(entries);
+}
+
+/**
+ * @brief Build the dedup index of the mounted filesystem from scratch.
+ */
+void build_dedup_index() {
+    dedup_init(data_blocks);
+    uint8_t* buf = (uint8_t*) malloc(block_size);
+    index_tree(root.file.first_block, buf);
+    free(buf);
+}
+
+/**
+ * @brief Turn sharing of identical file blocks on or off.
+ *
+ * While on, every block of file data written is hashed into an in-memory index, and writes
+ * replacing the whole of a file link to identical chains found through it instead of writing
+ * them, see `find_duplicate`. Shared blocks are counted in the FAT link counts clones use, so
+ * they are copied before either file changes them, see `unshare_data`. The index takes about
+ * 16 bytes per data block. It is built when dedup is turned on, and by every mount while it is.
+ * Call with a filesystem mounted. Like durability the setting outlasts an unmount.
+ *
+ * @param on Share identical blocks?
+ */
+void set_dedup(bool on) {
+    EXCLUSIVE_CALL;
+    if (on == dedup) { return; }
+    dedup = on;
+    dedup_shared = 0;
+    if (dedup) {
+        build_dedup_index();
+    } else {
+        dedup_close();
+    }
+}
+
+/**
+ * @brief Count the blocks the directory beginning at `block`, and everything below it, uses.
+ *
+ * @param block The first block containing entries in the directory.
+ * @param seen Blocks already counted once, updated.
+ * @param stats Updated with the blocks found.
+ */
+void count_tree(int block, bool* seen, DedupStats* stats) {
+    for (int b = block; b != LAST_BLOCK; b = get_fat(b)) {
+        stats->referenced++;
+        if (!seen[b]) { stats->stored++; }
+        seen[b] = true;
+    }
+    Entry* entries = enum_directory(block);
+    for (int i = 0; entries[i].file.name[0] != EOD_FLAG; i++) {
+        File f = entries[i].file;
+        if (f.name[0] == CLEANED_FLAG || f.name[0] == REMOVED_FLAG || f.tail != 0) { continue; }
+        if (f.type == DIRECTORY_FILE) {
+            count_tree(f.first_block, seen, stats);
+            continue;
+        }
+        for (uint32_t b = f.first_block; b != LAST_BLOCK && b != FREE_BLOCK; b = get_fat(b)) {
+            stats->referenced++;
+            if (!seen[b]) { stats->stored++; }
+            seen[b] = true;
+        }
+    }
+    free(entries);
+}
+
+/**
+ * @brief Measure how much sharing saves in the mounted filesystem.
+ *
+ * Walks the whole tree, so it costs a pass over the directories and FAT chains.
+ * Blocks shared by clones count as well as those shared by dedup. Packed files are left out
+ * as a tail block holding many of them is never shared.
+ *
+ * @return Whether dedup is on, the size of its index, the blocks it saved writing since mount,
+ * and the blocks the tree's files and directories use counting shared ones once for each user and once in all.
+ */
+DedupStats dedup_usage() {
+    SHARED_CALL;
+    DedupStats stats = { dedup, dedup_count(), dedup_shared, 0, 0 };
+    bool* seen = (bool*) calloc(data_blocks + 1, sizeof(bool));
+    count_tree(root.file.first_block, seen, &stats);
+    free(seen);
+    return stats;
+}
+
 /**
  * @brief Initialize filesystem given by `fs` string with given config information.
  *
  * Set `new_block_size = 2^{8 + new_block_size_config}`.
  * FAT takes up `new_fat_blocks * block_size` bytes.
  * Then `new_fat_entries` is this divided by 2 minus 1 entries (each block pointer is 2 bytes, first slot is config info).
- * Then the data region has size `new_fat_entries * block_size` bytes unless `new_fat_entries >= LAST_BLOCK`
- * in which case we cap the size of the data region as `LAST_BLOCK - 1`.
+ * Then the data region has size `new_fat_entries * block_size` bytes unless `new_fat_entries >= 0xFFFF`
+ * in which case we cap the size of the data region as `0xFFFF - 1` blocks.
+ * With more than 32 FAT blocks the 32-bit format is used instead: a superblock comes first,
+ * block pointers are 4 bytes, and the image is capped at `WIDE_MAX_BYTES`.
+ * An empty journal of `JOURNAL_SIZE` bytes follows the data region, and then a checksum table
+ * of 4 bytes per data block, all 0 as no block has been written yet.
  * Throws an error if fs refers to the currently open filesystem.
  *
  * @return -1 on failure and 0 on success.
@@ -533,6 +3315,7 @@ Entry find_directory(char** dir) {
  * @param new_block_size_config A value representing the block size of the filesystem.
  */
 int init_fs(char* fs, int new_fat_blocks, int new_block_size_config) {
+    EXCLUSIVE_CALL;
     // Check files aren't same
     int new_fs_fd = open(fs, O_RDWR | O_CREAT | O_APPEND | O_SYNC, 0666);
     if (new_fs_fd == -1) {
@@ -549,30 +3332,49 @@ int init_fs(char* fs, int new_fat_blocks, int new_block_size_config) {
     }
     // Compute config
     int new_block_size = 1 << (new_block_size_config + 8);
-    int new_data_blocks = (new_block_size * new_fat_blocks / 2) - 1;
-    if (new_data_blocks >= LAST_BLOCK) { new_data_blocks = LAST_BLOCK - 1; }
-    uint16_t init_vals[2];
-    // Blocks in fat is MSB, block size config is LSB
-    init_vals[0] = (uint16_t)((new_fat_blocks << 8) | new_block_size_config);
-    // Block 1 is first and last block of directory
-    init_vals[1] = LAST_BLOCK;
-    if (write(new_fs_fd, init_vals, 4) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("write");
-        exit(EXIT_FAILURE);
-    }
-    // Set rest of new filesystem to zeroes: seek to end - 1 and then write a byte
-    if (lseek(new_fs_fd, (new_fat_blocks + new_data_blocks) * new_block_size - 1, SEEK_SET) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("lseek");
-        exit(EXIT_FAILURE);
+    off_t new_data_blocks;
+    int new_meta_blocks;
+    if (new_fat_blocks <= 32) {
+        new_data_blocks = (new_block_size * new_fat_blocks / 2) - 1;
+        if (new_data_blocks >= 0xFFFF) { new_data_blocks = 0xFFFF - 1; }
+        new_meta_blocks = new_fat_blocks;
+        uint16_t init_vals[2];
+        // Blocks in fat is MSB, block size config and journal and checksum flags are LSB
+        init_vals[0] = (uint16_t)((new_fat_blocks << 8) | new_block_size_config | JOURNAL_FLAG | CHECKSUM_FLAG);
+        // Block 1 is first and last block of directory
+        init_vals[1] = 0xFFFF;
+        if (pwrite(new_fs_fd, init_vals, 4, 0) == -1) {
+            cur_errno = ERR_PERM;
+            p_perror("pwrite");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        // Too many FAT blocks to count in a byte, so use the 32-bit format
+        new_data_blocks = (off_t) new_block_size * new_fat_blocks / 4 - 1;
+        new_meta_blocks = new_fat_blocks + 1;
+        off_t max = (WIDE_MAX_BYTES - JOURNAL_SIZE) / new_block_size - new_meta_blocks;
+        if (new_data_blocks > max) { new_data_blocks = max; }
+        Superblock sb = {
+            SUPER_MAGIC, SUPER_VERSION, new_block_size_config | JOURNAL_FLAG | CHECKSUM_FLAG, new_fat_blocks, new_data_blocks
+        };
+        uint32_t last = LAST_BLOCK;
+        if (pwrite(new_fs_fd, &sb, sizeof(sb), 0) == -1 ||
+            pwrite(new_fs_fd, &last, sizeof(last), new_block_size + sizeof(uint32_t)) == -1) {
+            cur_errno = ERR_PERM;
+            p_perror("pwrite");
+            exit(EXIT_FAILURE);
+        }
     }
+    // Set rest of new filesystem to zeroes by writing its last byte
+    off_t journal_start = (new_meta_blocks + new_data_blocks) * new_block_size;
+    off_t end = journal_start + JOURNAL_SIZE + checksum_bytes(new_data_blocks);
     uint8_t zero = 0;
-    if (write(new_fs_fd, &zero, 1) == -1) {
+    if (pwrite(new_fs_fd, &zero, 1, end - 1) == -1) {
         cur_errno = ERR_PERM;
-        p_perror("write");
+        p_perror("pwrite");
         exit(EXIT_FAILURE);
     }
+    journal_format(new_fs_fd, journal_start);
     if (close(new_fs_fd) == -1) {
         cur_errno = ERR_PERM;
         p_perror("close");
@@ -585,41 +3387,271 @@ int init_fs(char* fs, int new_fat_blocks, int new_block_size_config) {
  * @brief Mount filesystem given by `fs` string.
  *
  * Fails if the file cannot be opened.
+ * Either format is accepted, images in the 32-bit format start with a superblock.
  * Initializes lots of global variables such as `fat` and the config information.
+ * Starts an empty block cache of `DEFAULT_CACHE_BLOCKS` blocks, see `cache_resize`.
+ * Starts the I/O backend used by `read_data` and `write_data` if it isn't running yet.
+ * Builds the free block index with one pass over the FAT.
+ * Durability is left at its current level, strict unless changed with `set_durability`.
+ * If the filesystem has a journal any transactions left in it by a crash are replayed first.
+ * If it has checksums their table is mapped, older images have none and nothing is verified.
+ * Blocks held by snapshots are pinned so that they are never written.
+ * If dedup is on its index is built, see `set_dedup`.
+ * When called by `mount_snapshot` the image is opened read-only and the journal is left alone.
  *
  * @return -1 on failure and 0 on success.
  * @param fs The name of the file containing the filesystem on the host machine to mount.
  */
 int mount_fs(char* fs) {
-    fs_fd = open(fs, O_RDWR);
+    EXCLUSIVE_CALL;
+    fs_fd = open(fs, read_only ? O_RDONLY : O_RDWR);
     if (fs_fd == -1) { return -1; }
-    uint16_t config;
-    read(fs_fd, &config, sizeof(uint16_t));
-    // MSB (little endian bottom byte) encodes block size
-    block_size = 1 << (8 + (config & 0xFF));
-    // LSB (little endian top byte) encodes number of fat blocks
-    fat_blocks = config >> 8;
-    data_blocks = (block_size * fat_blocks / 2) - 1;
-    if (data_blocks >= LAST_BLOCK) { data_blocks = LAST_BLOCK - 1; }
-    fat = mmap(NULL, fat_blocks * block_size, PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, 0);
+    Superblock sb = { 0 };
+    bool checksummed;
+    if (pread(fs_fd, &sb, sizeof(sb), 0) == -1) {
+        cur_errno = ERR_PERM;
+        p_perror("pread");
+        exit(EXIT_FAILURE);
+    }
+    if (sb.magic == SUPER_MAGIC) {
+        if (sb.version < 2 || sb.version > SUPER_VERSION) {
+            close(fs_fd);
+            errno = EINVAL;
+            return -1;
+        }
+        wide = true;
+        sparse = sb.version >= 3;
+        journaled = (sb.config & JOURNAL_FLAG) != 0;
+        checksummed = (sb.config & CHECKSUM_FLAG) != 0;
+        block_size = 1 << (8 + (sb.config & ~(JOURNAL_FLAG | CHECKSUM_FLAG)));
+        fat_blocks = sb.fat_blocks + 1;
+        fat_offset = block_size;
+        data_blocks = sb.data_blocks;
+    } else {
+        uint16_t config = sb.magic;
+        wide = false;
+        sparse = false;
+        // MSB (little endian bottom byte) encodes block size and whether there is a journal and checksums
+        journaled = (config & JOURNAL_FLAG) != 0;
+        checksummed = (config & CHECKSUM_FLAG) != 0;
+        block_size = 1 << (8 + (config & 0xFF & ~(JOURNAL_FLAG | CHECKSUM_FLAG)));
+        // LSB (little endian top byte) encodes number of fat blocks
+        fat_blocks = config >> 8;
+        fat_offset = 0;
+        data_blocks = (block_size * fat_blocks / 2) - 1;
+        if (data_blocks >= 0xFFFF) { data_blocks = 0xFFFF - 1; }
+    }
+    // Snapshots are committed whole, so a read-only mount needn't replay anything to see them
+    if (read_only) { journaled = false; }
+    checksums = NULL;
+    checksum_errors = 0;
+    if (checksummed) {
+        // The table follows the journal, mapped from the page it begins in
+        off_t at = (off_t) (fat_blocks + data_blocks) * block_size + JOURNAL_SIZE;
+        checksum_offset = at % sysconf(_SC_PAGESIZE);
+        uint8_t* table = mmap(NULL, checksum_offset + checksum_bytes(data_blocks),
+            read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, at - checksum_offset);
+        if (table == MAP_FAILED) {
+            cur_errno = ERR_PERM;
+            p_perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        checksums = (uint32_t*) (table + checksum_offset);
+        uint8_t* zeroes = (uint8_t*) calloc(block_size, 1);
+        zero_checksum = crc32c(zeroes, block_size);
+        free(zeroes);
+    }
+    cache_init(fs_fd, (off_t) (fat_blocks - 1) * block_size, block_size, DEFAULT_CACHE_BLOCKS);
+    io_start(NULL);
+    if (journaled) {
+        journal_open(fs_fd, (off_t) (fat_blocks + data_blocks) * block_size);
+        journal_replay(apply_record);
+    }
+    uint8_t* map = mmap(NULL, (size_t) fat_blocks * block_size, PROT_READ | PROT_WRITE,
+        journaled || read_only ? MAP_PRIVATE : MAP_SHARED, fs_fd, 0);
+    fat = map + fat_offset;
     root = (Entry) { (File) { "root", 0, 1, DIRECTORY_FILE, READ_PERM | WRITE_PERM | EXECUTE_PERM, 0 }, -1 };
+    dcache_clear();
+    tail_block = 0;
+    alloc_init(data_blocks);
+    for (int i = 1; i <= data_blocks; ++i) {
+        if (get_fat(i) != FREE_BLOCK) { alloc_mark_used(i); }
+        alloc_ref(get_fat(i));
+    }
+    if (wide && !read_only) { pin_snapshots(); }
+    dedup_shared = 0;
+    if (dedup) { build_dedup_index(); }
+    fat_dirty_lo = fat_dirty_hi = 0;
+    data_dirty = false;
+    pending_ops = 0;
+    time(&last_commit);
     return 0;
 }
 
 /**
  * @brief Unmount the currently mounted filesystem.
  *
+ * Commits anything not yet on disk first and leaves the journal empty.
+ *
  * @return -1 on failure and 0 on success.
  */
 int unmount_fs() {
+    EXCLUSIVE_CALL;
+    if (commit() == -1) {
+        cur_errno = ERR_PERM;
+        p_perror("fdatasync");
+        exit(EXIT_FAILURE);
+    }
+    if (journaled) {
+        journal_checkpoint();
+        journal_close();
+    }
+    map_data(false);
+    munmap((uint8_t*) fat - fat_offset, (size_t) fat_blocks * block_size);
+    if (checksums) {
+        munmap((uint8_t*) checksums - checksum_offset, checksum_offset + checksum_bytes(data_blocks));
+        checksums = NULL;
+    }
+    cache_close();
+    dcache_clear();
+    alloc_close();
+    dedup_close();
     if (close(fs_fd) == -1) {
         cur_errno = ERR_PERM;
         p_perror("close");
         exit(EXIT_FAILURE);
     }
+    read_only = false;
+    return 0;
+}
+
+/**
+ * @brief Choose when changes are committed to disk.
+ *
+ * Switching to a stricter level commits anything pending right away.
+ *
+ * @param level One of the `DURABILITY_` macros in filesys.h.
+ */
+void set_durability(int level) {
+    EXCLUSIVE_CALL;
+    durability = level;
+    if (durability != DURABILITY_NONE && pending_ops > 0) { commit(); }
+}
+
+/**
+ * @brief Commit every change made so far to disk regardless of durability level.
+ *
+ * @return -1 on failure and 0 on success.
+ */
+int sync_fs() {
+    EXCLUSIVE_CALL;
+    return commit();
+}
+
+/**
+ * @brief Map the data region of the mounted filesystem into memory, or unmap it.
+ *
+ * While mapped, reads copy straight from the mapping instead of going through the block cache
+ * and `borrow_file` can hand out pointers into it.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param on Whether the data region should be mapped.
+ */
+int map_data(bool on) {
+    EXCLUSIVE_CALL;
+    // The mapping starts at the beginning of the file since the data region needn't be page aligned
+    size_t length = (size_t) (fat_blocks + data_blocks) * block_size;
+    if (data_map) {
+        munmap(data_map - (size_t) fat_blocks * block_size, length);
+        data_map = NULL;
+        free(hole_zeroes);
+        hole_zeroes = NULL;
+    }
+    if (!on) { return 0; }
+    uint8_t* map = mmap(NULL, length, PROT_READ, MAP_SHARED, fs_fd, 0);
+    if (map == MAP_FAILED) { return -1; }
+    data_map = map + (size_t) fat_blocks * block_size;
+    hole_zeroes = (uint8_t*) calloc(block_size, 1);
     return 0;
 }
 
+/**
+ * @brief Is the data region of the mounted filesystem mapped?
+ *
+ * @return True if `map_data` mapped it.
+ */
+bool data_mapped() {
+    SHARED_CALL;
+    return data_map != NULL;
+}
+
+/**
+ * @brief Get the size and free space of the mounted filesystem.
+ *
+ * Free space comes from the free block index so no FAT scan is needed.
+ * Host usage counts only the parts of the image actually stored, so holes don't count.
+ *
+ * @return Block size, total data blocks, free data blocks and bytes used on the host.
+ */
+FsStats fs_stats() {
+    SHARED_CALL;
+    struct stat st;
+    if (fstat(fs_fd, &st) == -1) {
+        cur_errno = ERR_PERM;
+        p_perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    return (FsStats) {
+        block_size, data_blocks, alloc_free_count(), (long) st.st_blocks * 512, checksums != NULL,
+        __atomic_load_n(&checksum_errors, __ATOMIC_RELAXED)
+    };
+}
+
+/**
+ * @brief Check every block of the mounted filesystem against its checksum.
+ *
+ * Runs of blocks with checksums are read straight from the host `SCRUB_CHUNK` bytes at a time,
+ * bypassing the block cache so that a scrub neither evicts it nor trusts it.
+ * Blocks without a checksum, either never written or written by an older version, are skipped.
+ * If the filesystem has no checksums throws an `ENOTSUP` error.
+ *
+ * @return -1 on failure and the number of corrupt blocks otherwise.
+ * @param report Called with the FAT block number of each corrupt block, may be NULL.
+ * @param stats Filled in with what was found.
+ */
+int scrub_fs(void (*report)(int block), ScrubStats* stats) {
+    SHARED_CALL;
+    if (checksums == NULL) { errno = ENOTSUP; return -1; }
+    *stats = (ScrubStats) { 0, 0, 0 };
+    int max = SCRUB_CHUNK / block_size > 0 ? SCRUB_CHUNK / block_size : 1;
+    uint8_t* buf = (uint8_t*) malloc((size_t) max * block_size);
+    int b = 1;
+    while (b <= data_blocks) {
+        if (checksums[b] == 0 || alloc_unwritten(b)) {
+            stats->skipped++;
+            b++;
+            continue;
+        }
+        int n = 1;
+        while (n < max && b + n <= data_blocks && checksums[b + n] != 0 && !alloc_unwritten(b + n)) { n++; }
+        if (pread(fs_fd, buf, (size_t) n * block_size, block_position(b)) == -1) {
+            cur_errno = ERR_PERM;
+            p_perror("pread");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            stats->checked++;
+            if (crc32c(buf + (size_t) i * block_size, block_size) == checksums[b + i]) { continue; }
+            stats->bad++;
+            __atomic_fetch_add(&checksum_errors, 1, __ATOMIC_RELAXED);
+            if (report) { report(b + i); }
+        }
+        b += n;
+    }
+    free(buf);
+    return stats->bad;
+}
+
 /**
  * @brief Creates file at `path_str` and type `type` if it doesn't already exist.
  *
@@ -629,20 +3661,24 @@ int unmount_fs() {
  * On success, directory `size` containing file is increased and `mtime` is updated.
  * If the file is not a link and already exists or is a link and points to an existing file throws an `EEXIST` error.
  * If the file is a link and points to a file which doesn't exist that file will be created instead as a regular file.
+ * If a snapshot is mounted throws an `EROFS` error.
  *
  * @return -1 on failure and 0 on success.
  * @param path_str Path to create file at.
  * @param path_str Type of file to create.
  */
 int create_file(char* path_str, uint8_t type) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
     Path path = split_path(path_str);
     Entry d = find_directory(path.dir); // this might not be the directory containing e!
     if (d.file.name[0] == EOD_FLAG) { return -1; }
     if ((d.file.perm & WRITE_PERM) == 0) { errno = EACCES; return -1; }
-    Entry e = find_file(path.name, d.file.first_block, SKIP_TO_LAST);
+    Entry e = find_name(path.name, d.file.first_block, SKIP_TO_LAST);
     if (e.file.type == LINK_FILE) { // followed links and found dead end
-        char* new_name = (char*) malloc(e.file.size + 1);
-        read_data(block_size * e.file.first_block, (uint8_t*) new_name, e.file.size);
+        SCRATCH(scratch);
+        char* new_name = (char*) arena_alloc(&scratch, e.file.size + 1);
+        read_data((off_t) e.file.first_block * block_size + e.file.tail, (uint8_t*) new_name, e.file.size, NULL);
         return create_file(new_name, REGULAR_FILE); // create this file
     } else if (e.file.name[0] != EOD_FLAG) { 
         errno = EEXIST; 
@@ -651,20 +3687,13 @@ int create_file(char* path_str, uint8_t type) {
     d.file.size += 64;
     time(&d.file.mtime);
     if (d.position >= 0) { // not root
-        if (lseek(fs_fd, d.position, SEEK_SET) == -1) {
-            cur_errno = ERR_PERM;
-            p_perror("lseek");
-            exit(EXIT_FAILURE);
-        }
-        if (write(fs_fd, &d.file, sizeof(File)) == -1) {
-            cur_errno = ERR_PERM;
-            p_perror("write");
-            exit(EXIT_FAILURE);
-        }
+        write_entry(d);
     }
-    File f = init_file(path.name, type);
-    if (f.name[0] == EOD_FLAG) { return -1; }
-    if (add_file(f, d.file.first_block) == -1) { return -1; }
+    char name[NAME_BUFFER];
+    File f = init_file(name_string(path.name, name), type);
+    if (f.name[0] == EOD_FLAG) { return abort_op(); }
+    if (add_file(f, d.file.first_block) == -1) { return abort_op(); }
+    end_op();
     return 0;
 }
 
@@ -675,6 +3704,8 @@ int create_file(char* path_str, uint8_t type) {
  * On any permissions error throws `EACCES`. 
  * If `skip_flag` is false and `path_str` leads to a link the link will have its own metadata set.
  * If instead `skip_flag` is true the file pointed to by such a link will be set.
+ * Whether the file is compressed is kept, see `compress_file`.
+ * If a snapshot is mounted throws an `EROFS` error.
  *
  * @return -1 on failure and 0 on success.
  * @param path_str Path to file to set metadata of.
@@ -682,24 +3713,70 @@ int create_file(char* path_str, uint8_t type) {
  * @param skip_flag If the target file is a link, should it be followed?
  */
 int set_file(char* path_str, File f, bool skip_flag) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
     Path path = split_path(path_str);
     Entry d = find_directory(path.dir);
     if (d.file.name[0] == EOD_FLAG) { return -1; }
-    Entry e = find_file(path.name, d.file.first_block, skip_flag ? SKIP_ALL : SKIP_NONE);
+    Entry e = find_name(path.name, d.file.first_block, skip_flag ? SKIP_ALL : SKIP_NONE);
     if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
-    if (lseek(fs_fd, e.position, SEEK_SET) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("lseek");
-        exit(EXIT_FAILURE);
-    }
-    if (write(fs_fd, &f, sizeof(File)) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("write");
-        exit(EXIT_FAILURE);
+    if (strcmp(e.file.name, f.name) != 0) {
+        // A rename has to move the entry in the index of the directory holding it
+        if (find_name(path.name, d.file.first_block, SKIP_NONE).position != e.position) {
+            errno = EINVAL;
+            return -1;
+        }
+        DirIndex ix;
+        off_t at = index_open(d.file.first_block, &ix);
+        if (at != 0) {
+            index_remove(at, &ix, e.file.name, e.position);
+            index_insert(at, &ix, f.name, e.position);
+            index_save(at, &ix);
+        }
     }
+    f.perm = (f.perm & ~COMPRESSED_PERM) | (e.file.perm & COMPRESSED_PERM);
+    e.file = f;
+    write_entry(e);
+    end_op();
     return 0;
 }
 
+/**
+ * @brief Look up the file at `path_str` in the directory entry cache alone, without `fs_lock`.
+ *
+ * A seqlock read of the whole filesystem: the lookup only counts if `fs_seq` was even and
+ * unchanged throughout, so no exclusive call overlapped it. The root, links on the way and
+ * anything not cached are left to the locked lookup, as are errors.
+ *
+ * @return True and fills `f` on success, false if the locked lookup is needed.
+ * @param path_str Path to file to get metadata from.
+ * @param skip_flag If the target file is a link, should it be followed?
+ * @param f Set to the file metadata on success.
+ */
+bool lookup_cached(char* path_str, bool skip_flag, File* f) {
+    if (fs_lock_depth > 0) { return false; }
+    unsigned start = __atomic_load_n(&fs_seq, __ATOMIC_ACQUIRE);
+    if (start & 1) { return false; }
+    PathView rest = { path_str, strlen(path_str) };
+    PathView name;
+    if (!next_name(&rest, &name)) { return false; }
+    int block = __atomic_load_n(&root_block, __ATOMIC_RELAXED);
+    while (true) {
+        off_t position;
+        char buf[NAME_BUFFER];
+        PathView next;
+        bool last = !next_name(&rest, &next);
+        if (!dcache_lookup(block, name_string(name, buf), f, &position)) { return false; }
+        if (f->type == LINK_FILE && (!last || skip_flag)) { return false; }
+        if (last) { break; }
+        if (f->type != DIRECTORY_FILE || (f->perm & EXECUTE_PERM) == 0) { return false; }
+        block = f->first_block;
+        name = next;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&fs_seq, __ATOMIC_RELAXED) == start;
+}
+
 /**
  * @brief Gets file metadata from directory entry at `path_str`.
  *
@@ -713,10 +3790,13 @@ int set_file(char* path_str, File f, bool skip_flag) {
  * @param skip_flag If the target file is a link, should it be followed?
  */
 File get_file(char* path_str, bool skip_flag) {
+    File f;
+    if (lookup_cached(path_str, skip_flag, &f)) { return f; }
+    SHARED_CALL;
     Path path = split_path(path_str);
     Entry d = find_directory(path.dir);
     if (d.file.name[0] == EOD_FLAG) { return d.file; }
-    Entry e = find_file(path.name, d.file.first_block, skip_flag ? SKIP_ALL : SKIP_NONE);
+    Entry e = find_name(path.name, d.file.first_block, skip_flag ? SKIP_ALL : SKIP_NONE);
     if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; }
     return e.file;
 }
@@ -728,24 +3808,134 @@ File get_file(char* path_str, bool skip_flag) {
  * If the file is a directory throws an `EISDIR` error.
  * On any permissions error throws `EACCES`. File needs read permissions.
  * Extends file if offset goes beyond current size.
+ * Compressed files are decompressed as they are read, see `read_compressed`.
+ *
+ * @return The number of bytes read on success and -1 on failure.
+ * @param path_str Path to file to read from.
+ * @param offset Logical offset to begin reading from in the file.
+ * @param buf Buffer to read data into.
+ * @param size Number of bytes to read.
+ */
+int read_file(char* path_str, int offset, uint8_t* buf, int size) {
+    return read_file_cursor(path_str, offset, buf, size, NULL);
+}
+
+/**
+ * @brief Like read_file, but seeks from `cursor` and leaves it where the read stopped.
+ *
+ * Used by open files so that sequential reads don't walk the FAT from the start,
+ * and so that the blocks a sequential reader will want next are read ahead.
  *
  * @return The number of bytes read on success and -1 on failure.
  * @param path_str Path to file to read from.
  * @param offset Logical offset to begin reading from in the file.
  * @param buf Buffer to read data into.
  * @param size Number of bytes to read.
+ * @param cursor The open file's cursor, or NULL.
+ */
+int read_file_cursor(char* path_str, int offset, uint8_t* buf, int size, Cursor* cursor) {
+    SHARED_CALL;
+    Path path = split_path(path_str);
+    Entry d = find_directory(path.dir);
+    if (d.file.name[0] == EOD_FLAG) { return -1; }
+    Entry e = find_name(path.name, d.file.first_block, SKIP_ALL);
+    if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
+    if (e.file.type == DIRECTORY_FILE) { errno = EISDIR; return -1; }
+    if ((e.file.perm & READ_PERM) == 0) { errno = EACCES; return -1; }
+    if (e.file.perm & COMPRESSED_PERM) { return read_compressed(e.file, offset, buf, size); }
+    if (e.file.tail != 0) {
+        // Packed data shares its block with other files, so stop at the end of the file
+        if (offset >= (int) e.file.size) { return 0; }
+        if (size > (int) e.file.size - offset) { size = e.file.size - offset; }
+        if (read_extent(NULL, e.file.first_block, e.file.tail + offset, buf, size) == -1) { return -1; }
+        return size;
+    }
+    // Blocks past the end of the file are never read, nor added
+    if (offset >= (int) e.file.size || size <= 0) { return 0; }
+    if (size > (int) e.file.size - offset) { size = e.file.size - offset; }
+    e.position = seek_cursor(e.file.first_block, offset, cursor, false);
+    int n = read_data(e.position, buf, size, cursor);
+    if (cursor && n > 0) {
+        read_ahead(offset, n, (e.file.size + block_size - 1) / block_size, cursor);
+    }
+    return n;
+}
+
+/**
+ * @brief Get pointers to the data of the file at `path_str` without copying it.
+ *
+ * Fills `extents` with the physically contiguous pieces of the `size` bytes beginning at `offset`,
+ * stopping early at the end of the file or once `max` extents are filled.
+ * The pointers point into the mapped data region and stay valid until the file is
+ * written, truncated or removed, or the data region is unmapped.
+ * If the data region isn't mapped or the file is compressed throws an `ENOTSUP` error.
+ * Otherwise errors are as for read_file.
+ *
+ * @return The number of extents filled on success and -1 on failure.
+ * @param path_str Path to file to borrow from.
+ * @param offset Logical offset to begin from in the file.
+ * @param size Number of bytes wanted.
+ * @param extents Filled with pointers and lengths.
+ * @param max Maximum number of extents to fill.
  */
-int read_file(char* path_str, int offset, uint8_t* buf, int size) {
+int borrow_file(char* path_str, int offset, int size, Extent* extents, int max) {
+    EXCLUSIVE_CALL;
+    if (data_map == NULL) { errno = ENOTSUP; return -1; }
     Path path = split_path(path_str);
     Entry d = find_directory(path.dir);
     if (d.file.name[0] == EOD_FLAG) { return -1; }
-    Entry e = find_file(path.name, d.file.first_block, SKIP_ALL);
+    Entry e = find_name(path.name, d.file.first_block, SKIP_ALL);
     if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
     if (e.file.type == DIRECTORY_FILE) { errno = EISDIR; return -1; }
     if ((e.file.perm & READ_PERM) == 0) { errno = EACCES; return -1; }
-    e.position = seek_data(block_size * e.file.first_block, offset);
-    if (e.position == -1) { return -1; }
-    return read_data(e.position, buf, size);
+    if (e.file.perm & COMPRESSED_PERM) { errno = ENOTSUP; return -1; }
+    if (offset >= (int) e.file.size) { return 0; }
+    if (size > (int) e.file.size - offset) { size = e.file.size - offset; }
+    if (e.file.tail != 0) {
+        if (max < 1) { return 0; }
+        extents[0] = (Extent) { data_map + (size_t) (e.file.first_block - 1) * block_size + e.file.tail + offset, size };
+        return 1;
+    }
+    off_t at;
+    int block = position_node(walk_data((off_t) e.file.first_block * block_size, offset), &at);
+    offset = at;
+    int count = 0;
+    while (size > 0 && count < max && block != LAST_BLOCK) {
+        if (is_hole(block)) {
+            // A hole is lent as zeroes, a block at a time
+            off_t left = (off_t) node_blocks(block) * block_size - offset;
+            while (left > 0 && size > 0 && count < max) {
+                int n = left < block_size ? left : block_size;
+                if (n > size) { n = size; }
+                extents[count++] = (Extent) { hole_zeroes, n };
+                left -= n;
+                size -= n;
+            }
+            block = get_fat(block);
+            offset = 0;
+            continue;
+        }
+        // Grow the extent while the next block follows physically
+        int start = block;
+        int n = block_size - offset;
+        while (n < size && get_fat(block) == block + 1) {
+            block++;
+            n += block_size;
+        }
+        // The mapping would show stale data, so give unwritten blocks their zeroes now
+        for (int b = start; b <= block; b++) {
+            if (alloc_unwritten(b)) {
+                alloc_mark_written(b);
+                zero_blocks(b, 1);
+            }
+        }
+        if (n > size) { n = size; }
+        extents[count++] = (Extent) { data_map + (size_t) (start - 1) * block_size + offset, n };
+        size -= n;
+        block = get_fat(block);
+        offset = 0;
+    }
+    return count;
 }
 
 /**
@@ -754,8 +3944,13 @@ int read_file(char* path_str, int offset, uint8_t* buf, int size) {
  * If the file cannot be located throws an `ENOENT` or `ENOTDIR` error.
  * If the file is a directory throws an `EISDIR` error.
  * On any permissions error throws `EACCES`. File and directory need write permissions.
- * Updates `mtime`, `size`, and possibly `first_block` fields of file metadata.
+ * Updates `mtime`, `size`, and possibly `first_block` and `tail` fields of file metadata.
+ * Small files are packed into tail blocks rather than given blocks of their own, see `write_tail`.
+ * Compressed files are compressed as they are written instead, see `write_compressed`.
+ * With dedup on, a write replacing the whole of a file shares the blocks other files already hold
+ * the same data in rather than writing them, see `find_duplicate`.
  * Also throws an error if no space left.
+ * If a snapshot is mounted throws an `EROFS` error.
  *
  * @return The number of bytes written on success and -1 on failure.
  * @param path_str Path to file to write to.
@@ -765,35 +3960,83 @@ int read_file(char* path_str, int offset, uint8_t* buf, int size) {
  * @param skip_flag If the target file is a link, should it be followed?
  */
 int write_file(char* path_str, int offset, uint8_t* buf, int size, bool skip_flag) {
+    return write_file_cursor(path_str, offset, buf, size, skip_flag, NULL);
+}
+
+/**
+ * @brief Like write_file, but seeks from `cursor` and leaves it where the write stopped.
+ *
+ * Used by open files so that sequential writes don't walk the FAT from the start.
+ *
+ * @return The number of bytes written on success and -1 on failure.
+ * @param path_str Path to file to write to.
+ * @param offset Logical offset to begin writing into the file from.
+ * @param buf Buffer to write data from.
+ * @param size Number of bytes to write.
+ * @param skip_flag If the target file is a link, should it be followed?
+ * @param cursor The open file's cursor, or NULL.
+ */
+int write_file_cursor(char* path_str, int offset, uint8_t* buf, int size, bool skip_flag, Cursor* cursor) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
     Path path = split_path(path_str);
     Entry d = find_directory(path.dir);
     if (d.file.name[0] == EOD_FLAG) { return -1; }
     if ((d.file.perm & WRITE_PERM) == 0) { return -1; }
-    Entry e = find_file(path.name, d.file.first_block, skip_flag ? SKIP_ALL : SKIP_NONE);
+    Entry e = find_name(path.name, d.file.first_block, skip_flag ? SKIP_ALL : SKIP_NONE);
     if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
     if (e.file.type == DIRECTORY_FILE) { errno = EISDIR; return -1; }
     if ((e.file.perm & WRITE_PERM) == 0) { errno = EACCES; return -1; }
+    if (e.file.perm & COMPRESSED_PERM) {
+        if (write_compressed(&e.file, offset, buf, size) == -1) { return abort_op(); }
+        if (offset + size > e.file.size) { e.file.size = offset + size; }
+        time(&e.file.mtime);
+        write_entry(e);
+        end_op();
+        return 0;
+    }
+    if (e.file.tail != 0 || (e.file.size == 0 && size > 0)) {
+        int done = write_tail(&e.file, offset, buf, size);
+        if (done == -1) { return abort_op(); }
+        if (done == 1) {
+            if (offset + size > e.file.size) { e.file.size = offset + size; }
+            time(&e.file.mtime);
+            write_entry(e);
+            end_op();
+            return 0;
+        }
+    }
+    if (dedup && offset == 0 && size >= (int) e.file.size && size > block_size) {
+        int keep;
+        int duplicate = find_duplicate(buf, size, &keep);
+        if (duplicate != 0) {
+            if (write_duplicate(&e.file, buf, size, keep, duplicate) == -1) { return abort_op(); }
+            time(&e.file.mtime);
+            write_entry(e);
+            end_op();
+            return 0;
+        }
+    }
     if (e.file.size == 0 && size > 0) {
-        e.file.first_block = extend_data(0);
-        if (e.file.first_block == 0) { return -1; }
+        e.file.first_block = extend_data(0, false);
+        if (e.file.first_block == 0) { return abort_op(); }
+    }
+    if (unshare_data(&e.file.first_block, offset, size) == -1) { return abort_op(); }
+    // Reserve a contiguous run up front when growing by more than a block, unless a hole will be left
+    int blocks = (e.file.size + block_size - 1) / block_size;
+    int new_blocks = (offset + size + block_size - 1) / block_size;
+    if (size > 0 && new_blocks > blocks + 1 && !(sparse && offset / block_size > blocks + 1)) {
+        if (reserve_data(e.file.first_block, new_blocks) == -1) { return abort_op(); }
     }
     if (offset + size > e.file.size) {
         e.file.size = offset + size;
     }
     time(&e.file.mtime);
-    if (lseek(fs_fd, e.position, SEEK_SET) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("lseek");
-        exit(EXIT_FAILURE);
-    }
-    if (write(fs_fd, &e.file, sizeof(File)) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("write");
-        exit(EXIT_FAILURE);
-    }
-    e.position = seek_data(block_size * e.file.first_block, offset);
-    if (e.position == -1) { return -1; }
-    if (write_data(e.position, buf, size) == -1) { return -1; }
+    write_entry(e);
+    e.position = seek_cursor(e.file.first_block, offset, cursor, true);
+    if (e.position == -1) { return abort_op(); }
+    if (write_data(e.position, buf, size, cursor) == -1) { return abort_op(); }
+    end_op();
     return 0;
 }
 
@@ -801,39 +4044,260 @@ int write_file(char* path_str, int offset, uint8_t* buf, int size, bool skip_fla
  * @brief Set size of file at `path_str` to zero and free all of its allocated blocks.
  *
  * If the file cannot be located throws an `ENOENT` or `ENOTDIR` error.
- * If file is a directory and is non-empty throws an `ENOTEMPTY` error.
+ * If file is a directory and is non-empty throws an `ENOTEMPTY` error,
+ * and if it is empty only its index, if any, is freed.
  * On any permissions error throws `EACCES`. File and directory need write permissions.
  * On success updates `size`, and `first_block` fields of file metadata accordingly.
+ * If a snapshot is mounted throws an `EROFS` error.
  *
  * @return -1 on failure and 0 on success.
  * @param path_str Path to file to truncate.
  * @param skip_flag If the target file is a link, should we follow it?
  */
 int truncate_file(char* path_str, bool skip_flag) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
     Path path = split_path(path_str);
     Entry d = find_directory(path.dir);
     if (d.file.name[0] == EOD_FLAG) { return -1; }
     if ((d.file.perm & WRITE_PERM) == 0) { return -1; }
-    Entry e = find_file(path.name, d.file.first_block, skip_flag ? SKIP_ALL : SKIP_NONE);
+    Entry e = find_name(path.name, d.file.first_block, skip_flag ? SKIP_ALL : SKIP_NONE);
     if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
     if ((e.file.perm & WRITE_PERM) == 0) { errno = EACCES; return -1; }
     if (e.file.type == DIRECTORY_FILE) {
         if (e.file.size > 0) { errno = ENOTEMPTY; return -1; }
+        index_drop(e.file.first_block);
+        end_op();
         return 0;
     }
-    truncate_data(e.file.first_block);
+    if (e.file.tail != 0) {
+        release_tail(e.file);
+    } else {
+        truncate_data(e.file.first_block);
+    }
     e.file.size = 0;
     e.file.first_block = LAST_BLOCK;
-    if (lseek(fs_fd, e.position, SEEK_SET) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("lseek");
-        exit(EXIT_FAILURE);
+    e.file.tail = 0;
+    write_entry(e);
+    end_op();
+    return 0;
+}
+
+/**
+ * @brief Turn `size` bytes at `offset` in the file at `path_str` into a hole which reads as zeroes.
+ *
+ * Whole blocks in the range are punched out of the image so they take no space on the host,
+ * partially covered blocks have just the range zeroed. The blocks stay in the file's chain,
+ * and the range is clipped to the end of the file, whose size doesn't change.
+ * If the file cannot be located throws an `ENOENT` or `ENOTDIR` error.
+ * If the file is a directory throws an `EISDIR` error.
+ * If the file isn't writable throws `EACCES`, and if the range is negative `EINVAL`.
+ * Updates `mtime`.
+ * If a snapshot is mounted throws an `EROFS` error.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param path_str Path to file to punch.
+ * @param offset Logical offset the hole begins at.
+ * @param size Number of bytes in the hole.
+ */
+int punch_file(char* path_str, int offset, int size) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
+    Path path = split_path(path_str);
+    Entry d = find_directory(path.dir);
+    if (d.file.name[0] == EOD_FLAG) { return -1; }
+    Entry e = find_name(path.name, d.file.first_block, SKIP_ALL);
+    if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
+    if (e.file.type == DIRECTORY_FILE) { errno = EISDIR; return -1; }
+    if ((e.file.perm & WRITE_PERM) == 0) { errno = EACCES; return -1; }
+    if (offset < 0 || size < 0) { errno = EINVAL; return -1; }
+    if (size > (int) e.file.size - offset) { size = e.file.size - offset; }
+    if (size <= 0) { return 0; }
+    if (e.file.tail != 0 || (e.file.perm & COMPRESSED_PERM)) {
+        // Packed data shares its block with other files and compressed data has no blocks
+        // of its own either, so both are just overwritten
+        uint8_t* zeroes = (uint8_t*) calloc(size, 1);
+        int ret = e.file.tail != 0 ? write_tail(&e.file, offset, zeroes, size) : write_compressed(&e.file, offset, zeroes, size);
+        free(zeroes);
+        if (ret == -1) { return abort_op(); }
+        time(&e.file.mtime);
+        write_entry(e);
+        end_op();
+        return 0;
     }
-    if (write(fs_fd, &e.file, sizeof(File)) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("write");
-        exit(EXIT_FAILURE);
+    if (unshare_data(&e.file.first_block, offset, size) == -1) { return abort_op(); }
+    off_t at;
+    int block = position_node(walk_data((off_t) e.file.first_block * block_size, offset), &at);
+    // Whole blocks are gathered into physically contiguous runs and punched a run at a time
+    int run = 0;
+    int count = 0;
+    while (size > 0 && block != LAST_BLOCK) {
+        if (is_hole(block)) {
+            // Already reads as zeroes
+            off_t left = (off_t) node_blocks(block) * block_size - at;
+            size -= left < size ? left : size;
+            at = 0;
+            if (size > 0) { block = get_fat(block); }
+            continue;
+        }
+        int n = block_size - at < size ? block_size - at : size;
+        if (n == block_size && count > 0 && block == run + count) {
+            count++;
+        } else {
+            if (count > 0) { zero_blocks(run, count); }
+            count = 0;
+            if (n == block_size) {
+                run = block;
+                count = 1;
+            } else if (!alloc_unwritten(block)) {
+                zero_range(block, at, n);
+            }
+        }
+        // A punched block reads as zeroes from the host, so it needn't be zeroed again at commit
+        if (n == block_size) { alloc_mark_written(block); }
+        size -= n;
+        at = 0;
+        if (size > 0) { block = get_fat(block); }
+    }
+    if (count > 0) { zero_blocks(run, count); }
+    time(&e.file.mtime);
+    write_entry(e);
+    end_op();
+    return 0;
+}
+
+/**
+ * @brief Make the file at `dst_path` a copy of the file at `src_path` which shares its blocks.
+ *
+ * The copy gets a first block of its own which links to the rest of the source's chain, so
+ * cloning costs the same whatever the size of the file. Blocks are only copied once either
+ * file is written, see `unshare_data`. Packed files are small and are just packed again.
+ * The destination is compressed if and only if the source is.
+ * The data `dst_path` had is freed, unless it is the source itself, which is left alone.
+ * If either file cannot be located throws an `ENOENT` or `ENOTDIR` error.
+ * If either file is a directory throws an `EISDIR` error.
+ * The source needs read permissions and the destination write permissions, otherwise throws `EACCES`.
+ * If the source's blocks are shared too many times throws an `EMLINK` error.
+ * Also throws an error if no space left, in which case the destination is left as it was.
+ * Updates `mtime`, `size`, `first_block` and `tail` fields of the destination's metadata.
+ * If a snapshot is mounted throws an `EROFS` error.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param src_path Path to file to clone.
+ * @param dst_path Path to an existing file to make the clone.
+ */
+int clone_file(char* src_path, char* dst_path) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
+    Path path = split_path(src_path);
+    Entry d = find_directory(path.dir);
+    if (d.file.name[0] == EOD_FLAG) { return -1; }
+    Entry src = find_name(path.name, d.file.first_block, SKIP_ALL);
+    if (src.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
+    if (src.file.type == DIRECTORY_FILE) { errno = EISDIR; return -1; }
+    if ((src.file.perm & READ_PERM) == 0) { errno = EACCES; return -1; }
+    path = split_path(dst_path);
+    d = find_directory(path.dir);
+    if (d.file.name[0] == EOD_FLAG) { return -1; }
+    Entry e = find_name(path.name, d.file.first_block, SKIP_ALL);
+    if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
+    if (e.file.type == DIRECTORY_FILE) { errno = EISDIR; return -1; }
+    if ((e.file.perm & WRITE_PERM) == 0) { errno = EACCES; return -1; }
+    if (e.position == src.position) { return 0; }
+    int next = src.file.tail == 0 && src.file.first_block != LAST_BLOCK ? get_fat(src.file.first_block) : LAST_BLOCK;
+    if (alloc_refs(next) >= ALLOC_MAX_REFS) { errno = EMLINK; return -1; }
+    if (e.file.tail != 0) {
+        release_tail(e.file);
+    } else {
+        truncate_data(e.file.first_block);
+    }
+    e.file.size = 0;
+    e.file.first_block = LAST_BLOCK;
+    e.file.tail = 0;
+    e.file.perm = (e.file.perm & ~COMPRESSED_PERM) | (src.file.perm & COMPRESSED_PERM);
+    time(&e.file.mtime);
+    int ret = 0;
+    if (src.file.tail != 0) {
+        uint8_t* data = (uint8_t*) malloc(src.file.size);
+        read_extent(NULL, src.file.first_block, src.file.tail, data, src.file.size);
+        ret = pack_tail(&e.file, data, src.file.size);
+        free(data);
+    } else if (src.file.first_block != LAST_BLOCK) {
+        int block = extend_data(0, false);
+        if (block == 0) {
+            ret = -1;
+        } else {
+            copy_block(src.file.first_block, block);
+            set_fat(block, next);
+            e.file.first_block = block;
+        }
+    }
+    if (ret == -1) { return abort_op(); }
+    e.file.size = src.file.size;
+    write_entry(e);
+    end_op();
+    return 0;
+}
+
+/**
+ * @brief Turn compression of the file at `path_str` on or off, see `COMPRESSED_PERM`.
+ *
+ * The data is written out again in the new form before the old copy is freed, so it is never lost.
+ * If the file cannot be located throws an `ENOENT` or `ENOTDIR` error.
+ * If the file is not a regular file throws an `EINVAL` error.
+ * On any permissions error throws `EACCES`. File needs read and write permissions.
+ * Also throws an error if no space left, in which case the file is left as it was.
+ * If a snapshot is mounted throws an `EROFS` error.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param path_str Path to file to compress or decompress. Links are followed.
+ * @param on Should the file be compressed?
+ */
+int compress_file(char* path_str, bool on) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
+    Path path = split_path(path_str);
+    Entry d = find_directory(path.dir);
+    if (d.file.name[0] == EOD_FLAG) { return -1; }
+    Entry e = find_name(path.name, d.file.first_block, SKIP_ALL);
+    if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
+    if (e.file.type != REGULAR_FILE) { errno = EINVAL; return -1; }
+    if ((e.file.perm & READ_PERM) == 0 || (e.file.perm & WRITE_PERM) == 0) { errno = EACCES; return -1; }
+    if (((e.file.perm & COMPRESSED_PERM) != 0) == on) { return 0; }
+    int size = e.file.size;
+    uint8_t* data = (uint8_t*) malloc(size > 0 ? size : 1);
+    if (read_file(path_str, 0, data, size) == -1) { free(data); return -1; }
+    File f = e.file;
+    f.perm ^= COMPRESSED_PERM;
+    f.first_block = LAST_BLOCK;
+    f.size = 0;
+    f.tail = 0;
+    int ret = 0;
+    if (on) {
+        ret = write_compressed(&f, 0, data, size);
+    } else if (size > 0 && size <= block_size / TAIL_FRACTION) {
+        ret = pack_tail(&f, data, size);
+    } else if (size > 0) {
+        f.first_block = extend_data(0, false);
+        if (f.first_block == 0) {
+            f.first_block = LAST_BLOCK;
+            ret = -1;
+        } else {
+            ret = reserve_data(f.first_block, (size + block_size - 1) / block_size);
+            if (ret == 0) { ret = write_data((off_t) f.first_block * block_size, data, size, NULL); }
+        }
+    }
+    free(data);
+    if (ret == -1) { return abort_op(); }
+    if (e.file.tail != 0) {
+        release_tail(e.file);
+    } else {
+        truncate_data(e.file.first_block);
     }
+    f.size = size;
+    e.file = f;
+    write_entry(e);
+    end_op();
     return 0;
 }
 
@@ -848,42 +4312,36 @@ int truncate_file(char* path_str, bool skip_flag) {
  * Returns the position of the file on success for later cleanup.
  * TODO: what if file is deleted and overwritten? how will other processes using the file be able to see its data? 
  * need to not overwrite if entry is 2!!!
+ * If a snapshot is mounted throws an `EROFS` error.
  *
  * @return -1 on failure and position of deleted file on success.
  * @param path_str Path to file to remove.
  */
-int remove_file(char* path_str) {
+off_t remove_file(char* path_str) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
     Path path = split_path(path_str);
     Entry d = find_directory(path.dir);
     if (d.file.name[0] == EOD_FLAG) { return -1; }
     if ((d.file.perm & WRITE_PERM) == 0) { return -1; }
-    Entry e = find_file(path.name, d.file.first_block, SKIP_NONE);
+    Entry e = find_name(path.name, d.file.first_block, SKIP_NONE);
     if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return -1; }
     d.file.size -= 64;
     time(&d.file.mtime);
     if (d.position >= 0) { // not root
-        if (lseek(fs_fd, d.position, SEEK_SET) == -1) {
-            cur_errno = ERR_PERM;
-            p_perror("lseek");
-            exit(EXIT_FAILURE);
-        }
-        if (write(fs_fd, &d.file, sizeof(File)) == -1) {
-            cur_errno = ERR_PERM;
-            p_perror("write");
-            exit(EXIT_FAILURE);
-        }
-    }
-    e.file.name[0] = REMOVED_FLAG;
-    if (lseek(fs_fd, e.position, SEEK_SET) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("lseek");
-        exit(EXIT_FAILURE);
+        write_entry(d);
     }
-    if (write(fs_fd, &e.file, sizeof(File)) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("write");
-        exit(EXIT_FAILURE);
+    DirIndex ix;
+    off_t at = index_open(d.file.first_block, &ix);
+    if (at != 0) {
+        index_remove(at, &ix, e.file.name, e.position);
+        write_position(e.position + SLOT_LINK, &ix.free_slot, 4);
+        ix.free_slot = e.position / 64;
+        index_save(at, &ix);
     }
+    e.file.name[0] = REMOVED_FLAG;
+    write_entry(e);
+    end_op();
     return e.position;
 }
 
@@ -895,22 +4353,18 @@ int remove_file(char* path_str) {
  * This allows the directory to reclaim the entry as the `first_block` pointer is no longer needed.
  * Note that working with raw positions is necessary because deleting a file
  * corrupts its name field and hence we can no longer access it with the other methods.
+ * If a snapshot is mounted throws an `EROFS` error.
  *
  * @return -1 on failure and 0 on success.
  * @param position Position of directory entry to indicate has been cleaned up.
  */
-int cleanup_file(int position) {
+int cleanup_file(off_t position) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
     int flag = CLEANED_FLAG;
-    if (lseek(fs_fd, position, SEEK_SET) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("lseek");
-        exit(EXIT_FAILURE);
-    }
-    if (write(fs_fd, &flag, 1) == -1) {
-        cur_errno = ERR_PERM;
-        p_perror("write");
-        exit(EXIT_FAILURE);
-    }
+    write_position(position, &flag, 1);
+    dcache_invalidate(position);
+    end_op();
     return 0;
 }
 
@@ -922,42 +4376,421 @@ int cleanup_file(int position) {
  * If the file cannot be located throws an `ENOENT` or `ENOTDIR` error.
  * If the file is not a directory throws an `ENOTDIR` error.
  * On any permissions error throws an `EACCES`. Directory needs read permissions.
+ * The list is read straight from the directory's slots into `scratch`, sized by one pass counting them.
  *
- * @return -1 on failure and 0 on success.
- * @param position Position of directory entry to indicate has been cleaned up.
+ * @return NULL on failure and the list, allocated in `scratch`, on success.
+ * @param path_str Path to the directory.
+ * @param scratch The caller's scratch arena.
  */
-File* list_directory(char* path_str) {
+File* list_directory(char* path_str, Arena* scratch) {
+    SHARED_CALL;
     Path path = split_path(path_str);
-    int count = 1;
-    int i;
     Entry d = find_directory(path.dir);
     if (d.file.name[0] == EOD_FLAG) { return NULL; }
     Entry e;
-    if (path.name == NULL) {
+    if (path.name.len == 0) {
         e = d;
     } else {
-        e = find_file(path.name, d.file.first_block, SKIP_ALL);
+        e = find_name(path.name, d.file.first_block, SKIP_ALL);
         if (e.file.name[0] == EOD_FLAG) { errno = ENOENT; return NULL; }
         if (e.file.type != DIRECTORY_FILE) { errno = ENOTDIR; return NULL; }
         if ((e.file.perm & READ_PERM) == 0) { errno = EACCES; return NULL; }
     }
-    Entry* entries = enum_directory(e.file.first_block);
-    for (i = 0; entries[i].file.name[0] != EOD_FLAG; ++i) {
-        if (
-            entries[i].file.name[0] != EOD_FLAG && 
-            entries[i].file.name[0] != CLEANED_FLAG && 
-            entries[i].file.name[0] != REMOVED_FLAG
-        ) { count++; }
-    }
-    File* list = (File*) malloc(64 * count);
-    count = 0;
-    for (i = 0; entries[i].file.name[0] != EOD_FLAG; ++i) {
-        if (
-            entries[i].file.name[0] != EOD_FLAG && 
-            entries[i].file.name[0] != CLEANED_FLAG && 
-            entries[i].file.name[0] != REMOVED_FLAG
-        ) { list[count] = entries[i].file; count++; }
+    int block = e.file.first_block;
+    File* list = (File*) arena_alloc(scratch, space_directory(block) * sizeof(File));
+    int files_per_block = block_size / 64;
+    int count = 0;
+    while (1) {
+        for (int i = 0; i < files_per_block; i++) {
+            read_slot(block_position(block) + 64 * i, &list[count]);
+            uint8_t flag = list[count].name[0];
+            if (flag == EOD_FLAG) { return list; }
+            if (flag != CLEANED_FLAG && flag != REMOVED_FLAG) { count++; }
+        }
+        block = get_fat(block);
+    }
+}
+
+/**
+ * @brief Count the blocks of the directory beginning at `block` and of every directory below it.
+ *
+ * @return The number of blocks.
+ * @param block The first block containing entries in the directory.
+ */
+int tree_blocks(int block) {
+    int count = 0;
+    for (int b = block; b != LAST_BLOCK; b = get_fat(b)) { count++; }
+    Entry* entries = enum_directory(block);
+    for (int i = 0; entries[i].file.name[0] != EOD_FLAG; i++) {
+        uint8_t flag = entries[i].file.name[0];
+        if (flag != CLEANED_FLAG && flag != REMOVED_FLAG && entries[i].file.type == DIRECTORY_FILE) {
+            count += tree_blocks(entries[i].file.first_block);
+        }
+    }
+    free(entries);
+    return count;
+}
+
+/**
+ * @brief Copy the directory beginning at `block`, and every directory below it, for a snapshot.
+ *
+ * The copies' slots point to the copies of subdirectories and to the same data as the originals.
+ * Copies have no index. In `view`, the snapshot's FAT, the copies replace the originals and
+ * their indexes. The caller makes sure there is space for the copies, but if none is left
+ * throws an `ENOSPC` error, leaving what was copied for `abort_op`.
+ *
+ * @return The first block of the copy on success or 0 on failure.
+ * @param block The first block containing entries in the directory.
+ * @param view The snapshot's FAT, updated.
+ */
+int copy_directory(int block, uint32_t* view) {
+    uint32_t desc[2];
+    read_position(block_position(block) + SLOT_INDEX, desc, sizeof(desc));
+    if (desc[0] == INDEX_MAGIC && desc[1] != 0 && desc[1] <= (uint32_t) data_blocks) {
+        for (uint32_t b = desc[1]; b != LAST_BLOCK && b != FREE_BLOCK; b = get_fat(b)) { view[b] = FREE_BLOCK; }
+    }
+    uint8_t* buf = (uint8_t*) malloc(block_size);
+    int head = 0;
+    int prev = 0;
+    bool end = false;
+    for (int b = block; b != LAST_BLOCK; b = get_fat(b)) {
+        int copy = extend_data(prev, false);
+        if (copy == 0) {
+            free(buf);
+            return 0;
+        }
+        read_extent(NULL, b, 0, buf, block_size);
+        if (b == block) { memset(buf + SLOT_INDEX, 0, sizeof(desc)); }
+        for (int i = 0; i < block_size && !end; i += 64) {
+            Slot* slot = (Slot*) (buf + i);
+            end = slot->name[0] == EOD_FLAG;
+            if (end || slot->name[0] == CLEANED_FLAG || slot->name[0] == REMOVED_FLAG || slot->type != DIRECTORY_FILE) {
+                continue;
+            }
+            int child = copy_directory(slot->first_block | (uint32_t) slot->first_block_hi << 16, view);
+            if (child == 0) {
+                free(buf);
+                return 0;
+            }
+            slot->first_block = child;
+            slot->first_block_hi = child >> 16;
+        }
+        write_extent(NULL, copy, 0, buf, block_size);
+        view[b] = FREE_BLOCK;
+        view[copy] = LAST_BLOCK;
+        if (prev != 0) { view[prev] = copy; }
+        if (head == 0) { head = copy; }
+        prev = copy;
+    }
+    free(buf);
+    return head;
+}
+
+/**
+ * @brief Mark a snapshot's copy of a directory beginning at `block`, and the copies below it, free in `view`.
+ *
+ * @param block The first block containing entries in the copy.
+ * @param view A FAT, updated.
+ */
+void drop_directory_copy(int block, uint32_t* view) {
+    Entry* entries = enum_directory(block);
+    for (int i = 0; entries[i].file.name[0] != EOD_FLAG; i++) {
+        uint8_t flag = entries[i].file.name[0];
+        if (flag != CLEANED_FLAG && flag != REMOVED_FLAG && entries[i].file.type == DIRECTORY_FILE) {
+            drop_directory_copy(entries[i].file.first_block, view);
+        }
+    }
+    free(entries);
+    for (int b = block; b != LAST_BLOCK; b = get_fat(b)) { view[b] = FREE_BLOCK; }
+}
+
+/**
+ * @brief Free a snapshot's copy of a directory beginning at `block`, and the copies below it.
+ *
+ * @param block The first block containing entries in the copy.
+ */
+void free_directory_copy(int block) {
+    Entry* entries = enum_directory(block);
+    for (int i = 0; entries[i].file.name[0] != EOD_FLAG; i++) {
+        uint8_t flag = entries[i].file.name[0];
+        if (flag != CLEANED_FLAG && flag != REMOVED_FLAG && entries[i].file.type == DIRECTORY_FILE) {
+            free_directory_copy(entries[i].file.first_block);
+        }
+    }
+    free(entries);
+    truncate_data(block);
+}
+
+/**
+ * @brief Take a snapshot of the mounted filesystem called `name`.
+ *
+ * Copies the FAT and the directory tree, and pins every block the snapshot uses so that
+ * the live filesystem copies a block before writing to it, see `unshare_data`.
+ * The other snapshots' copies of the FAT and of the directories are left out of the copy,
+ * so they are freed for good when those snapshots are deleted.
+ * File data is not copied, so the cost depends only on the size of the FAT and of the directories.
+ * The snapshot is committed right away whatever the durability level.
+ * If the filesystem isn't in the 32-bit format throws an `ENOTSUP` error.
+ * If the name is empty or too long throws `EINVAL`, and if it is taken `EEXIST`.
+ * If the snapshot table is full or no space left throws an `ENOSPC` error.
+ * If a snapshot is mounted throws an `EROFS` error.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param name Name of the new snapshot.
+ */
+int snapshot_fs(char* name) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
+    if (!wide) { errno = ENOTSUP; return -1; }
+    if (name[0] == '\0' || strlen(name) > 31) { errno = EINVAL; return -1; }
+    if (find_snapshot(name) != -1) { errno = EEXIST; return -1; }
+    Snapshot* table = snapshot_table();
+    int i = 0;
+    while (i < snapshot_slots() && table[i].name[0] != '\0') { i++; }
+    if (i == snapshot_slots()) { errno = ENOSPC; return -1; }
+    int size = (data_blocks + 1) * sizeof(uint32_t);
+    if (tree_blocks(root.file.first_block) + (size + block_size - 1) / block_size > alloc_free_count()) {
+        errno = ENOSPC;
+        return -1;
+    }
+    // Unwritten blocks are only zeroed by a commit, which mustn't happen to blocks the snapshot holds
+    commit();
+    uint32_t* view = (uint32_t*) malloc(size);
+    memcpy(view, fat, size);
+    for (int j = 0; j < snapshot_slots(); j++) {
+        if (table[j].name[0] == '\0') { continue; }
+        drop_directory_copy(table[j].root, view);
+        for (int b = table[j].fat_block; b != LAST_BLOCK; b = get_fat(b)) { view[b] = FREE_BLOCK; }
+    }
+    Snapshot s = { 0 };
+    strcpy(s.name, name);
+    s.root = copy_directory(root.file.first_block, view);
+    s.fat_block = s.root == 0 ? 0 : extend_data(0, false);
+    if (s.fat_block == 0 || write_data((off_t) s.fat_block * block_size, (uint8_t*) view, size, NULL) == -1) {
+        free(view);
+        return abort_op();
     }
-    list[count] = entries[i].file;
+    time(&s.time);
+    for (int b = 1; b <= data_blocks; b++) {
+        if (view[b] != FREE_BLOCK) { alloc_pin(b); }
+    }
+    free(view);
+    write_snapshot(i, s);
+    // The current tail block is pinned now, so small files need a new one
+    tail_block = 0;
+    return commit();
+}
+
+/**
+ * @brief Delete the snapshot called `name`.
+ *
+ * Its copies of the FAT and the directories are freed, and so are blocks only it held.
+ * The deletion is committed right away whatever the durability level.
+ * If the filesystem isn't in the 32-bit format throws an `ENOTSUP` error.
+ * If there is no such snapshot throws an `ENOENT` error.
+ * If a snapshot is mounted throws an `EROFS` error.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param name Name of the snapshot.
+ */
+int delete_snapshot(char* name) {
+    EXCLUSIVE_CALL;
+    if (read_only) { errno = EROFS; return -1; }
+    if (!wide) { errno = ENOTSUP; return -1; }
+    int i = find_snapshot(name);
+    if (i == -1) { errno = ENOENT; return -1; }
+    Snapshot s = snapshot_table()[i];
+    commit();
+    free_directory_copy(s.root);
+    truncate_data(s.fat_block);
+    Snapshot empty = { 0 };
+    write_snapshot(i, empty);
+    // Blocks the snapshot held may only be reused once it is gone for good
+    if (commit() == -1) { return -1; }
+    alloc_unpin_all();
+    pin_snapshots();
+    for (int b = 1; b <= data_blocks; b++) {
+        if (get_fat(b) == FREE_BLOCK) { alloc_mark_free(b); }
+    }
+    return commit();
+}
+
+/**
+ * @brief List the snapshots of the mounted filesystem.
+ *
+ * Last snapshot in list has an empty name.
+ * If the filesystem isn't in the 32-bit format throws an `ENOTSUP` error.
+ *
+ * @return The snapshots on success and NULL on failure.
+ */
+Snapshot* list_snapshots() {
+    SHARED_CALL;
+    if (!wide) { errno = ENOTSUP; return NULL; }
+    Snapshot* table = snapshot_table();
+    Snapshot* list = (Snapshot*) malloc((snapshot_slots() + 1) * sizeof(Snapshot));
+    int count = 0;
+    for (int i = 0; i < snapshot_slots(); i++) {
+        if (table[i].name[0] != '\0') { list[count++] = table[i]; }
+    }
+    list[count].name[0] = '\0';
     return list;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Mount the snapshot called `name` of the filesystem given by `fs` string, read-only.
+ *
+ * The image is opened read-only and nothing is written to it, so a snapshot can be mounted
+ * while the filesystem itself is mounted elsewhere. Every change fails with `EROFS` until unmounted.
+ * Fails as `mount_fs` does. If the filesystem isn't in the 32-bit format throws an `ENOTSUP` error,
+ * and if there is no such snapshot `ENOENT`.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param fs The name of the file containing the filesystem on the host machine.
+ * @param name Name of the snapshot.
+ */
+int mount_snapshot(char* fs, char* name) {
+    EXCLUSIVE_CALL;
+    read_only = true;
+    if (mount_fs(fs) == -1) {
+        read_only = false;
+        return -1;
+    }
+    int i = wide ? find_snapshot(name) : -1;
+    if (i == -1) {
+        int err = wide ? ENOENT : ENOTSUP;
+        unmount_fs();
+        errno = err;
+        return -1;
+    }
+    Snapshot s = snapshot_table()[i];
+    uint32_t* view = load_snapshot(s);
+    memcpy(fat, view, (data_blocks + 1) * sizeof(uint32_t));
+    free(view);
+    root.file.first_block = s.root;
+    root.file.mtime = s.time;
+    return 0;
+}
+
+/**
+ * @brief Append every file in the directory beginning at `block`, and below it, to `list`.
+ *
+ * Walks the chains of whatever FAT `fat` points to.
+ *
+ * @param block The first block containing entries in the directory.
+ * @param prefix Path of the directory, empty for the root.
+ * @param list The list, reallocated as needed.
+ * @param count Number of files in the list.
+ * @param cap Capacity of the list.
+ */
+void walk_tree(int block, char* prefix, TreeFile** list, int* count, int* cap) {
+    Entry* entries = enum_directory(block);
+    for (int i = 0; entries[i].file.name[0] != EOD_FLAG; i++) {
+        uint8_t flag = entries[i].file.name[0];
+        if (flag == CLEANED_FLAG || flag == REMOVED_FLAG) { continue; }
+        char* path = (char*) malloc(strlen(prefix) + strlen(entries[i].file.name) + 2);
+        sprintf(path, "%s/%s", prefix, entries[i].file.name);
+        if (*count == *cap) {
+            *cap = *cap ? 2 * *cap : 64;
+            *list = (TreeFile*) realloc(*list, *cap * sizeof(TreeFile));
+        }
+        (*list)[(*count)++] = (TreeFile) { path, entries[i].file };
+        if (entries[i].file.type == DIRECTORY_FILE) {
+            walk_tree(entries[i].file.first_block, path, list, count, cap);
+        }
+    }
+    free(entries);
+}
+
+/**
+ * @brief Order files found by `walk_tree` by path for qsort.
+ *
+ * @return Negative, zero or positive as `a` is before, equal to or after `b`.
+ * @param a The first file.
+ * @param b The second file.
+ */
+int compare_tree_files(const void* a, const void* b) {
+    return strcmp(((const TreeFile*) a)->path, ((const TreeFile*) b)->path);
+}
+
+/**
+ * @brief Do two versions of a file differ?
+ *
+ * A block a snapshot holds is never written, so data is the same exactly when the chains are.
+ * Directories only differ in type and permissions, changes to their files are found separately.
+ *
+ * @return True if the metadata or the chains differ.
+ * @param a The first version.
+ * @param fat_a The FAT holding its chain.
+ * @param b The second version.
+ * @param fat_b The FAT holding its chain.
+ */
+bool file_changed(File a, uint32_t* fat_a, File b, uint32_t* fat_b) {
+    if (a.type != b.type || a.perm != b.perm) { return true; }
+    if (a.type == DIRECTORY_FILE) { return false; }
+    if (a.size != b.size || a.mtime != b.mtime || a.tail != b.tail) { return true; }
+    if (a.tail != 0) { return a.first_block != b.first_block; }
+    uint32_t x = a.first_block;
+    uint32_t y = b.first_block;
+    while (x == y && x != LAST_BLOCK && x != FREE_BLOCK && x <= (uint32_t) data_blocks) {
+        x = fat_next(fat_a[x]);
+        y = fat_next(fat_b[y]);
+    }
+    return x != y;
+}
+
+/**
+ * @brief Find what changed between snapshot `from` and snapshot `to`, or the mounted filesystem.
+ *
+ * Calls `report` once per changed path, in path order, with 'A' for files only in `to`,
+ * 'D' for files only in `from` and 'M' for files in both which differ, see `file_changed`.
+ * Only metadata and FATs are read, never file data.
+ * If the filesystem isn't in the 32-bit format throws an `ENOTSUP` error.
+ * If there is no such snapshot throws an `ENOENT` error.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param from Name of the older snapshot.
+ * @param to Name of the newer snapshot, or NULL for the mounted filesystem.
+ * @param report Called with the kind of change and the absolute path of each changed file.
+ */
+int diff_snapshots(char* from, char* to, void (*report)(char change, char* path)) {
+    EXCLUSIVE_CALL;
+    if (!wide) { errno = ENOTSUP; return -1; }
+    int i = find_snapshot(from);
+    int j = to != NULL ? find_snapshot(to) : -1;
+    if (i == -1 || (to != NULL && j == -1)) { errno = ENOENT; return -1; }
+    Snapshot* table = snapshot_table();
+    uint32_t* fat_a = load_snapshot(table[i]);
+    uint32_t* fat_b = to != NULL ? load_snapshot(table[j]) : (uint32_t*) fat;
+    TreeFile* a = NULL;
+    TreeFile* b = NULL;
+    int na = 0, nb = 0, cap_a = 0, cap_b = 0;
+    // Directories are read through whichever FAT holds their chains
+    void* live = fat;
+    fat = fat_a;
+    walk_tree(table[i].root, "", &a, &na, &cap_a);
+    fat = fat_b;
+    walk_tree(to != NULL ? table[j].root : root.file.first_block, "", &b, &nb, &cap_b);
+    fat = live;
+    qsort(a, na, sizeof(TreeFile), compare_tree_files);
+    qsort(b, nb, sizeof(TreeFile), compare_tree_files);
+    int x = 0, y = 0;
+    while (x < na || y < nb) {
+        int cmp = x == na ? 1 : y == nb ? -1 : strcmp(a[x].path, b[y].path);
+        if (cmp < 0) {
+            report('D', a[x++].path);
+        } else if (cmp > 0) {
+            report('A', b[y++].path);
+        } else {
+            if (file_changed(a[x].file, fat_a, b[y].file, fat_b)) { report('M', b[y].path); }
+            x++;
+            y++;
+        }
+    }
+    for (x = 0; x < na; x++) { free(a[x].path); }
+    for (y = 0; y < nb; y++) { free(b[y].path); }
+    free(a);
+    free(b);
+    free(fat_a);
+    if (to != NULL) { free(fat_b); }
+    return 0;
+}
@@ -1,5 +1,9 @@
+#ifndef FILESYS
+#define FILESYS
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include "arena.h"
 
 /**
  * @file filesys.h
@@ -51,6 +55,14 @@
  */
 #define WRITE_PERM 4
 
+/**
+ * @brief Not a permission: marks a regular file whose data is stored compressed.
+ *
+ * Reads and writes are unaffected, the data is compressed and decompressed as it goes.
+ * Only `compress_file` changes it, `set_file` keeps whatever the file had.
+ */
+#define COMPRESSED_PERM 8
+
 /**
  * @brief End of directory special marker in name[0].
  * 
@@ -70,6 +82,38 @@
  */
 #define REMOVED_FLAG 0x02
 
+/**
+ * @brief Changes are only guaranteed to reach the disk on unmount or `sync_fs`.
+ */
+#define DURABILITY_NONE 0
+
+/**
+ * @brief Changes are committed in groups, see `GROUP_COMMIT_OPS` and `GROUP_COMMIT_SECONDS`.
+ */
+#define DURABILITY_GROUP 1
+
+/**
+ * @brief Every operation is committed before it returns. The default.
+ */
+#define DURABILITY_STRICT 2
+
+/**
+ * @brief Maximum number of operations in a group commit.
+ */
+#define GROUP_COMMIT_OPS 64
+
+/**
+ * @brief Maximum age in seconds of the oldest operation in a group commit.
+ *
+ * Checked when an operation finishes, there is no background flusher.
+ */
+#define GROUP_COMMIT_SECONDS 1
+
+/**
+ * @brief Files of at most `block_size / TAIL_FRACTION` bytes are packed into tail blocks.
+ */
+#define TAIL_FRACTION 4
+
 /**
  * @brief A file struct type as specified in the PennOS writeup.
  */
@@ -92,9 +136,10 @@ typedef struct file {
     /**
     * @brief First block number of the file.
     *
-    * Equal to LAST_BLOCK if size is zero.
+    * Equal to LAST_BLOCK if size is zero, and to the tail block holding the data if `tail` is nonzero.
+    * Block numbers are 16 bits on disk in the original format and 32 bits in the 32-bit format.
     */
-    uint16_t first_block;
+    uint32_t first_block;
     /**
     * @brief File type indicator. See macros above.
     */
@@ -109,16 +154,218 @@ typedef struct file {
     * TODO: decide exactly when time should be updated.
     */
     time_t mtime;
+    /**
+    * @brief Offset of the data within tail block `first_block`, or 0 if the file has blocks of its own.
+    *
+    * Files of at most `1 / TAIL_FRACTION` of a block are packed together into shared tail blocks.
+    */
+    uint16_t tail;
 } File;
 
+/**
+ * @brief Size and free space of a mounted filesystem.
+ */
+typedef struct fs_stats {
+    /**
+    * @brief Block size in bytes.
+    */
+    int block_size;
+    /**
+    * @brief Number of data blocks.
+    */
+    int total_blocks;
+    /**
+    * @brief Number of data blocks not allocated to any file.
+    */
+    int free_blocks;
+    /**
+    * @brief Bytes of the image actually stored on the host, which holes don't take up.
+    */
+    long host_bytes;
+    /**
+    * @brief Does the filesystem have block checksums?
+    */
+    bool checksummed;
+    /**
+    * @brief Number of blocks read since mount which didn't match their checksums.
+    */
+    long checksum_errors;
+} FsStats;
+
+/**
+ * @brief How much sharing saves in a mounted filesystem, see `dedup_usage`.
+ */
+typedef struct dedup_stats {
+    /**
+    * @brief Is dedup on?
+    */
+    bool on;
+    /**
+    * @brief Number of blocks in the dedup index.
+    */
+    int indexed;
+    /**
+    * @brief Number of blocks since mount which weren't written because identical ones were shared instead.
+    */
+    long shared;
+    /**
+    * @brief Number of blocks files and directories use, a shared block counting once for each.
+    */
+    long referenced;
+    /**
+    * @brief Number of distinct blocks files and directories use.
+    */
+    long stored;
+} DedupStats;
+
+/**
+ * @brief What a scrub of the filesystem found, see `scrub_fs`.
+ */
+typedef struct scrub_stats {
+    /**
+    * @brief Number of blocks checked against their checksums.
+    */
+    int checked;
+    /**
+    * @brief Number of blocks without a checksum, which were skipped.
+    */
+    int skipped;
+    /**
+    * @brief Number of blocks which didn't match their checksums.
+    */
+    int bad;
+} ScrubStats;
+
+/**
+ * @brief A remembered position in a file's chain of blocks.
+ *
+ * Lets consecutive reads and writes of an open file continue from where the last one
+ * stopped instead of walking the FAT from the file's first block every time.
+ * A cursor is only trusted while it belongs to the same chain and no chain has been freed since it was set.
+ * Reads through a cursor also track whether access is sequential, for readahead.
+ */
+typedef struct cursor {
+    /**
+    * @brief First block of the chain the cursor was set on.
+    */
+    int first_block;
+    /**
+    * @brief Logical block index within the file.
+    */
+    int index;
+    /**
+    * @brief FAT block holding logical block `index`, or the hole node whose run starts there.
+    */
+    int block;
+    /**
+    * @brief Value of the chain generation when the cursor was set, -1 if never set.
+    */
+    int generation;
+    /**
+    * @brief Logical offset just past the last read, where a sequential read would start.
+    */
+    int next_offset;
+    /**
+    * @brief Number of blocks to read ahead next time, 0 until reads are seen to be sequential.
+    */
+    int window;
+    /**
+    * @brief Logical block index up to which blocks have been read ahead (exclusive).
+    */
+    int ahead;
+} Cursor;
+
+/**
+ * @brief A piece of a file's data which is contiguous in memory, see `borrow_file`.
+ */
+typedef struct extent {
+    /**
+    * @brief First byte of the piece.
+    */
+    uint8_t* data;
+    /**
+    * @brief Number of bytes in the piece.
+    */
+    int size;
+} Extent;
+
+/**
+ * @brief A read-only view of the whole filesystem as it was when taken.
+ *
+ * Only images in the 32-bit format can hold snapshots. Each keeps a copy of the FAT
+ * and of the directory tree, and shares the data blocks of files with the live filesystem,
+ * which copies a block before writing to it as long as a snapshot holds it.
+ */
+typedef struct snapshot {
+    /**
+    * @brief Snapshot name (null terminated), empty for an unused record.
+    */
+    char name[32];
+    /**
+    * @brief First block of the chain holding the snapshot's copy of the FAT.
+    */
+    uint32_t fat_block;
+    /**
+    * @brief First block of the snapshot's copy of the root directory.
+    */
+    uint32_t root;
+    /**
+    * @brief When the snapshot was taken as returned by time(2) in Linux.
+    */
+    time_t time;
+} Snapshot;
+
+/**
+ * @brief Part of a path string, such as one component or what is left to parse, pointed to rather than copied.
+ */
+typedef struct path_view {
+    /**
+    * @brief First character, in the path string.
+    */
+    char* ptr;
+    /**
+    * @brief Number of characters, which need not be followed by a null.
+    */
+    int len;
+} PathView;
+
+/**
+ * @brief A cursor which has never been set.
+ */
+#define NO_CURSOR ((Cursor) { 0, 0, 0, -1, 0, 0, 0 })
+
 // Documentation in filesys.c
 
+bool next_name(PathView* rest, PathView* name);
+
+void join_path(char* out, char* dir, char* name);
+
 int init_fs(char* fs, int new_fat_blocks, int new_block_size_config);
 
 int mount_fs(char* fs);
 
 int unmount_fs();
 
+void set_durability(int level);
+
+void set_dedup(bool on);
+
+DedupStats dedup_usage();
+
+int sync_fs();
+
+void begin_txn();
+
+void end_txn();
+
+int map_data(bool on);
+
+bool data_mapped();
+
+FsStats fs_stats();
+
+int scrub_fs(void (*report)(int block), ScrubStats* stats);
+
 int create_file(char* path_str, uint8_t type);
 
 int set_file(char* path_str, File f, bool skip_flag);
@@ -129,12 +376,36 @@ int read_file(char* path_str, int offset, uint8_t* buf, int size);
 
 int write_file(char* path_str, int offset, uint8_t* buf, int size, bool skip_flag);
 
+int read_file_cursor(char* path_str, int offset, uint8_t* buf, int size, Cursor* cursor);
+
+int borrow_file(char* path_str, int offset, int size, Extent* extents, int max);
+
+int write_file_cursor(char* path_str, int offset, uint8_t* buf, int size, bool skip_flag, Cursor* cursor);
+
 int truncate_file(char* path_str, bool skip_flag);
 
-int remove_file(char* path_str);
+int punch_file(char* path_str, int offset, int size);
+
+int clone_file(char* src_path, char* dst_path);
+
+int compress_file(char* path_str, bool on);
+
+int snapshot_fs(char* name);
+
+int delete_snapshot(char* name);
+
+Snapshot* list_snapshots();
+
+int mount_snapshot(char* fs, char* name);
+
+int diff_snapshots(char* from, char* to, void (*report)(char change, char* path));
+
+off_t remove_file(char* path_str);
+
+int cleanup_file(off_t position);
 
-int cleanup_file(int offset);
+off_t seek_data(off_t position, int offset);
 
-int seek_data(int position, int offset);
+File* list_directory(char* path_str, Arena* scratch);
 
-File* list_directory(char* path_str);
\ No newline at end of file
+#endif
\ No newline at end of file
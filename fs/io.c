@@ -0,0 +1,684 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "io.h"
+#include "../error.h"
+
+/**
+ * @file io.c
+ * @brief An implementation of batched host I/O.
+ *
+ * Callers collect the reads and writes of one operation in a batch and submit them all at once.
+ * A backend then carries them out asynchronously: io_uring where the kernel allows it
+ * (through raw system calls, there is no liburing), otherwise a small pool of worker threads,
+ * otherwise plain blocking calls. The caller waits for the whole batch before going on,
+ * so the gain is in overlapping the batch's requests with each other, not with other work.
+ *
+ * Requests without a batch are carried out immediately with blocking calls.
+ *
+ * Signals are blocked while the queues are touched, so that PennOS can't switch
+ * to another process half way through a submission or a completion. The queues
+ * are also locked then, so that several host threads can share them: each backend
+ * has a single producer, and a thread waiting for completions collects everyone's.
+ */
+
+/**
+ * @brief The backend in use, NULL until `io_start`.
+ */
+static const IoBackend* backend = NULL;
+
+/**
+ * @brief Number of submitted requests not yet done, across all batches.
+ */
+static atomic_int inflight = 0;
+
+/**
+ * @brief Held while the backend's queues are touched.
+ */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Number of unfinished `io_block_signals` calls of the calling thread.
+ */
+static __thread int signals_blocked = 0;
+
+/**
+ * @brief Block every signal, saving the old mask in `old`.
+ *
+ * Calls nest, and only the outermost one changes the mask, so that locks taken
+ * inside the filesystem's own lock cost no system calls.
+ *
+ * @param old Where to save the old signal mask, only written by the outermost call.
+ */
+void io_block_signals(sigset_t* old) {
+    if (signals_blocked++ > 0) { return; }
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, old);
+}
+
+/**
+ * @brief Undo an `io_block_signals`, restoring the mask once the outermost call is undone.
+ *
+ * @param old The mask saved by the matching call.
+ */
+void io_restore_signals(sigset_t* old) {
+    if (--signals_blocked > 0) { return; }
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/**
+ * @brief Block every signal, saving the old mask in `old`, and take `queue_lock`.
+ *
+ * @param old Where to save the old signal mask.
+ */
+static void enter_critical(sigset_t* old) {
+    io_block_signals(old);
+    pthread_mutex_lock(&queue_lock);
+}
+
+/**
+ * @brief Release `queue_lock` and restore the signal mask saved by `enter_critical`.
+ *
+ * @param old The saved signal mask.
+ */
+static void leave_critical(sigset_t* old) {
+    pthread_mutex_unlock(&queue_lock);
+    io_restore_signals(old);
+}
+
+/**
+ * @brief Carry out a request with blocking calls.
+ *
+ * @return Bytes transferred, or minus the error number on failure.
+ * @param r The request.
+ */
+static ssize_t transfer(IoRequest* r) {
+    ssize_t n;
+    do {
+        n = r->write ? pwritev(r->fd, r->iov, r->count, r->at) : preadv(r->fd, r->iov, r->count, r->at);
+    } while (n == -1 && errno == EINTR);
+    return n == -1 ? -errno : n;
+}
+
+/**
+ * @brief Record that request `r` finished with `result`.
+ *
+ * May be called from a worker thread, the batch isn't touched once its count drops.
+ *
+ * @param r The request.
+ * @param result Bytes transferred, or minus the error number on failure.
+ */
+static void complete(IoRequest* r, ssize_t result) {
+    r->result = result;
+    atomic_fetch_sub(&r->batch->remaining, 1);
+    atomic_fetch_sub(&inflight, 1);
+}
+
+/**
+ * @brief Check the result of a finished request.
+ *
+ * Bytes past the end of the host file read as zeroes.
+ * Failures are fatal, as for any other host I/O.
+ *
+ * @param r The request.
+ */
+static void settle(IoRequest* r) {
+    if (r->write && r->result >= 0 && (size_t) r->result < r->size) { r->result = -EIO; }
+    if (r->result < 0) {
+        errno = -r->result;
+        cur_errno = ERR_PERM;
+        p_perror(r->write ? "pwritev" : "preadv");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = r->result;
+    for (int i = 0; i < r->count; i++) {
+        if (n < r->iov[i].iov_len) {
+            memset((uint8_t*) r->iov[i].iov_base + n, 0, r->iov[i].iov_len - n);
+            n = 0;
+        } else {
+            n -= r->iov[i].iov_len;
+        }
+    }
+}
+
+/**
+ * @brief Start the blocking backend, which is always available.
+ *
+ * @return 0.
+ */
+static int sync_start() {
+    return 0;
+}
+
+/**
+ * @brief Carry out request `r` right away.
+ *
+ * @param r The request.
+ */
+static void sync_submit(IoRequest* r) {
+    complete(r, transfer(r));
+}
+
+/**
+ * @brief Nothing to do, requests are done when submitted.
+ */
+static void sync_flush() {
+}
+
+/**
+ * @brief Nothing to do, requests are done when submitted.
+ *
+ * @param block Ignored.
+ */
+static void sync_reap(bool block) {
+}
+
+/**
+ * @brief Blocking calls made by the caller, used when nothing better is available.
+ */
+const IoBackend io_sync_backend = { "sync", sync_start, sync_submit, sync_flush, sync_reap };
+
+/**
+ * @brief The io_uring instance.
+ */
+static int ring_fd = -1;
+
+/**
+ * @brief Submission queue tail, shared with the kernel.
+ */
+static unsigned* sq_tail;
+
+/**
+ * @brief Submission queue index mask.
+ */
+static unsigned* sq_mask;
+
+/**
+ * @brief Submission queue indirection array.
+ */
+static unsigned* sq_array;
+
+/**
+ * @brief Submission queue entries.
+ */
+static struct io_uring_sqe* sqes;
+
+/**
+ * @brief Completion queue head, shared with the kernel.
+ */
+static unsigned* cq_head;
+
+/**
+ * @brief Completion queue tail, shared with the kernel.
+ */
+static unsigned* cq_tail;
+
+/**
+ * @brief Completion queue index mask.
+ */
+static unsigned* cq_mask;
+
+/**
+ * @brief Completion queue entries.
+ */
+static struct io_uring_cqe* cqes;
+
+/**
+ * @brief Number of queued submission entries the kernel hasn't been told about.
+ */
+static unsigned unsubmitted = 0;
+
+/**
+ * @brief Call io_uring_enter(2).
+ *
+ * @return As for io_uring_enter.
+ * @param to_submit Number of entries to submit.
+ * @param min_complete Number of completions to wait for.
+ */
+static int ring_enter(unsigned to_submit, unsigned min_complete) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/**
+ * @brief Set up an io_uring with room for `IO_QUEUE_DEPTH` requests and map its queues.
+ *
+ * @return 0 on success and -1 if io_uring isn't available.
+ */
+static int uring_start() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &p);
+    if (ring_fd == -1) { return -1; }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_size > sq_size) { sq_size = cq_size; }
+    uint8_t* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    uint8_t* cq = single ? sq :
+        mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+    sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*) (sq + p.sq_off.array);
+    cq_head = (unsigned*) (cq + p.cq_off.head);
+    cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Queue request `r` as a submission entry.
+ *
+ * There is always room since no more than `IO_QUEUE_DEPTH` requests are in flight.
+ *
+ * @param r The request.
+ */
+static void uring_submit(IoRequest* r) {
+    unsigned tail = *sq_tail;
+    unsigned i = tail & *sq_mask;
+    struct io_uring_sqe* sqe = &sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = r->fd;
+    sqe->addr = (uint64_t) (uintptr_t) r->iov;
+    sqe->len = r->count;
+    sqe->off = r->at;
+    sqe->user_data = (uint64_t) (uintptr_t) r;
+    sq_array[i] = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+}
+
+/**
+ * @brief Tell the kernel about every queued submission entry with one call.
+ */
+static void uring_flush() {
+    while (unsubmitted > 0) {
+        int n = ring_enter(unsubmitted, 0);
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            cur_errno = ERR_PERM;
+            p_perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        unsubmitted -= n;
+    }
+}
+
+/**
+ * @brief Collect completion entries.
+ *
+ * @param block Wait for at least one if there are none yet?
+ */
+static void uring_reap(bool block) {
+    unsigned head = *cq_head;
+    if (block && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        if (ring_enter(0, 1) == -1 && errno != EINTR) {
+            cur_errno = ERR_PERM;
+            p_perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+        complete((IoRequest*) (uintptr_t) cqe->user_data, cqe->res);
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief io_uring, one system call submits a whole batch.
+ */
+const IoBackend io_uring_backend = { "io_uring", uring_start, uring_submit, uring_flush, uring_reap };
+
+/**
+ * @brief Requests waiting for a worker thread, a ring indexed modulo `IO_QUEUE_DEPTH`.
+ */
+static IoRequest* work_queue[IO_QUEUE_DEPTH];
+
+/**
+ * @brief Where the next request goes in `work_queue`. Only touched with `queue_lock` held.
+ */
+static int work_tail = 0;
+
+/**
+ * @brief Where the next worker takes a request from in `work_queue`.
+ */
+static atomic_int work_head = 0;
+
+/**
+ * @brief Posted once for each request put in `work_queue`.
+ */
+static sem_t work_ready;
+
+/**
+ * @brief Posted once for each request a worker finishes.
+ */
+static sem_t work_done;
+
+/**
+ * @brief Body of a worker thread: carry out requests one at a time as they arrive.
+ *
+ * @return Never returns.
+ * @param arg Unused.
+ */
+static void* worker(void* arg) {
+    while (true) {
+        while (sem_wait(&work_ready) == -1) { }
+        IoRequest* r = work_queue[atomic_fetch_add(&work_head, 1) % IO_QUEUE_DEPTH];
+        complete(r, transfer(r));
+        sem_post(&work_done);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start `IO_THREADS` worker threads.
+ *
+ * The workers block every signal so that PennOS's timer always lands on the main thread.
+ *
+ * @return 0 if at least one worker started and -1 otherwise.
+ */
+static int thread_start() {
+    if (sem_init(&work_ready, 0, 0) == -1 || sem_init(&work_done, 0, 0) == -1) { return -1; }
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int started = 0;
+    for (int i = 0; i < IO_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, NULL) != 0) { break; }
+        pthread_detach(thread);
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return started > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Hand request `r` to the workers.
+ *
+ * @param r The request.
+ */
+static void thread_submit(IoRequest* r) {
+    work_queue[work_tail++ % IO_QUEUE_DEPTH] = r;
+    sem_post(&work_ready);
+}
+
+/**
+ * @brief Nothing to do, workers pick requests up as they are submitted.
+ */
+static void thread_flush() {
+}
+
+/**
+ * @brief Wait for a worker to finish a request if `block` is true.
+ *
+ * Workers record their own completions, so this only waits.
+ *
+ * @param block Wait for a completion?
+ */
+static void thread_reap(bool block) {
+    if (block) {
+        while (sem_wait(&work_done) == -1) { }
+    } else {
+        while (sem_trywait(&work_done) == 0) { }
+    }
+}
+
+/**
+ * @brief A pool of `IO_THREADS` threads making blocking calls.
+ */
+const IoBackend io_thread_backend = { "threads", thread_start, thread_submit, thread_flush, thread_reap };
+
+/**
+ * @brief Start the first backend which can be started, trying `wanted` first, with `queue_lock` held.
+ *
+ * @param wanted The backend to try first, or NULL.
+ */
+static void start_backend(const IoBackend* wanted) {
+    if (backend != NULL) { return; }
+    const IoBackend* order[] = { wanted ? wanted : &io_uring_backend, &io_thread_backend, &io_sync_backend };
+    for (int i = 0; backend == NULL; i++) {
+        if (order[i]->start() == 0) { backend = order[i]; }
+    }
+}
+
+/**
+ * @brief Pick the backend used for batches.
+ *
+ * Does nothing if a backend was already started.
+ * Falls back from `backend` (or io_uring if NULL) to the thread pool and then to blocking calls
+ * when a backend can't be started.
+ *
+ * @param wanted The backend to try first, or NULL.
+ */
+void io_start(const IoBackend* wanted) {
+    sigset_t old;
+    enter_critical(&old);
+    start_backend(wanted);
+    leave_critical(&old);
+}
+
+/**
+ * @brief Get the name of the backend in use.
+ *
+ * @return The name, or "none" before `io_start`.
+ */
+const char* io_backend_name() {
+    return backend ? backend->name : "none";
+}
+
+/**
+ * @brief Start an empty batch.
+ *
+ * @param batch The batch.
+ */
+void io_batch_init(IoBatch* batch) {
+    *batch = (IoBatch) { NULL, 0, 0, NULL, 0, 0, 0 };
+}
+
+/**
+ * @brief Allocate a request with room for `count` buffers and `extra` bytes after it.
+ *
+ * @return The request, its `iov` set up.
+ * @param count Number of buffers.
+ * @param extra Number of further bytes.
+ */
+static IoRequest* new_request(int count, int extra) {
+    IoRequest* r = (IoRequest*) malloc(sizeof(IoRequest) + count * sizeof(struct iovec) + extra);
+    if (r == NULL) {
+        cur_errno = ERR_PERM;
+        p_perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    r->iov = (struct iovec*) (r + 1);
+    r->count = count;
+    return r;
+}
+
+/**
+ * @brief Add request `r` to `batch`, or carry it out now if `batch` is NULL.
+ *
+ * @param batch The batch or NULL.
+ * @param r The request, freed when done.
+ */
+static void add_request(IoBatch* batch, IoRequest* r) {
+    r->size = 0;
+    for (int i = 0; i < r->count; i++) {
+        r->size += r->iov[i].iov_len;
+    }
+    if (batch == NULL) {
+        r->result = transfer(r);
+        settle(r);
+        free(r);
+        return;
+    }
+    if (batch->count == batch->cap) {
+        batch->cap = batch->cap ? 2 * batch->cap : 8;
+        batch->requests = (IoRequest**) realloc(batch->requests, batch->cap * sizeof(IoRequest*));
+        if (batch->requests == NULL) {
+            cur_errno = ERR_PERM;
+            p_perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    r->batch = batch;
+    batch->requests[batch->count++] = r;
+}
+
+/**
+ * @brief Read from host offset `at` of `fd` into each buffer of `iov` in turn.
+ *
+ * Bytes past the end of the host file read as zeroes.
+ * The buffers must stay valid until the batch is finished.
+ *
+ * @param batch The batch, or NULL to read now.
+ * @param fd Host file descriptor.
+ * @param at Host offset.
+ * @param iov Buffers to fill, copied so they needn't outlive the call.
+ * @param count Number of buffers.
+ */
+void io_read(IoBatch* batch, int fd, off_t at, struct iovec* iov, int count) {
+    IoRequest* r = new_request(count, 0);
+    r->fd = fd;
+    r->write = false;
+    r->at = at;
+    memcpy(r->iov, iov, count * sizeof(struct iovec));
+    add_request(batch, r);
+}
+
+/**
+ * @brief Write `size` bytes from `buf` at host offset `at` of `fd`.
+ *
+ * @param batch The batch, or NULL to write now.
+ * @param fd Host file descriptor.
+ * @param at Host offset.
+ * @param buf Bytes to write, which must stay valid until the batch is finished unless `copy`.
+ * @param size Number of bytes.
+ * @param copy Take a copy of `buf` so the caller can reuse it straight away?
+ */
+void io_write(IoBatch* batch, int fd, off_t at, void* buf, int size, bool copy) {
+    copy = copy && batch != NULL;
+    IoRequest* r = new_request(1, copy ? size : 0);
+    r->fd = fd;
+    r->write = true;
+    r->at = at;
+    r->iov[0] = (struct iovec) { copy ? (void*) (r->iov + 1) : buf, size };
+    if (copy) { memcpy(r->iov + 1, buf, size); }
+    add_request(batch, r);
+}
+
+/**
+ * @brief Copy `size` bytes from `src` to `dst` once the batch's requests are done.
+ *
+ * Used to hand on data read into an intermediate buffer.
+ *
+ * @param batch The batch, or NULL to copy now.
+ * @param dst Where to copy to.
+ * @param src Where to copy from.
+ * @param size Number of bytes.
+ * @param pin Decremented after the copy, or NULL.
+ */
+void io_copy(IoBatch* batch, void* dst, void* src, int size, atomic_int* pin) {
+    if (batch == NULL) {
+        memcpy(dst, src, size);
+        if (pin) { atomic_fetch_sub(pin, 1); }
+        return;
+    }
+    if (batch->copy_count == batch->copy_cap) {
+        batch->copy_cap = batch->copy_cap ? 2 * batch->copy_cap : 4;
+        batch->copies = (IoCopy*) realloc(batch->copies, batch->copy_cap * sizeof(IoCopy));
+        if (batch->copies == NULL) {
+            cur_errno = ERR_PERM;
+            p_perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    batch->copies[batch->copy_count++] = (IoCopy) { dst, src, size, pin };
+}
+
+/**
+ * @brief Wait until every request of a submitted batch is done.
+ *
+ * @param batch The batch.
+ */
+void io_wait(IoBatch* batch) {
+    if (atomic_load(&batch->remaining) == 0) { return; }
+    sigset_t old;
+    enter_critical(&old);
+    while (atomic_load(&batch->remaining) > 0) {
+        backend->reap(true);
+    }
+    leave_critical(&old);
+}
+
+/**
+ * @brief Wait for a submitted batch, check its results, make its copies and free it.
+ *
+ * @param batch The batch.
+ */
+static void io_settle(IoBatch* batch) {
+    io_wait(batch);
+    sigset_t old;
+    enter_critical(&old);
+    for (int i = 0; i < batch->count; i++) {
+        settle(batch->requests[i]);
+        free(batch->requests[i]);
+    }
+    for (int i = 0; i < batch->copy_count; i++) {
+        IoCopy* c = &batch->copies[i];
+        memcpy(c->dst, c->src, c->size);
+        if (c->pin) { atomic_fetch_sub(c->pin, 1); }
+    }
+    free(batch->requests);
+    free(batch->copies);
+    io_batch_init(batch);
+    leave_critical(&old);
+}
+
+/**
+ * @brief Submit every request of `batch` and return once they are all done.
+ *
+ * The requests are submitted together, with a single system call for io_uring.
+ * Afterwards results are checked, copies are made and the batch is empty again.
+ *
+ * @param batch The batch.
+ */
+void io_finish(IoBatch* batch) {
+    sigset_t old;
+    enter_critical(&old);
+    start_backend(NULL);
+    atomic_store(&batch->remaining, batch->count);
+    for (int i = 0; i < batch->count; i++) {
+        while (atomic_load(&inflight) >= IO_QUEUE_DEPTH) {
+            backend->flush();
+            backend->reap(true);
+        }
+        atomic_fetch_add(&inflight, 1);
+        backend->submit(batch->requests[i]);
+    }
+    backend->flush();
+    leave_critical(&old);
+    io_settle(batch);
+}
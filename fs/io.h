@@ -0,0 +1,178 @@
+#ifndef IO
+#define IO
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * @file io.h
+ * @brief Batched host I/O through a pluggable asynchronous backend.
+ */
+
+/**
+ * @brief A host read or write, part of a batch.
+ */
+typedef struct io_request {
+    /**
+    * @brief Host file descriptor.
+    */
+    int fd;
+    /**
+    * @brief Is this a write?
+    */
+    bool write;
+    /**
+    * @brief Host offset.
+    */
+    off_t at;
+    /**
+    * @brief Buffers, stored right after the request.
+    */
+    struct iovec* iov;
+    /**
+    * @brief Number of buffers.
+    */
+    int count;
+    /**
+    * @brief Total number of bytes in the buffers.
+    */
+    size_t size;
+    /**
+    * @brief Bytes transferred, or minus the error number on failure.
+    */
+    ssize_t result;
+    /**
+    * @brief The batch the request belongs to.
+    */
+    struct io_batch* batch;
+} IoRequest;
+
+/**
+ * @brief A copy to make once a batch's reads are done, see `io_copy`.
+ */
+typedef struct io_copy {
+    /**
+    * @brief Where to copy to.
+    */
+    void* dst;
+    /**
+    * @brief Where to copy from.
+    */
+    void* src;
+    /**
+    * @brief Number of bytes.
+    */
+    int size;
+    /**
+    * @brief Decremented after the copy, or NULL.
+    */
+    atomic_int* pin;
+} IoCopy;
+
+/**
+ * @brief Host reads and writes which are submitted together and waited for together.
+ *
+ * Initialize with `io_batch_init`, add requests with `io_read` and `io_write` and
+ * submit with `io_finish`. The requests in a batch must not overlap.
+ */
+typedef struct io_batch {
+    /**
+    * @brief The requests.
+    */
+    IoRequest** requests;
+    /**
+    * @brief Number of requests.
+    */
+    int count;
+    /**
+    * @brief Capacity of `requests`.
+    */
+    int cap;
+    /**
+    * @brief Copies to make once the requests are done.
+    */
+    IoCopy* copies;
+    /**
+    * @brief Number of copies.
+    */
+    int copy_count;
+    /**
+    * @brief Capacity of `copies`.
+    */
+    int copy_cap;
+    /**
+    * @brief Number of submitted requests not yet done.
+    */
+    atomic_int remaining;
+} IoBatch;
+
+/**
+ * @brief A way of carrying out host I/O asynchronously.
+ */
+typedef struct io_backend {
+    /**
+    * @brief Name shown in statistics.
+    */
+    const char* name;
+    /**
+    * @brief Get ready for requests.
+    *
+    * @return 0 on success and -1 if the backend isn't available.
+    */
+    int (*start)();
+    /**
+    * @brief Queue request `r`. It may not start until `flush` is called.
+    */
+    void (*submit)(IoRequest* r);
+    /**
+    * @brief Start every queued request.
+    */
+    void (*flush)();
+    /**
+    * @brief Collect finished requests, waiting for at least one if `block` is true.
+    */
+    void (*reap)(bool block);
+} IoBackend;
+
+/**
+ * @brief Maximum number of requests in flight at once.
+ */
+#define IO_QUEUE_DEPTH 256
+
+/**
+ * @brief Number of worker threads in the thread pool backend.
+ */
+#define IO_THREADS 4
+
+// Documentation in io.c
+
+extern const IoBackend io_uring_backend;
+
+extern const IoBackend io_thread_backend;
+
+extern const IoBackend io_sync_backend;
+
+void io_start(const IoBackend* backend);
+
+const char* io_backend_name();
+
+void io_block_signals(sigset_t* old);
+
+void io_restore_signals(sigset_t* old);
+
+void io_batch_init(IoBatch* batch);
+
+void io_read(IoBatch* batch, int fd, off_t at, struct iovec* iov, int count);
+
+void io_write(IoBatch* batch, int fd, off_t at, void* buf, int size, bool copy);
+
+void io_copy(IoBatch* batch, void* dst, void* src, int size, atomic_int* pin);
+
+void io_finish(IoBatch* batch);
+
+void io_wait(IoBatch* batch);
+
+#endif
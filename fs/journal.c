@@ -0,0 +1,458 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include "journal.h"
+#include "../error.h"
+
+/**
+ * @file journal.c
+ * @brief An implementation of the metadata redo journal.
+ *
+ * Metadata writes made during an operation are logged here instead of going to their home
+ * locations. On commit they are appended to the journal region as one transaction and flushed
+ * together with any data written by the operation, and only then written to their homes.
+ * A crash therefore leaves each transaction either absent or complete in the journal,
+ * and mount replays complete ones. Homes are flushed lazily at the next checkpoint,
+ * which happens when the journal fills up and on unmount.
+ *
+ * The region starts with a header holding the sequence number of the first valid transaction.
+ * Each transaction is a header (magic, sequence number, payload length, checksum) followed by
+ * records of an 8 byte host offset, a 2 byte length and that many bytes.
+ */
+
+/**
+ * @brief Marks the journal region header.
+ */
+#define HEAD_MAGIC 0x4c4e4a50
+
+/**
+ * @brief Marks the start of a transaction.
+ */
+#define TXN_MAGIC 0x4e585451
+
+/**
+ * @brief Bytes reserved for the region header.
+ */
+#define HEAD_SIZE 16
+
+/**
+ * @brief Bytes in a transaction header.
+ */
+#define TXN_HEADER 16
+
+/**
+ * @brief Bytes in a record header.
+ */
+#define RECORD_HEADER 10
+
+/**
+ * @brief Host file descriptor of the filesystem.
+ */
+static int journal_fd;
+
+/**
+ * @brief Host offset of the journal region.
+ */
+static off_t start;
+
+/**
+ * @brief Host offset where the next transaction is appended.
+ */
+static off_t head;
+
+/**
+ * @brief Sequence number of the next transaction.
+ */
+static uint32_t seq;
+
+/**
+ * @brief The open transaction, a transaction header followed by records.
+ */
+static uint8_t* txn = NULL;
+
+/**
+ * @brief Bytes used in `txn`, including the transaction header.
+ */
+static int txn_len;
+
+/**
+ * @brief Bytes allocated for `txn`.
+ */
+static int txn_cap;
+
+/**
+ * @brief Offset in `txn` of the last record, or -1 if there are none.
+ */
+static int last_record;
+
+/**
+ * @brief Bytes used in `txn` when the current operation began, see `journal_begin_op`.
+ */
+static int op_mark = TXN_HEADER;
+
+/**
+ * @brief Read `size` bytes at host offset `offset`.
+ *
+ * @param offset Host offset.
+ * @param buf Buffer to read into.
+ * @param size Number of bytes to read.
+ * @return Number of bytes read.
+ */
+static int host_read(off_t offset, void* buf, int size) {
+    int n = pread(journal_fd, buf, size, offset);
+    if (n == -1) {
+        cur_errno = ERR_PERM;
+        p_perror("pread");
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+/**
+ * @brief Write `size` bytes at offset `offset` of host file `fd`.
+ *
+ * @param fd Host file descriptor.
+ * @param offset Host offset.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
+ */
+static void write_at(int fd, off_t offset, void* buf, int size) {
+    if (pwrite(fd, buf, size, offset) == -1) {
+        cur_errno = ERR_PERM;
+        p_perror("pwrite");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Write `size` bytes at host offset `offset`.
+ *
+ * @param offset Host offset.
+ * @param buf Buffer to write from.
+ * @param size Number of bytes to write.
+ */
+static void host_write(off_t offset, void* buf, int size) {
+    write_at(journal_fd, offset, buf, size);
+}
+
+/**
+ * @brief Flush everything written to the host file.
+ */
+static void host_flush() {
+    if (fdatasync(journal_fd) == -1) {
+        cur_errno = ERR_PERM;
+        p_perror("fdatasync");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Checksum a transaction payload together with its sequence number (FNV-1a).
+ *
+ * @return The checksum.
+ * @param s The transaction's sequence number.
+ * @param buf The payload.
+ * @param size Number of bytes in the payload.
+ */
+static uint32_t checksum(uint32_t s, uint8_t* buf, int size) {
+    uint32_t h = 2166136261u ^ s;
+    for (int i = 0; i < size; i++) {
+        h = (h ^ buf[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Write a region header saying transactions start at sequence number `s`.
+ *
+ * @param fd Host file descriptor.
+ * @param offset Host offset of the journal region.
+ * @param s Sequence number of the first valid transaction.
+ */
+static void write_head(int fd, off_t offset, uint32_t s) {
+    uint32_t h[HEAD_SIZE / 4] = { HEAD_MAGIC, s, 0, 0 };
+    write_at(fd, offset, h, HEAD_SIZE);
+}
+
+/**
+ * @brief Empty the open transaction.
+ */
+static void txn_reset() {
+    txn_len = TXN_HEADER;
+    last_record = -1;
+    op_mark = TXN_HEADER;
+}
+
+/**
+ * @brief Make room for `size` more bytes in the open transaction.
+ *
+ * @param size Number of bytes needed.
+ */
+static void txn_reserve(int size) {
+    if (txn_len + size <= txn_cap) { return; }
+    while (txn_len + size > txn_cap) { txn_cap *= 2; }
+    txn = (uint8_t*) realloc(txn, txn_cap);
+    if (txn == NULL) {
+        cur_errno = ERR_PERM;
+        p_perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Call `apply` on each record in `payload`.
+ *
+ * @param payload Records back to back.
+ * @param size Number of bytes of records.
+ * @param apply Called with each record's host offset and bytes.
+ */
+static void apply_records(uint8_t* payload, int size, JournalApply apply) {
+    int i = 0;
+    while (i < size) {
+        int64_t offset;
+        uint16_t n;
+        memcpy(&offset, payload + i, 8);
+        memcpy(&n, payload + i + 8, 2);
+        apply(offset, payload + i + RECORD_HEADER, n);
+        i += RECORD_HEADER + n;
+    }
+}
+
+/**
+ * @brief Write an empty journal into a new filesystem.
+ *
+ * Doesn't disturb the journal of the mounted filesystem, if any.
+ *
+ * @param fd Host file descriptor of the new filesystem.
+ * @param offset Host offset of its journal region.
+ */
+void journal_format(int fd, off_t offset) {
+    write_head(fd, offset, 1);
+}
+
+/**
+ * @brief Start journaling to the region at `new_start` in the mounted filesystem.
+ *
+ * Call `journal_replay` before anything else.
+ *
+ * @param fd Host file descriptor of the filesystem.
+ * @param new_start Host offset of the journal region.
+ */
+void journal_open(int fd, off_t new_start) {
+    journal_fd = fd;
+    start = new_start;
+    head = start + HEAD_SIZE;
+    if (txn == NULL) {
+        txn_cap = 4096;
+        txn = (uint8_t*) malloc(txn_cap);
+        if (txn == NULL) {
+            cur_errno = ERR_PERM;
+            p_perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    txn_reset();
+}
+
+/**
+ * @brief Stop journaling and release the open transaction.
+ *
+ * Anything still logged is dropped, commit first.
+ */
+void journal_close() {
+    free(txn);
+    txn = NULL;
+    txn_cap = 0;
+}
+
+/**
+ * @brief Redo every complete transaction left in the journal, then empty it.
+ *
+ * Transactions are applied in order until one is missing, torn or out of sequence.
+ * Replaying a transaction twice is harmless.
+ *
+ * @return The number of transactions replayed.
+ * @param apply Writes a record to its home location.
+ */
+int journal_replay(JournalApply apply) {
+    uint32_t h[HEAD_SIZE / 4];
+    seq = 1;
+    if (host_read(start, h, HEAD_SIZE) == HEAD_SIZE && h[0] == HEAD_MAGIC) {
+        seq = h[1];
+    }
+    int count = 0;
+    off_t end = start + JOURNAL_SIZE;
+    while (head + TXN_HEADER <= end) {
+        uint32_t t[TXN_HEADER / 4];
+        if (host_read(head, t, TXN_HEADER) != TXN_HEADER) { break; }
+        if (t[0] != TXN_MAGIC || t[1] != seq || t[2] > (uint64_t) (end - head - TXN_HEADER)) { break; }
+        uint8_t* payload = (uint8_t*) malloc(t[2]);
+        if (payload == NULL) {
+            cur_errno = ERR_PERM;
+            p_perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (host_read(head + TXN_HEADER, payload, t[2]) != (int) t[2] || checksum(seq, payload, t[2]) != t[3]) {
+            free(payload);
+            break;
+        }
+        apply_records(payload, t[2], apply);
+        free(payload);
+        head += TXN_HEADER + t[2];
+        seq++;
+        count++;
+    }
+    journal_checkpoint();
+    return count;
+}
+
+/**
+ * @brief Log a write of `size` bytes at host offset `offset` in the open transaction.
+ *
+ * Nothing is written to the host until `journal_commit`.
+ * A write inside or directly after the previous one is merged into it.
+ *
+ * @param offset Host offset of the home location.
+ * @param buf Bytes to write.
+ * @param size Number of bytes, less than 65536.
+ */
+void journal_log(off_t offset, void* buf, int size) {
+    if (last_record != -1) {
+        int64_t lo;
+        uint16_t n;
+        memcpy(&lo, txn + last_record, 8);
+        memcpy(&n, txn + last_record + 8, 2);
+        if (offset >= lo && offset + size <= lo + n) {
+            memcpy(txn + last_record + RECORD_HEADER + (offset - lo), buf, size);
+            return;
+        }
+        if (offset == lo + n && n + size <= 0xFFFF) {
+            txn_reserve(size);
+            memcpy(txn + txn_len, buf, size);
+            txn_len += size;
+            n += size;
+            memcpy(txn + last_record + 8, &n, 2);
+            return;
+        }
+    }
+    txn_reserve(RECORD_HEADER + size);
+    int64_t lo = offset;
+    uint16_t n = size;
+    last_record = txn_len;
+    memcpy(txn + txn_len, &lo, 8);
+    memcpy(txn + txn_len + 8, &n, 2);
+    memcpy(txn + txn_len + RECORD_HEADER, buf, size);
+    txn_len += RECORD_HEADER + size;
+}
+
+/**
+ * @brief Mark the start of an operation, whose writes `journal_abort_op` drops if it fails.
+ *
+ * Its writes are never merged into records logged before the mark.
+ */
+void journal_begin_op() {
+    op_mark = txn_len;
+    last_record = -1;
+}
+
+/**
+ * @brief Drop every write logged since `journal_begin_op`.
+ */
+void journal_abort_op() {
+    txn_len = op_mark;
+    last_record = -1;
+}
+
+/**
+ * @brief Patch `buf`, just read from host offset `offset`, with writes logged but not yet applied.
+ *
+ * @param offset Host offset `buf` was read from.
+ * @param buf Bytes read.
+ * @param size Number of bytes read.
+ */
+void journal_overlay(off_t offset, void* buf, int size) {
+    int i = TXN_HEADER;
+    while (i < txn_len) {
+        int64_t lo;
+        uint16_t n;
+        memcpy(&lo, txn + i, 8);
+        memcpy(&n, txn + i + 8, 2);
+        off_t from = offset > lo ? offset : lo;
+        off_t to = offset + size < lo + n ? offset + size : lo + n;
+        if (from < to) {
+            memcpy((uint8_t*) buf + (from - offset), txn + i + RECORD_HEADER + (from - lo), to - from);
+        }
+        i += RECORD_HEADER + n;
+    }
+}
+
+/**
+ * @brief Are there logged writes not yet committed?
+ *
+ * @return True if the open transaction is not empty.
+ */
+bool journal_pending() {
+    return txn != NULL && txn_len > TXN_HEADER;
+}
+
+/**
+ * @brief Get the size of the open transaction.
+ *
+ * @return Number of bytes the open transaction would take in the journal.
+ */
+int journal_pending_bytes() {
+    return txn_len;
+}
+
+/**
+ * @brief Commit the open transaction.
+ *
+ * The transaction is appended to the journal in one write and flushed in one fdatasync,
+ * which also flushes any data written since the last commit. Then each write is handed
+ * to `apply` to be written to its home location. If the journal has no room it is
+ * checkpointed first. A transaction too big for the journal is applied and flushed
+ * directly, losing atomicity but not durability.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param apply Writes a record to its home location.
+ */
+int journal_commit(JournalApply apply) {
+    if (!journal_pending()) { return 0; }
+    int payload = txn_len - TXN_HEADER;
+    if (txn_len > JOURNAL_SIZE - HEAD_SIZE) {
+        apply_records(txn + TXN_HEADER, payload, apply);
+        host_flush();
+        txn_reset();
+        return 0;
+    }
+    if (head + txn_len > start + JOURNAL_SIZE) {
+        journal_checkpoint();
+    }
+    uint32_t t[TXN_HEADER / 4] = { TXN_MAGIC, seq, payload, checksum(seq, txn + TXN_HEADER, payload) };
+    memcpy(txn, t, TXN_HEADER);
+    host_write(head, txn, txn_len);
+    host_flush();
+    apply_records(txn + TXN_HEADER, payload, apply);
+    head += txn_len;
+    seq++;
+    txn_reset();
+    return 0;
+}
+
+/**
+ * @brief Make every applied transaction durable in place and empty the journal.
+ *
+ * The open transaction is kept.
+ *
+ * @return -1 on failure and 0 on success.
+ */
+int journal_checkpoint() {
+    host_flush();
+    write_head(journal_fd, start, seq);
+    host_flush();
+    head = start + HEAD_SIZE;
+    return 0;
+}
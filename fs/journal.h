@@ -0,0 +1,50 @@
+#ifndef JOURNAL
+#define JOURNAL
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * @file journal.h
+ * @brief A redo journal making metadata updates atomic and durable with one flush.
+ */
+
+/**
+ * @brief Size in bytes of the journal region at the end of a journaled filesystem.
+ *
+ * A multiple of every supported block size.
+ */
+#define JOURNAL_SIZE (256 * 1024)
+
+/**
+ * @brief Called with each logged write once its transaction is safely in the journal.
+ */
+typedef void (*JournalApply)(off_t offset, uint8_t* buf, int size);
+
+// Documentation in journal.c
+
+void journal_format(int fd, off_t offset);
+
+void journal_open(int fd, off_t start);
+
+void journal_close();
+
+int journal_replay(JournalApply apply);
+
+void journal_log(off_t offset, void* buf, int size);
+
+void journal_begin_op();
+
+void journal_abort_op();
+
+void journal_overlay(off_t offset, void* buf, int size);
+
+bool journal_pending();
+
+int journal_pending_bytes();
+
+int journal_commit(JournalApply apply);
+
+int journal_checkpoint();
+
+#endif
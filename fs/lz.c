@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "lz.h"
+
+/**
+ * @file lz.c
+ * @brief An implementation of the codec.
+ *
+ * Compressed data is a sequence of sequences, each a run of literal bytes followed by a match:
+ * a copy of earlier output. A sequence begins with a token byte holding the number of literals
+ * in its high nibble and the match length less `LZ_MIN_MATCH` in its low nibble. A nibble of 15
+ * means more length follows after the token (for literals) or the offset (for the match), as
+ * bytes which are added on until one is less than 255. The literals come next, then the match
+ * offset as two little endian bytes counting back from the end of the output. The last sequence
+ * stops after its literals, which is how the end of the data is found.
+ *
+ * Matches are found greedily through a hash table of the last position each 4-byte string
+ * was seen at. The search skips ahead faster the longer it goes without a match, so data
+ * which doesn't compress costs little time.
+ */
+
+/**
+ * @brief Shortest match worth encoding.
+ */
+#define LZ_MIN_MATCH 4
+
+/**
+ * @brief Furthest back a match may begin.
+ */
+#define LZ_MAX_OFFSET 0xFFFF
+
+/**
+ * @brief Number of bits in a hash, the table has `1 << LZ_HASH_BITS` entries.
+ */
+#define LZ_HASH_BITS 12
+
+/**
+ * @brief Bytes without a match after which the search step grows by one.
+ */
+#define LZ_SKIP_BYTES 64
+
+/**
+ * @brief Work done so far, added to atomically.
+ */
+static LzStats stats = { 0, 0, 0, 0, 0 };
+
+/**
+ * @brief Current time in nanoseconds, for the stats.
+ *
+ * @return Nanoseconds on a monotonic clock.
+ */
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * @brief Hash the 4 bytes at `p`.
+ *
+ * @return A hash of `LZ_HASH_BITS` bits.
+ */
+static uint32_t lz_hash(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief Number of bytes needed for the part of a length which doesn't fit in its nibble.
+ *
+ * @return The number of extra length bytes.
+ * @param n The length stored in the nibble, literals or match length less `LZ_MIN_MATCH`.
+ */
+static int extra_bytes(int n) {
+    return n < 15 ? 0 : (n - 15) / 255 + 1;
+}
+
+/**
+ * @brief Write the part of a length which doesn't fit in its nibble.
+ *
+ * @return The output after the bytes written.
+ * @param out Where to write.
+ * @param n The length stored in the nibble, at least 15.
+ */
+static uint8_t* put_extra(uint8_t* out, int n) {
+    for (n -= 15; n >= 255; n -= 255) { *out++ = 255; }
+    *out++ = n;
+    return out;
+}
+
+/**
+ * @brief Write a sequence of `count` literals from `literals` followed by a match.
+ *
+ * @return The output after the sequence, or NULL if it doesn't fit.
+ * @param out Where to write.
+ * @param end End of the output buffer.
+ * @param literals The literal bytes.
+ * @param count Number of literals.
+ * @param offset Distance back the match begins at, unused if there is no match.
+ * @param match Match length, or 0 for the last sequence.
+ */
+static uint8_t* put_sequence(uint8_t* out, uint8_t* end, const uint8_t* literals, int count, int offset, int match) {
+    int m = match > 0 ? match - LZ_MIN_MATCH : 0;
+    int need = 1 + extra_bytes(count) + count + (match > 0 ? 2 + extra_bytes(m) : 0);
+    if (end - out < need) { return NULL; }
+    *out++ = (count < 15 ? count : 15) << 4 | (m < 15 ? m : 15);
+    if (count >= 15) { out = put_extra(out, count); }
+    memcpy(out, literals, count);
+    out += count;
+    if (match == 0) { return out; }
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+    if (m >= 15) { out = put_extra(out, m); }
+    return out;
+}
+
+/**
+ * @brief Compress `size` bytes from `src` into `dst`.
+ *
+ * @return The number of bytes of compressed data, or 0 if it wouldn't fit in `cap` bytes.
+ * @param src Data to compress.
+ * @param size Number of bytes to compress.
+ * @param dst Buffer to compress into.
+ * @param cap Size of `dst`.
+ */
+int lz_compress(const uint8_t* src, int size, uint8_t* dst, int cap) {
+    long start = now_ns();
+    // Positions are stored plus one so that zero means none
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t* p = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + size;
+    uint8_t* out = dst;
+    uint8_t* out_end = dst + cap;
+    while (out != NULL && end - p >= LZ_MIN_MATCH) {
+        uint32_t h = lz_hash(p);
+        const uint8_t* candidate = table[h] != 0 ? src + table[h] - 1 : NULL;
+        table[h] = p - src + 1;
+        if (candidate == NULL || p - candidate > LZ_MAX_OFFSET || memcmp(candidate, p, LZ_MIN_MATCH) != 0) {
+            p += 1 + (p - anchor) / LZ_SKIP_BYTES;
+            continue;
+        }
+        const uint8_t* q = p + LZ_MIN_MATCH;
+        const uint8_t* r = candidate + LZ_MIN_MATCH;
+        while (q < end && *q == *r) {
+            q++;
+            r++;
+        }
+        out = put_sequence(out, out_end, anchor, p - anchor, p - candidate, q - p);
+        p = anchor = q;
+    }
+    if (out != NULL) { out = put_sequence(out, out_end, anchor, end - anchor, 0, 0); }
+    int n = out != NULL ? out - dst : 0;
+    __atomic_fetch_add(&stats.compressed_in, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.compressed_out, n != 0 ? n : size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.compress_ns, now_ns() - start, __ATOMIC_RELAXED);
+    return n;
+}
+
+/**
+ * @brief Read the part of a length which didn't fit in its nibble.
+ *
+ * @return The full length, or -1 if the input ends first.
+ * @param in Where to read from, advanced past the bytes read.
+ * @param end End of the input.
+ * @param n The length stored in the nibble.
+ */
+static int get_length(const uint8_t** in, const uint8_t* end, int n) {
+    if (n < 15) { return n; }
+    while (true) {
+        if (*in == end) { return -1; }
+        uint8_t b = *(*in)++;
+        n += b;
+        if (b < 255) { return n; }
+    }
+}
+
+/**
+ * @brief Decompress `size` bytes from `src` into `dst`.
+ *
+ * @return The number of bytes of decompressed data, or -1 if `src` is malformed or decompresses to more than `cap` bytes.
+ * @param src Data to decompress.
+ * @param size Number of bytes to decompress.
+ * @param dst Buffer to decompress into.
+ * @param cap Size of `dst`.
+ */
+int lz_decompress(const uint8_t* src, int size, uint8_t* dst, int cap) {
+    long start = now_ns();
+    const uint8_t* in = src;
+    const uint8_t* end = src + size;
+    uint8_t* out = dst;
+    int n = -1;
+    while (in < end) {
+        uint8_t token = *in++;
+        int count = get_length(&in, end, token >> 4);
+        if (count == -1 || count > end - in || count > dst + cap - out) { break; }
+        memcpy(out, in, count);
+        in += count;
+        out += count;
+        if (in == end) {
+            n = out - dst;
+            break;
+        }
+        if (end - in < 2) { break; }
+        int offset = in[0] | in[1] << 8;
+        in += 2;
+        int match = get_length(&in, end, token & 0xF);
+        if (offset == 0 || offset > out - dst || match == -1) { break; }
+        match += LZ_MIN_MATCH;
+        if (match > dst + cap - out) { break; }
+        // Byte by byte as the match may overlap what it copies
+        for (uint8_t* from = out - offset; match > 0; match--) { *out++ = *from++; }
+    }
+    if (n != -1) { __atomic_fetch_add(&stats.decompressed, n, __ATOMIC_RELAXED); }
+    __atomic_fetch_add(&stats.decompress_ns, now_ns() - start, __ATOMIC_RELAXED);
+    return n;
+}
+
+/**
+ * @brief Get the codec's counters.
+ *
+ * @return The work done and time taken so far.
+ */
+LzStats lz_stats() {
+    return (LzStats) {
+        __atomic_load_n(&stats.compressed_in, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.compressed_out, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.compress_ns, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.decompressed, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.decompress_ns, __ATOMIC_RELAXED)
+    };
+}
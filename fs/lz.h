@@ -0,0 +1,44 @@
+#ifndef LZ
+#define LZ
+#include <stdint.h>
+
+/**
+ * @file lz.h
+ * @brief A small LZ77 codec in the style of LZ4, used for compressed files.
+ */
+
+/**
+ * @brief Counters describing how much work the codec has done and how long it took.
+ */
+typedef struct lz_stats {
+    /**
+    * @brief Number of bytes given to `lz_compress`.
+    */
+    long compressed_in;
+    /**
+    * @brief Number of bytes stored for them, counting input which didn't compress as stored as is.
+    */
+    long compressed_out;
+    /**
+    * @brief Time spent compressing in nanoseconds.
+    */
+    long compress_ns;
+    /**
+    * @brief Number of bytes produced by `lz_decompress`.
+    */
+    long decompressed;
+    /**
+    * @brief Time spent decompressing in nanoseconds.
+    */
+    long decompress_ns;
+} LzStats;
+
+// Documentation in lz.c
+
+int lz_compress(const uint8_t* src, int size, uint8_t* dst, int cap);
+
+int lz_decompress(const uint8_t* src, int size, uint8_t* dst, int cap);
+
+LzStats lz_stats();
+
+#endif
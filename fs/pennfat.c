@@ -8,8 +8,15 @@
 #include <time.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "pennfat.h"
 #include "filesys.h"
+#include "cache.h"
+#include "io.h"
+#include "lz.h"
+#include "crc.h"
+#include "arena.h"
 #include "../error.h"
 
 /**
@@ -33,6 +40,26 @@ const char* MONTHS2[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug",
  */
 bool mounted = false;
 
+/**
+ * @brief Scratch arena of the command being run, released when it returns to the main loop.
+ */
+Arena* command_scratch = NULL;
+
+/**
+ * @brief Bytes read by one `read_file` call in `bench`.
+ */
+#define BENCH_CHUNK 65536
+
+/**
+ * @brief Bytes each reader thread reads in one `bench` run.
+ */
+#define BENCH_BYTES (64 << 20)
+
+/**
+ * @brief Most reader threads `bench` runs at once.
+ */
+#define BENCH_MAX_THREADS 64
+
 /**
  * @brief A sized byte array type.
  */
@@ -58,69 +85,17 @@ void arg_error2(char* err) {
 }
 
 /**
- * @brief Computes a parsed absolute path string to the file located at `name`.
+ * @brief Computes a parsed absolute path string to the file located at `name`, see `join_path`.
  *
- * If `name` is an absolute path (begins with '\') it is returned.
- * If `name` is a relative path we append it to the global `pwd` variable.
- * "Parsed" means that all dots are removed from the returned string.
- * Single dots '.' do nothing.
- * Double dots '..' go up one directory (unless at root).
+ * Relative paths are relative to the global `pwd2` variable.
+ * The path is only valid until the command returns, see `command_scratch`.
  *
  * @return The path from the root directory to the file.
  * @param name The location of the file.
  */
 char* abs_path2(char* name) {
-    // Get full path with extra chars (. and ..)
-    char* path_str;
-    int len;
-    if (name[0] != '/') {
-        len = strlen(pwd2) + strlen(name) + 1; // middle slash
-        path_str = (char*) malloc(len + 1);
-        strcpy(path_str, pwd2);
-        strcat(path_str, "/");
-        strcat(path_str, name);
-    } else {
-        len = strlen(name) + 1;
-        path_str = (char*) malloc(len + 1);
-        strcat(path_str, name);
-    }
-    // Compute number of tokens
-    char tmp[len + 1];
-    strcpy(tmp, path_str);
-    int argc = 0;
-    if (strtok(tmp, "/")) { argc++; }
-    while (strtok(NULL, "/")) { argc++; }
-    // Build raw token sequence
-    char** tokens = malloc(sizeof(char*) * argc);
-    tokens[0] = strtok(path_str, "/");
-    for (int i = 1; i < argc; i++) { 
-        tokens[i] = strtok(NULL, "/");
-    }
-    // Build logical token sequence
-    // Recall: . = do nothing, .. = go back a token
-    char** path = malloc(sizeof(char*) * argc);
-    int i = 0; // ptr past last token
-    for (int j = 0; j < argc; ++j) {
-        if ((strcmp(tokens[j], "..")) == 0) {
-            if (i > 0) { --i; }
-        } else if ((strcmp(tokens[j], ".")) == 0) {
-            // do nothing
-        } else {
-            path[i] = tokens[j];
-            ++i;
-        }
-    }
-    // Build string
-    len = 2;
-    for (int j = 0; j < i; ++j) {
-        len += strlen(path[j]) + 1; // slash!
-    }
-    char* str = (char*) malloc(len);
-    str[0] = '\0';
-    for (int j = 0; j < i; ++j) {
-        strcat(str, "/");
-        strcat(str, path[j]);
-    }
+    char* str = (char*) arena_alloc(command_scratch, strlen(pwd2) + strlen(name) + 2);
+    join_path(str, pwd2, name);
     return str;
 }
 
@@ -155,6 +130,49 @@ Vec read_files2(char** names, int num) {
     return vec;
 }
 
+/**
+ * @brief Write the contents of each file in `names` to host file descriptor `fd` without copying them first.
+ *
+ * Only possible when the data region is mapped, see `mount -m`.
+ * Compressed files can't be borrowed and are read into a buffer instead.
+ * Skips any link files to write the file which is pointed to.
+ *
+ * @return -1 on failure and 0 on success.
+ * @param fd The host file descriptor to write to.
+ * @param names A sequence of paths to read from.
+ * @param num The number of files in the input.
+ */
+int write_borrowed(int fd, char** names, int num) {
+    for (int i = 0; i < num; ++i) {
+        File f = get_file(abs_path2(names[i]), true);
+        if (f.name[0] == 0) { return -1; }
+    }
+    for (int i = 0; i < num; ++i) {
+        char* path = abs_path2(names[i]);
+        File f = get_file(path, true);
+        int size = f.size;
+        if (f.perm & COMPRESSED_PERM) {
+            uint8_t* buf = (uint8_t*) malloc(size > 0 ? size : 1);
+            int n = read_file(path, 0, buf, size);
+            int ret = n == -1 ? -1 : write(fd, buf, n);
+            free(buf);
+            if (ret == -1) { return -1; }
+            continue;
+        }
+        int offset = 0;
+        Extent extents[16];
+        while (offset < size) {
+            int n = borrow_file(path, offset, size - offset, extents, 16);
+            if (n <= 0) { return -1; }
+            for (int j = 0; j < n; ++j) {
+                if (write(fd, extents[j].data, extents[j].size) == -1) { return -1; }
+                offset += extents[j].size;
+            }
+        }
+    }
+    return 0;
+}
+
 /**
  * @brief Makes a filesystem in the current directory on the host machine.
  *
@@ -170,8 +188,8 @@ void pf_mkfs(int argc, char** args) {
     if (argc == 3) { arg_error2("mkfs: Missing blocks size config\n"); return; }
     if (argc > 4) { arg_error2("mkfs: Too many arguments\n"); return; }
     int new_fat_blocks = atoi(args[2]);
-    if (new_fat_blocks < 1 || new_fat_blocks > 32) { 
-        arg_error2("mkfs: Blocks in fat must be integer in [1..32]\n"); return; 
+    if (new_fat_blocks < 1 || new_fat_blocks > 65536) { 
+        arg_error2("mkfs: Blocks in fat must be integer in [1..65536], above 32 uses 32-bit block numbers\n"); return; 
     }
     int new_block_size_config = atoi(args[3]);
     if (new_block_size_config < 0 || new_block_size_config > 4) {
@@ -189,19 +207,54 @@ void pf_mkfs(int argc, char** args) {
  *
  * Sets `pwd` and `mounted` variables appropriately.
  * Prints an error if another filesystem is already mounted.
+ * The optional -c flag sets how many blocks the block cache holds (0 disables it).
+ * The optional -d flag sets the durability level: none, group or strict (the default).
+ * The optional -m flag maps the data region into memory so reads need no copies through the cache.
+ * The optional -s flag mounts the named snapshot instead, read-only.
+ * The optional -D flag turns on dedup, so files written whole share blocks identical to ones already stored.
  *
  * @param args[1] Name of the filesystem.
+ * @param args[2...] Optional -c flag followed by a block count, -d flag followed by a level,
+ * -s flag followed by a snapshot name, -m flag and -D flag.
  */
 void pf_mount(int argc, char** args) {
     if (argc == 1) { cur_errno = ERR_INVAL; arg_error2("mount: Missing filesystem name\n"); return; }
-    if (argc > 2) { cur_errno = ERR_INVAL; arg_error2("mount: Too many arguments\n"); return; }
+    if (argc > 10) { cur_errno = ERR_INVAL; arg_error2("mount: Too many arguments\n"); return; }
+    int cache_blocks = DEFAULT_CACHE_BLOCKS;
+    int durability = DURABILITY_STRICT;
+    bool map = false;
+    bool dedup = false;
+    char* snapshot = NULL;
+    for (int i = 2; i < argc; i += 2) {
+        if (strcmp(args[i], "-m") == 0) { map = true; i--; continue; }
+        if (strcmp(args[i], "-D") == 0) { dedup = true; i--; continue; }
+        if (i + 1 == argc) { cur_errno = ERR_INVAL; arg_error2("mount: Missing option value\n"); return; }
+        if (strcmp(args[i], "-c") == 0) {
+            cache_blocks = atoi(args[i + 1]);
+            if (cache_blocks < 0) { arg_error2("mount: Cache blocks must be a non-negative integer\n"); return; }
+        } else if (strcmp(args[i], "-d") == 0) {
+            if (strcmp(args[i + 1], "none") == 0) { durability = DURABILITY_NONE; }
+            else if (strcmp(args[i + 1], "group") == 0) { durability = DURABILITY_GROUP; }
+            else if (strcmp(args[i + 1], "strict") == 0) { durability = DURABILITY_STRICT; }
+            else { cur_errno = ERR_INVAL; arg_error2("mount: Durability must be none, group or strict\n"); return; }
+        } else if (strcmp(args[i], "-s") == 0) {
+            snapshot = args[i + 1];
+        } else {
+            cur_errno = ERR_INVAL; arg_error2("mount: Unknown option\n"); return;
+        }
+    }
     if (mounted) { cur_errno = ERR_INVAL; arg_error2("mount: Another filesystem is currently mounted\n"); return; }
-    if (mount_fs(args[1]) == -1) { 
+    if ((snapshot ? mount_snapshot(args[1], snapshot) : mount_fs(args[1])) == -1) { 
         cur_errno = ERR_PERM;
         p_perror("mount"); 
         return; 
     }
+    if (cache_blocks != DEFAULT_CACHE_BLOCKS) { cache_resize(cache_blocks); }
+    set_durability(durability);
+    set_dedup(dedup);
+    if (map && map_data(true) == -1) { perror("mount"); }
     mounted = true;
+    free(pwd2);
     pwd2 = (char*) malloc(1);
     pwd2[0] = '\0';
 }
@@ -320,20 +373,24 @@ void pf_mv(int argc, char** args) {
         strcat(p2_new, name);
         p2 = p2_new;
     }
+    // Commit the rename as a whole
+    begin_txn();
     if (create_file(p2, f.type) == -1) {
-        if (errno != EEXIST) { perror("mv"); return; }
+        if (errno != EEXIST) { perror("mv"); end_txn(); return; }
         File dest = get_file(p2, false);
         if (dest.type != DIRECTORY_FILE && f.type == DIRECTORY_FILE) { 
-            cur_errno = ERR_DIR; p_perror("mv"); return;
+            cur_errno = ERR_DIR; p_perror("mv"); end_txn(); return;
         }
         if (truncate_file(p2, false) == -1) {
             cur_errno = ERR_PERM;
             p_perror("mv"); 
+            end_txn();
             return;
         }
     }
     set_file(p2, f, false);
     cleanup_file(remove_file(p1));
+    end_txn();
 }
 
 /**
@@ -346,6 +403,7 @@ void pf_mv(int argc, char** args) {
  * Up to one -h flag is allowed.
  * If dest is a directory, we instead set dest = path_to_dest/name_of_source
  * and follow the above rules effectively copying source into dest.
+ * A copy within the filesystem is a clone sharing the source's blocks, see `clone_file`.
  *
  * @param args[1] Source file, possibly with preceding -h flag.
  * @param args[2] Destination file, possibly with preceding -h flag.
@@ -360,7 +418,7 @@ void pf_cp(int argc, char** args) {
     }
     bool h_dest = strcmp(args[2], "-h") == 0;
     if (argc > 4) { arg_error2("cp: Too many arguments\n"); return; }
-    Vec v;
+    Vec v = { NULL, 0 };
     if (h_src) {
         int src_fd = open(args[2], O_RDONLY);
         if (src_fd == -1) { arg_error2("cp: Cannot open source file\n"); return; }
@@ -370,7 +428,13 @@ void pf_cp(int argc, char** args) {
         v.buf = (uint8_t*) malloc(v.size);
         read(src_fd, v.buf, v.size);
         close(src_fd);
-    } else {
+    } else if (h_dest && data_mapped()) {
+        int dest_fd = open(args[3], O_WRONLY | O_CREAT | O_TRUNC, 0777); 
+        if (dest_fd == -1) { cur_errno = ERR_NOENT; p_perror("cp"); return; }
+        if (write_borrowed(dest_fd, &args[1], 1) == -1) { cur_errno = ERR_PERM; p_perror("cp"); }
+        close(dest_fd);
+        return;
+    } else if (h_dest) {
         v = read_files2(&args[1], 1);
         if (v.size == -1) { cur_errno = ERR_PERM; p_perror("cp"); return; }
     }
@@ -380,6 +444,9 @@ void pf_cp(int argc, char** args) {
         write(dest_fd, v.buf, v.size);
         close(dest_fd);
     } else {
+        // Within the filesystem the source is cloned rather than read
+        char* src = h_src ? NULL : abs_path2(args[1]);
+        if (src != NULL && get_file(src, true).name[0] == 0) { cur_errno = ERR_PERM; p_perror("cp"); return; }
         char* path = abs_path2(args[h_src ? 3 : 2]);
         File dest = get_file(path, true);
         if (dest.type == DIRECTORY_FILE) {
@@ -397,12 +464,20 @@ void pf_cp(int argc, char** args) {
         }
         if (create_file(path, REGULAR_FILE) == -1) {
             if (errno != EEXIST) { perror("cp"); return; }
-            if (truncate_file(path, true) == -1) {
+            // A clone replaces the old data itself, and must not lose it when copying a file onto itself
+            if (h_src && truncate_file(path, true) == -1) {
                 cur_errno = ERR_PERM;
                 p_perror("cp");
                 return;
             }
         }
+        if (!h_src) {
+            if (clone_file(src, path) == -1) {
+                cur_errno = ERR_PERM;
+                p_perror("cp");
+            }
+            return;
+        }
         if (write_file(path, 0, v.buf, v.size, true) == -1) {
             cur_errno = ERR_PERM;
             p_perror("cp");
@@ -436,7 +511,10 @@ void pf_cat(int argc, char** args) {
     bool append_f = strcmp(flag, "-a") == 0;
     bool write_f = strcmp(flag, "-w") == 0;
     Vec vec;
-    if (argc == 3 && (append_f || write_f)) {
+    if (!append_f && !write_f && data_mapped()) {
+        if (write_borrowed(STDOUT_FILENO, &args[1], argc - 1) == -1) { cur_errno = ERR_PERM; p_perror("cat"); }
+        return;
+    } else if (argc == 3 && (append_f || write_f)) {
         vec.buf = (uint8_t*) malloc(MAX_LINE_LENGTH);
         vec.size = read(STDIN_FILENO, vec.buf, MAX_LINE_LENGTH);
     } else {
@@ -495,7 +573,7 @@ void pf_ls(int argc, char** args)  {
     } else {
         path = abs_path2("");
     }
-    File* list = list_directory(path); 
+    File* list = list_directory(path, command_scratch);
     if (list == NULL) { cur_errno = ERR_PERM; p_perror("ls"); return; }
     int fb_len = 0;
     int size_len = 0;
@@ -503,7 +581,7 @@ void pf_ls(int argc, char** args)  {
     int name_len = 0;
     char str[32];
     for (int i = 0; list[i].name[0] != 0; i++) {
-        sprintf(str, "%hu", list[i].first_block);
+        sprintf(str, "%d", (int) list[i].first_block);
         if (strlen(str) > fb_len) { fb_len = strlen(str); }
         memset(str, 0, strlen(str));
         sprintf(str, "%u", list[i].size);
@@ -518,8 +596,8 @@ void pf_ls(int argc, char** args)  {
     }
     for (int i = 0; list[i].name[0] != 0; i++) {
         struct tm *time_data = localtime(&list[i].mtime);
-        printf("%*hu %c %c%c%c %*u %s %*u %02u:%02u %.*s\n", 
-            fb_len, list[i].first_block, 
+        printf("%*d %c %c%c%c %*u %s %*u %02u:%02u %.*s\n", 
+            fb_len, (int) list[i].first_block, 
             list[i].type == UNKNOWN_FILE ? 'u' : list[i].type == REGULAR_FILE ? 'f' : list[i].type == DIRECTORY_FILE ? 'd' : 'l',
             list[i].perm & EXECUTE_PERM ? 'x' : '-', 
             list[i].perm & READ_PERM ? 'r' : '-',
@@ -537,12 +615,12 @@ void pf_ls(int argc, char** args)  {
 /**
  * @brief Change the permissions of a file.
  *
- * Can add/remove one of read/write/execute on a file.
+ * Can add/remove one of read/write/execute on a file, or turn compression on or off with c.
  * Links are always followed.
  * Prints an error if the permissions modifier is invalid or
  * if the file cannot be found.
  *
- * @param args[1] (+/-)(r/w/x) permissions modifier.
+ * @param args[1] (+/-)(r/w/x/c) permissions modifier.
  * @param args[2] File to change permissions of.
  */
 void pf_chmod(int argc, char** args) {
@@ -557,6 +635,9 @@ void pf_chmod(int argc, char** args) {
         perm = READ_PERM;
     } else if (args[1][1] == 'w') {
         perm = WRITE_PERM;
+    } else if (args[1][1] == 'c' && (args[1][0] == '+' || args[1][0] == '-')) {
+        if (compress_file(abs_path2(args[2]), args[1][0] == '+') == -1) { perror("chmod"); }
+        return;
     } else {
         arg_error2("chmod: Invalid permssions modifier\n");
         return;
@@ -590,7 +671,8 @@ void pf_cd(int argc, char** args) {
     File f = get_file(path, true);
     if (f.name[0] == 0) { cur_errno = ERR_NOENT; p_perror("cd"); return; }
     if (f.type != DIRECTORY_FILE) { cur_errno = ERR_NOTDIR; p_perror("cd"); return; }
-    pwd2 = path;
+    free(pwd2);
+    pwd2 = strdup(path);
 }
 
 /**
@@ -688,6 +770,468 @@ void pf_ln(int argc, char** args) {
     }
 }
 
+/**
+ * @brief Print the size and free space of the mounted filesystem.
+ *
+ * Also prints how much space the image takes on the host, which holes don't count towards.
+ * Prints an error if no filesystem is mounted.
+ */
+void pf_df(int argc, char** args) {
+    if (argc > 1) { arg_error2("df: Too many arguments\n"); return; }
+    if (!mounted) { arg_error2("df: No filesystem mounted\n"); return; }
+    FsStats fs = fs_stats();
+    int used = fs.total_blocks - fs.free_blocks;
+    printf("%d blocks of %d bytes, %d used, %d free (%ld bytes free)\n",
+        fs.total_blocks, fs.block_size, used, fs.free_blocks,
+        (long) fs.free_blocks * fs.block_size
+    );
+    printf("image uses %ld bytes on the host\n", fs.host_bytes);
+}
+
+/**
+ * @brief Punch a hole in a file.
+ *
+ * The range reads as zeroes afterwards and whole blocks in it stop taking space on the host.
+ * The file keeps its size. Links are followed.
+ * Prints an error if the file cannot be found or written or the range is invalid.
+ *
+ * @param args[1] File to punch a hole in.
+ * @param args[2] Offset the hole begins at.
+ * @param args[3] Number of bytes in the hole.
+ */
+void pf_punch(int argc, char** args) {
+    if (!mounted) { arg_error2("punch: No filesystem mounted\n"); return; }
+    if (argc <= 3) { arg_error2("punch: Missing operand\n"); return; }
+    if (argc > 4) { arg_error2("punch: Too many arguments\n"); return; }
+    if (punch_file(abs_path2(args[1]), atoi(args[2]), atoi(args[3])) == -1) { perror("punch"); }
+}
+
+/**
+ * @brief Take, delete or list snapshots of the mounted filesystem.
+ *
+ * Without an argument lists the snapshots and when they were taken.
+ * With a name takes a snapshot by that name, and with the -d flag deletes it.
+ * Snapshots need a filesystem with 32-bit block numbers, see `mkfs`.
+ * Prints an error if no filesystem is mounted or the snapshot can't be taken or deleted.
+ *
+ * @param args[1] Optional -d flag or name of the snapshot.
+ * @param args[2] Name of the snapshot to delete after -d.
+ */
+void pf_snapshot(int argc, char** args) {
+    if (!mounted) { arg_error2("snapshot: No filesystem mounted\n"); return; }
+    if (argc > 3) { arg_error2("snapshot: Too many arguments\n"); return; }
+    if (argc == 1) {
+        Snapshot* list = list_snapshots();
+        if (list == NULL) { perror("snapshot"); return; }
+        for (int i = 0; list[i].name[0] != '\0'; i++) {
+            struct tm *time_data = localtime(&list[i].time);
+            printf("%s %2u %02u:%02u %s\n",
+                MONTHS2[time_data->tm_mon], time_data->tm_mday, time_data->tm_hour, time_data->tm_min, list[i].name
+            );
+        }
+        free(list);
+        return;
+    }
+    if (strcmp(args[1], "-d") == 0) {
+        if (argc == 2) { arg_error2("snapshot: Missing snapshot name\n"); return; }
+        if (delete_snapshot(args[2]) == -1) { perror("snapshot"); }
+        return;
+    }
+    if (argc > 2) { arg_error2("snapshot: Too many arguments\n"); return; }
+    if (snapshot_fs(args[1]) == -1) { perror("snapshot"); }
+}
+
+/**
+ * @brief Print a line for a path changed between snapshots, see `diff_snapshots`.
+ *
+ * @param change A for added, D for deleted or M for modified.
+ * @param path Absolute path of the file.
+ */
+void print_change(char change, char* path) {
+    printf("%c %s\n", change, path);
+}
+
+/**
+ * @brief List the files changed between two snapshots.
+ *
+ * With one snapshot compares it with the mounted filesystem instead.
+ * Each changed file is printed after A if it was added, D if it was deleted and M if it was modified.
+ * Prints an error if no filesystem is mounted or a snapshot can't be found.
+ *
+ * @param args[1] Name of the older snapshot.
+ * @param args[2] Optional name of the newer snapshot.
+ */
+void pf_snapdiff(int argc, char** args) {
+    if (!mounted) { arg_error2("snapdiff: No filesystem mounted\n"); return; }
+    if (argc == 1) { arg_error2("snapdiff: Missing snapshot name\n"); return; }
+    if (argc > 3) { arg_error2("snapdiff: Too many arguments\n"); return; }
+    if (diff_snapshots(args[1], argc == 3 ? args[2] : NULL, print_change) == -1) { perror("snapdiff"); }
+}
+
+/**
+ * @brief Print a line for a block which doesn't match its checksum, see `scrub_fs`.
+ *
+ * @param block The FAT block number.
+ */
+void print_bad_block(int block) {
+    printf("block %d: checksum mismatch\n", block);
+}
+
+/**
+ * @brief Check every block of the mounted filesystem against its checksum.
+ *
+ * Each corrupt block is printed, then how many blocks were checked and skipped and how fast.
+ * Prints an error if no filesystem is mounted or it has no checksums.
+ */
+void pf_scrub(int argc, char** args) {
+    if (argc > 1) { arg_error2("scrub: Too many arguments\n"); return; }
+    if (!mounted) { arg_error2("scrub: No filesystem mounted\n"); return; }
+    struct timespec t0;
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ScrubStats ss;
+    if (scrub_fs(print_bad_block, &ss) == -1) { perror("scrub"); return; }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double mb = (double) ss.checked * fs_stats().block_size / (1 << 20);
+    printf("%d blocks checked, %d skipped, %d bad, %.1f MiB in %.3f s (%.0f MiB/s)\n",
+        ss.checked, ss.skipped, ss.bad, mb, secs, secs > 0 ? mb / secs : 0.0
+    );
+}
+
+/**
+ * @brief One thread's share of a `bench` run.
+ */
+typedef struct bench_job {
+    /**
+    * @brief File the thread reads, or rewrites for the writer.
+    */
+    char path[32];
+    /**
+    * @brief What the file should hold.
+    */
+    uint8_t* expect;
+    /**
+    * @brief Size of the file.
+    */
+    int size;
+    /**
+    * @brief Number of times a reader reads the whole file.
+    */
+    int passes;
+    /**
+    * @brief Bytes read, or written for the writer.
+    */
+    long bytes;
+    /**
+    * @brief Reads which failed or returned the wrong data.
+    */
+    long bad;
+    /**
+    * @brief Set once the readers are done, telling the writer to stop.
+    */
+    atomic_bool* stop;
+} BenchJob;
+
+/**
+ * @brief Body of a `bench` reader: read a file again and again in `BENCH_CHUNK` pieces, checking each piece.
+ *
+ * @return NULL.
+ * @param arg The thread's `BenchJob`.
+ */
+void* bench_reader(void* arg) {
+    BenchJob* job = (BenchJob*) arg;
+    uint8_t* buf = (uint8_t*) malloc(BENCH_CHUNK);
+    for (int pass = 0; pass < job->passes; pass++) {
+        for (int offset = 0; offset < job->size; offset += BENCH_CHUNK) {
+            int want = job->size - offset < BENCH_CHUNK ? job->size - offset : BENCH_CHUNK;
+            int n = read_file(job->path, offset, buf, BENCH_CHUNK);
+            if (n != want || memcmp(buf, job->expect + offset, n) != 0) { job->bad++; }
+            if (n > 0) { job->bytes += n; }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Body of the `bench` writer: until told to stop, rewrite a file and check it,
+ * and create and remove another next to the readers' files.
+ *
+ * @return NULL.
+ * @param arg The thread's `BenchJob`.
+ */
+void* bench_writer(void* arg) {
+    BenchJob* job = (BenchJob*) arg;
+    uint8_t* buf = (uint8_t*) malloc(job->size);
+    char tmp[sizeof(job->path) + 2];
+    snprintf(tmp, sizeof(tmp), "%s.t", job->path);
+    while (!atomic_load(job->stop)) {
+        if (write_file(job->path, 0, job->expect, job->size, true) == -1 ||
+            read_file(job->path, 0, buf, job->size) != job->size ||
+            memcmp(buf, job->expect, job->size) != 0) { job->bad++; }
+        job->bytes += job->size;
+        if (create_file(tmp, REGULAR_FILE) == -1 || write_file(tmp, 0, job->expect, 1, true) == -1 ||
+            truncate_file(tmp, false) == -1 || cleanup_file(remove_file(tmp)) == -1) { job->bad++; }
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Run `readers` reader threads over the first `readers` jobs, and the writer over `writer` if not NULL.
+ *
+ * @return Seconds the readers took.
+ * @param jobs The readers' jobs, whose counters are reset.
+ * @param readers Number of reader threads.
+ * @param writer The writer's job, or NULL.
+ */
+double bench_run(BenchJob* jobs, int readers, BenchJob* writer) {
+    pthread_t threads[BENCH_MAX_THREADS];
+    pthread_t writer_thread;
+    atomic_bool stop = false;
+    struct timespec t0;
+    struct timespec t1;
+    if (writer) {
+        writer->stop = &stop;
+        if (pthread_create(&writer_thread, NULL, bench_writer, writer) != 0) {
+            cur_errno = ERR_PERM;
+            p_perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < readers; i++) {
+        jobs[i].bytes = 0;
+        jobs[i].bad = 0;
+        if (pthread_create(&threads[i], NULL, bench_reader, &jobs[i]) != 0) {
+            cur_errno = ERR_PERM;
+            p_perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (writer) {
+        atomic_store(&stop, true);
+        pthread_join(writer_thread, NULL);
+    }
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Write the files of a `bench` run to the root directory, one per job, each with its own contents.
+ *
+ * Prints an error if a file already exists or can't be written.
+ *
+ * @return True if every file was written.
+ * @param jobs The jobs, set up for their files.
+ * @param count Number of files.
+ * @param size Size of each file in bytes.
+ * @param compressed Should the files be compressed as they are written?
+ * @param made Set to the number of jobs set up, which `bench_remove` needs, whether or not it succeeds.
+ */
+bool bench_create(BenchJob* jobs, int count, int size, bool compressed, int* made) {
+    *made = 0;
+    for (int i = 0; i < count; i++) {
+        BenchJob* job = &jobs[i];
+        snprintf(job->path, sizeof(job->path), "/bench%d", i);
+        if (get_file(job->path, false).name[0] != EOD_FLAG) {
+            errno = EEXIST;
+            perror("bench");
+            return false;
+        }
+        job->expect = (uint8_t*) malloc(size);
+        for (int j = 0; j < size; j++) {
+            job->expect[j] = (uint8_t) (j * 31 + i * 7 + (j >> 9));
+        }
+        job->size = size;
+        job->passes = BENCH_BYTES / size > 0 ? BENCH_BYTES / size : 1;
+        (*made)++;
+        if (create_file(job->path, REGULAR_FILE) == -1 || (compressed && compress_file(job->path, true) == -1) ||
+            write_file(job->path, 0, job->expect, size, true) == -1) {
+            perror("bench");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Remove the files of the first `made` jobs of a `bench` run and free their buffers.
+ *
+ * @param jobs The jobs.
+ * @param made Number of jobs set up by `bench_create`.
+ */
+void bench_remove(BenchJob* jobs, int made) {
+    for (int i = 0; i < made; i++) {
+        if (truncate_file(jobs[i].path, false) != -1) { cleanup_file(remove_file(jobs[i].path)); }
+        free(jobs[i].expect);
+    }
+}
+
+/**
+ * @brief Run `bench -c`: write and read the same files plain and then compressed.
+ *
+ * For each form prints how fast `threads` files were written and then read by `threads` threads at once,
+ * the bytes they take on the host once committed, and the time spent compressing and decompressing.
+ *
+ * @param jobs Room for `threads` jobs.
+ * @param threads Number of files and reader threads.
+ * @param size Size of each file in bytes.
+ */
+void bench_compare(BenchJob* jobs, int threads, int size) {
+    for (int compressed = 0; compressed <= 1; compressed++) {
+        sync_fs();
+        long host = fs_stats().host_bytes;
+        LzStats lz = lz_stats();
+        struct timespec t0;
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int made;
+        bool ready = bench_create(jobs, threads, size, compressed, &made);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (ready) {
+            double write_secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            sync_fs();
+            long stored = fs_stats().host_bytes - host;
+            double secs = bench_run(jobs, threads, NULL);
+            long bytes = 0;
+            long bad = 0;
+            for (int i = 0; i < threads; i++) {
+                bytes += jobs[i].bytes;
+                bad += jobs[i].bad;
+            }
+            LzStats after = lz_stats();
+            printf("%s: write %.0f MiB/s, read %.0f MiB/s, %ld host bytes, codec %.3f s, %ld errors\n",
+                compressed ? "compressed" : "plain",
+                (double) threads * size / write_secs / (1 << 20), bytes / secs / (1 << 20), stored,
+                (after.compress_ns - lz.compress_ns + after.decompress_ns - lz.decompress_ns) / 1e9, bad
+            );
+        }
+        bench_remove(jobs, made);
+        if (!ready) { return; }
+    }
+}
+
+/**
+ * @brief Measure how reads of different files scale across host threads, then stress them against a writer.
+ *
+ * Writes one file per thread to the root directory, each with its own contents, and has 1, 2, 4
+ * and so on up to `threads` threads each read their own file `BENCH_BYTES` bytes over, printing the
+ * combined throughput and the speedup over one thread. Then runs all the readers again while another
+ * thread keeps rewriting a file and creating and removing files in the same directory, and prints
+ * both sides' throughput. Every read is checked, and any failed or wrong read is counted as an error.
+ * With `-c` compares plain and compressed files instead, see `bench_compare`.
+ * The files are removed afterwards.
+ * Prints an error if no filesystem is mounted or the files can't be written.
+ *
+ * @param args[1] Optional `-c`, which shifts the other arguments along.
+ * @param args[2] Optional number of threads, 4 by default.
+ * @param args[3] Optional size of each file in KiB, 1024 by default.
+ */
+void pf_bench(int argc, char** args) {
+    if (!mounted) { arg_error2("bench: No filesystem mounted\n"); return; }
+    bool compare = argc > 1 && strcmp(args[1], "-c") == 0;
+    if (compare) {
+        args++;
+        argc--;
+    }
+    if (argc > 3) { arg_error2("bench: Too many arguments\n"); return; }
+    int threads = argc > 1 ? atoi(args[1]) : 4;
+    int size = (argc > 2 ? atoi(args[2]) : 1024) * 1024;
+    if (threads < 1 || threads > BENCH_MAX_THREADS) { arg_error2("bench: Invalid number of threads\n"); return; }
+    if (size < 1) { arg_error2("bench: Invalid file size\n"); return; }
+    // The last file is the writer's
+    BenchJob jobs[BENCH_MAX_THREADS + 1];
+    if (compare) {
+        bench_compare(jobs, threads, size);
+        return;
+    }
+    int made;
+    if (bench_create(jobs, threads + 1, size, false, &made)) {
+        double base = 0;
+        long bad = 0;
+        for (int n = 1; n <= threads; n = n < threads && 2 * n > threads ? threads : 2 * n) {
+            double secs = bench_run(jobs, n, NULL);
+            long bytes = 0;
+            for (int i = 0; i < n; i++) {
+                bytes += jobs[i].bytes;
+                bad += jobs[i].bad;
+            }
+            double rate = bytes / secs / (1 << 20);
+            if (n == 1) { base = rate; }
+            printf("%d %s: %.0f MiB/s (%.2fx)\n", n, n == 1 ? "thread" : "threads", rate, rate / base);
+        }
+        BenchJob* writer = &jobs[threads];
+        writer->bytes = 0;
+        writer->bad = 0;
+        double secs = bench_run(jobs, threads, writer);
+        long bytes = 0;
+        for (int i = 0; i < threads; i++) {
+            bytes += jobs[i].bytes;
+            bad += jobs[i].bad;
+        }
+        bad += writer->bad;
+        printf("stress: %.0f MiB/s read while %.0f MiB/s rewritten, %ld errors\n",
+            bytes / secs / (1 << 20), writer->bytes / secs / (1 << 20), bad
+        );
+    }
+    bench_remove(jobs, made);
+}
+
+/**
+ * @brief Print filesystem statistics.
+ *
+ * Reports block cache capacity, hits, misses, hit rate and evictions,
+ * how many blocks were read ahead and how many of those were then used,
+ * which backend carries out batched I/O, and how many bytes of compressed files were compressed
+ * into how many and decompressed and the time each took, so the space and host I/O compression
+ * saves can be weighed against the CPU it costs, and how many bytes were checksummed by which
+ * implementation in how long and how many blocks failed their checksums, and how much space sharing
+ * blocks saves: the blocks files use against the distinct blocks stored, which clones count towards
+ * too, and with dedup on how many blocks it kept from being written since mount.
+ * Prints an error if no filesystem is mounted.
+ */
+void pf_stats(int argc, char** args) {
+    if (argc > 1) { arg_error2("stats: Too many arguments\n"); return; }
+    if (!mounted) { arg_error2("stats: No filesystem mounted\n"); return; }
+    CacheStats cs = cache_stats();
+    long lookups = cs.hits + cs.misses;
+    printf("cache: %d blocks, %ld hits, %ld misses (%.1f%% hit rate), %ld evictions\n",
+        cs.capacity, cs.hits, cs.misses,
+        lookups ? 100.0 * cs.hits / lookups : 0.0,
+        cs.evictions
+    );
+    printf("readahead: %ld blocks, %ld used (%.1f%% hit rate)\n",
+        cs.readahead, cs.readahead_hits,
+        cs.readahead ? 100.0 * cs.readahead_hits / cs.readahead : 0.0
+    );
+    printf("io: %s\n", io_backend_name());
+    LzStats lz = lz_stats();
+    printf("compression: %ld bytes into %ld (%.2fx) in %.3f s, %ld bytes decompressed in %.3f s\n",
+        lz.compressed_in, lz.compressed_out,
+        lz.compressed_out ? (double) lz.compressed_in / lz.compressed_out : 1.0,
+        lz.compress_ns / 1e9, lz.decompressed, lz.decompress_ns / 1e9
+    );
+    FsStats fs = fs_stats();
+    CrcStats crc = crc_stats();
+    if (fs.checksummed) {
+        printf("checksums: %s, %ld bytes in %.3f s, %ld errors\n",
+            crc32c_impl_name(), crc.bytes, crc.ns / 1e9, fs.checksum_errors
+        );
+    } else {
+        printf("checksums: none\n");
+    }
+    DedupStats ds = dedup_usage();
+    printf("dedup: %s, %d blocks indexed, %ld shared since mount, %ld blocks used by files in %ld stored (%.2fx)\n",
+        ds.on ? "on" : "off", ds.indexed, ds.shared, ds.referenced, ds.stored,
+        ds.stored ? (double) ds.referenced / ds.stored : 1.0
+    );
+}
+
 /**
  * @brief Main loop.
  */
@@ -717,8 +1261,10 @@ int main(int _argc, char** _argv) {
         if (strtok(tmp, " \n\t")) { argc++; }
         while (strtok(NULL, " \n\t")) { argc++; }
         if (argc == 0) { continue; }
+        SCRATCH(scratch);
+        command_scratch = &scratch;
         // Build array of arguments
-        char** args = malloc(sizeof(char*) * argc);
+        char** args = (char**) arena_alloc(&scratch, sizeof(char*) * argc);
         args[0] = strtok(input_line, " \n\t");
         for (int i = 1; i < argc; i++) { 
             args[i] = strtok(NULL, " \n\t");
@@ -739,6 +1285,13 @@ int main(int _argc, char** _argv) {
         else if (strcmp(args[0], "rmdir") == 0) { pf_rmdir(argc, args); } 
         else if (strcmp(args[0], "pwd") == 0) { pf_pwd(argc, args); }
         else if (strcmp(args[0], "ln") == 0) { pf_ln(argc, args); } 
+        else if (strcmp(args[0], "stats") == 0) { pf_stats(argc, args); }
+        else if (strcmp(args[0], "df") == 0) { pf_df(argc, args); }
+        else if (strcmp(args[0], "punch") == 0) { pf_punch(argc, args); }
+        else if (strcmp(args[0], "scrub") == 0) { pf_scrub(argc, args); }
+        else if (strcmp(args[0], "bench") == 0) { pf_bench(argc, args); }
+        else if (strcmp(args[0], "snapshot") == 0) { pf_snapshot(argc, args); }
+        else if (strcmp(args[0], "snapdiff") == 0) { pf_snapdiff(argc, args); }
         else { arg_error2("pennfat: Command not recognized\n"); }
     }
 }
\ No newline at end of file
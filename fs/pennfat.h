@@ -33,4 +33,18 @@ void pf_rmdir(int argc, char** args);
 
 void pf_pwd(int argc, char** args);
 
-void pf_ln(int argc, char** args);
\ No newline at end of file
+void pf_ln(int argc, char** args);
+
+void pf_stats(int argc, char** args);
+
+void pf_df(int argc, char** args);
+
+void pf_punch(int argc, char** args);
+
+void pf_scrub(int argc, char** args);
+
+void pf_bench(int argc, char** args);
+
+void pf_snapshot(int argc, char** args);
+
+void pf_snapdiff(int argc, char** args);
\ No newline at end of file
@@ -23,6 +23,11 @@ const char* MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug",
  */
 char* pwd = "\0";
 
+/**
+ * @brief Was `pwd` allocated by `abs_path`, rather than being the initial empty string?
+ */
+static bool pwd_allocated = false;
+
 /*
     Initiate file descriptor table in the kernel
 */
@@ -45,17 +50,19 @@ int f_open(const char *fname, int mode) {
 }
 
 /*
- * Helper to read contents of files specified by names into a vec.
+ * Helper to read contents of files specified by names into a vec allocated in scratch.
+ * The contents are followed by a null so that text can be used as a string.
  * Returns -1 in size field of vec if one of the files doesn't exist.
 */
-Vec read_files(char** names, int num) {
+Vec read_files(Arena* scratch, char** names, int num) {
     int size = 0;
     for (int i = 0; i < num; ++i) {
         File f = get_file(names[i], true);
         if (f.name[0] == 0) { Vec vec = { NULL, -1 }; return vec; }
         size += f.size;
     }
-    uint8_t* buf = (uint8_t*) malloc(size);
+    uint8_t* buf = (uint8_t*) arena_alloc(scratch, size + 1);
+    buf[size] = '\0';
     size = 0;
     for (int i = 0; i < num; ++i) {
         File f = get_file(names[i], true);
@@ -91,9 +98,9 @@ int f_read(int fd, int n, char *buf) {
     }
     int r = f.size - node->file_pointer;
     if (r > n) { r = n; }
-    else if (node->file_pointer > f.size) { return 0; }
+    if (r <= 0) { return 0; }
     //write to buffer and change pointer
-    int c = read_file((char*)node->file_name, node->file_pointer, (uint8_t*) buf, r);
+    int c = read_file_cursor((char*)node->file_name, node->file_pointer, (uint8_t*) buf, r, &node->cursor);
     if (c >= 0) {
         node->file_pointer += c;
     }
@@ -126,9 +133,11 @@ int f_write(int fd, const char *str, int n) {
     }
     //write
 
-    write_file((char*)node->file_name, node->file_pointer, (uint8_t*) str, n, true);
+    if (write_file_cursor((char*)node->file_name, node->file_pointer, (uint8_t*) str, n, true, &node->cursor) == -1) {
+        return -1;
+    }
     //increment by number of bytes written
-    node->file_pointer = seek_data(node->file_pointer, n);
+    node->file_pointer += n;
     
     return n;
 }
@@ -160,127 +169,96 @@ void f_unlink(const char *fname) {
 */
 void f_lseek(int fd, int offset, int whence) {
     TNode *node = get_fd(&fd_table, fd);
+    if (!node) {
+        return;
+    }
     File f = get_file((char*)node->file_name, true);
 
+    // the cursor is kept, the next read or write seeks from it if it can
     if (whence == SEEK_SET) {
-        node->file_descriptor = seek_data(f.first_block * 64, offset);
+        node->file_pointer = offset;
     } else if (whence == SEEK_CUR) {
-        node->file_descriptor = seek_data(node->file_descriptor, offset);
+        node->file_pointer += offset;
     } else if (whence == SEEK_END) {
-        node->file_descriptor = seek_data(f.first_block * 64, f.size);
-        node->file_descriptor = seek_data(node->file_descriptor, offset);
+        node->file_pointer = f.size + offset;
     }
 }
 
 /*
-    Returns file or list of files in directory if filename is null
+ * Helper to format the ls lines of the files in list named only, or of all of them if only is NULL.
+ * Each field is padded to the widest of the files listed.
+ * Returns the lines allocated in scratch, followed by an empty string.
 */
-char** f_ls(const char *filename) {
-    char** out = NULL;
+char** format_list(Arena* scratch, File* list, const char* only) {
+    int count = 0;
+    int fb_len = 0;
+    int size_len = 0;
+    int day_len = 0;
+    int name_len = 0;
+    char str[32];
+    for (int i = 0; list[i].name[0] != 0; i++) {
+        if (only && strcmp(list[i].name, only)) { continue; }
+        count++;
+        struct tm time_data;
+        localtime_r(&list[i].mtime, &time_data);
+        int len = sprintf(str, "%d", (int) list[i].first_block);
+        if (len > fb_len) { fb_len = len; }
+        len = sprintf(str, "%u", list[i].size);
+        if (len > size_len) { size_len = len; }
+        len = sprintf(str, "%u", time_data.tm_mday);
+        if (len > day_len) { day_len = len; }
+        len = strlen(list[i].name);
+        if (len > name_len) { name_len = len; }
+    }
+    char** out = (char**) arena_alloc(scratch, sizeof(char*) * (count + 1));
+    out[count] = "\0";
+    // Widths, 3 permissions, 3 letter month, hh:mm, 6 separators, the newline and a null
+    int line_len = fb_len + size_len + day_len + name_len + 19;
+    count = 0;
+    for (int i = 0; list[i].name[0] != 0; i++) {
+        if (only && strcmp(list[i].name, only)) { continue; }
+        struct tm time_data;
+        localtime_r(&list[i].mtime, &time_data);
+        out[count] = (char*) arena_alloc(scratch, line_len);
+        snprintf(out[count], line_len, "%*d %c%c%c %*u %s %*u %02u:%02u %.*s\n", 
+            fb_len, (int) list[i].first_block, 
+            list[i].perm & EXECUTE_PERM ? 'x' : '-', 
+            list[i].perm & READ_PERM ? 'r' : '-',
+            list[i].perm & WRITE_PERM ? 'w' : '-',
+            size_len, list[i].size, 
+            MONTHS[time_data.tm_mon],
+            day_len, time_data.tm_mday,
+            time_data.tm_hour,
+            time_data.tm_min,
+            name_len, list[i].name
+        );
+        count++;
+    }
+    return out;
+}
 
-    if (!filename) {
-        char* path = abs_path("");
-        File* list = list_directory(path);
-        int count = 0;
-        for (int i = 0; list[i].name[0] != 0; i++) {
-            count++;
-        }
-        out = malloc(sizeof(char*) * (count + 1));
-        out[count] = "\0";
-        int fb_len = 0;
-        int size_len = 0;
-        int day_len = 0;
-        int name_len = 0;
-        char str[32];
-        for (int i = 0; list[i].name[0] != 0; i++) {
-            sprintf(str, "%hu", list[i].first_block);
-            if (strlen(str) > fb_len) { fb_len = strlen(str); }
-            memset(str, 0, strlen(str));
-            sprintf(str, "%u", list[i].size);
-            if (strlen(str) > size_len) { size_len = strlen(str); }
-            memset(str, 0, strlen(str));
-            struct tm *time_data = localtime(&list[i].mtime);
-            sprintf(str, "%u", time_data->tm_mday);
-            if (strlen(str) > day_len) { day_len = strlen(str); }
-            memset(str, 0, strlen(str));
-            if (strlen(list[i].name) > name_len) { name_len = strlen(list[i].name); }
-            memset(str, 0, strlen(str));
-        }
-        for (int i = 0; list[i].name[0] != 0; i++) {
-            out[i] = malloc(sizeof(char) * 32);
-            struct tm *time_data = localtime(&list[i].mtime);
-            sprintf(out[i], "%*hu %c%c%c %*u %s %*u %02u:%02u %.*s\n", 
-                fb_len, list[i].first_block, 
-                list[i].perm & EXECUTE_PERM ? 'x' : '-', 
-                list[i].perm & READ_PERM ? 'r' : '-',
-                list[i].perm & WRITE_PERM ? 'w' : '-',
-                size_len, list[i].size, 
-                MONTHS[time_data->tm_mon],
-                day_len, time_data->tm_mday,
-                time_data->tm_hour,
-                time_data->tm_min,
-                name_len, list[i].name
-            );
-        }
-    } else {
-        char* filename2 = malloc(sizeof(char) * (strlen(filename) + 1));
-        filename2[strlen(filename)] = '\0';
-        strcpy(filename2, filename);
-        char* path = abs_path(filename2);
-        File* list = list_directory(path);
+/*
+    Returns file or list of files in directory if filename is null
+    The lines and everything needed to make them are allocated in scratch
+*/
+char** f_ls(Arena* scratch, const char *filename) {
+    char* path = abs_path_in(scratch, filename ? (char*) filename : "");
+    File* list = list_directory(path, scratch);
+    if (!list) {
+        return NULL;
+    }
+    if (filename) {
         bool exists = false;
         for (int i = 0; list[i].name[0] != 0; i++) {
             if (!strcmp(list[i].name, filename)) {
                 exists = true;
             }
         }
-        if(!exists) {
-            return out;
-        }
-        out = malloc(sizeof(char*) * 2);
-        out[1] = "\0";
-        int fb_len = 0;
-        int size_len = 0;
-        int day_len = 0;
-        int name_len = 0;
-        char str[32];
-        out[0] = malloc(sizeof(char) * 32);
-        for (int i = 0; list[i].name[0] != 0; i++) {
-            if (!strcmp(list[i].name, filename)) {
-                sprintf(str, "%hu", list[i].first_block);
-                if (strlen(str) > fb_len) { fb_len = strlen(str); }
-                memset(str, 0, strlen(str));
-                sprintf(str, "%u", list[i].size);
-                if (strlen(str) > size_len) { size_len = strlen(str); }
-                memset(str, 0, strlen(str));
-                struct tm *time_data = localtime(&list[i].mtime);
-                sprintf(str, "%u", time_data->tm_mday);
-                if (strlen(str) > day_len) { day_len = strlen(str); }
-                memset(str, 0, strlen(str));
-                if (strlen(list[i].name) > name_len) { name_len = strlen(list[i].name); }
-                memset(str, 0, strlen(str));
-            }
-        }
-        for (int i = 0; list[i].name[0] != 0; i++) {
-            if (!strcmp(list[i].name, filename)) {
-                struct tm *time_data = localtime(&list[i].mtime);
-                sprintf(out[0], "%*hu %c%c%c %*u %s %*u %02u:%02u %.*s\n", 
-                    fb_len, list[i].first_block, 
-                    list[i].perm & EXECUTE_PERM ? 'x' : '-', 
-                    list[i].perm & READ_PERM ? 'r' : '-',
-                    list[i].perm & WRITE_PERM ? 'w' : '-',
-                    size_len, list[i].size, 
-                    MONTHS[time_data->tm_mon],
-                    day_len, time_data->tm_mday,
-                    time_data->tm_hour,
-                    time_data->tm_min,
-                    name_len, list[i].name
-                );
-            }
+        if (!exists) {
+            return NULL;
         }
     }
-
-    return out;
+    return format_list(scratch, list, filename);
 }
 
 void arg_error(char* err) {
@@ -291,24 +269,28 @@ void arg_error(char* err) {
 }
 
 void f_touch(char* args[]) {
+    SCRATCH(scratch);
     if (!strcmp(args[1], "\0")) { arg_error("touch: missing file operand\n"); return; }
+    ArenaMark mark = arena_mark(&scratch);
     int i = 1;
     while(strcmp(args[i], "\0")) {
-        char* path = abs_path(args[i]);
+        char* path = abs_path_in(&scratch, args[i]);
         create_file(path, REGULAR_FILE);
         write_file(path, 0, NULL, 0, true);
+        arena_reset(&scratch, mark);
         i++;
     }
 }
 
 void f_mv(char* args[]) {
+    SCRATCH(scratch);
     int argc = 0;
     while (strcmp(args[argc], "\0")) { argc++; }
     if (argc == 1) { arg_error("mv: Missing source file\n"); return; }
     if (argc == 2) { arg_error("mv: Missing destination file\n"); return; }
     if (argc > 3) { arg_error("mv: Too many arguments\n"); return; }
-    char* p1 = abs_path(args[1]);
-    char* p2 = abs_path(args[2]);
+    char* p1 = abs_path_in(&scratch, args[1]);
+    char* p2 = abs_path_in(&scratch, args[2]);
     File f = get_file(p1, false);
     if (f.name[0] == 0) { arg_error("mv: cannot find source file\n"); return; }
     File tgt = get_file(p2, false);
@@ -325,30 +307,36 @@ void f_mv(char* args[]) {
     strcpy(f.name, name);
     // Thing to replace is p2path/p1name instead of p2path
     if (tgt.type == DIRECTORY_FILE) {
-        char* p2_new = (char*) malloc(strlen(p2) + strlen(name) + 2); // slash!
+        char* p2_new = (char*) arena_alloc(&scratch, strlen(p2) + strlen(name) + 2); // slash!
         strcpy(p2_new, p2);
         strcat(p2_new, "/");
         strcat(p2_new, name);
         p2 = p2_new;
     }
+    // Commit the rename as a whole
+    begin_txn();
     if (create_file(p2, f.type) == -1) {
         File dest = get_file(p2, false);
         if (dest.type != DIRECTORY_FILE && f.type == DIRECTORY_FILE) { 
             cur_errno = ERR_DIR;
             p_perror("mv error"); 
+            end_txn();
             return;
         }
         if (truncate_file(p2, false) == -1) {
             cur_errno = ERR_DIR;
             p_perror("mv error");  
+            end_txn();
             return;
         }
     }
     set_file(p2, f, false);
     cleanup_file(remove_file(p1));
+    end_txn();
 }
 
 void f_cp(char* args[]) {
+    SCRATCH(scratch);
     int argc = 0;
     while (strcmp(args[argc], "\0")) { argc++; }
     if (argc == 1) { arg_error("cp: missing source file\n"); return; }
@@ -359,18 +347,18 @@ void f_cp(char* args[]) {
     }
     bool h_dest = strcmp(args[2], "-h") == 0;
     if (argc > 4) { arg_error("cp: too many arguments\n"); return; }
-    Vec v;
+    Vec v = { NULL, 0 };
     if (h_src) {
         int src_fd = open(args[2], O_RDONLY);
         if (src_fd == -1) { arg_error("cp: cannot open source file\n"); return; }
         struct stat st;
         if (fstat(src_fd, &st) == -1) { arg_error("cp: cannot stat source file\n"); return; };
         v.size = st.st_size;
-        v.buf = (uint8_t*) malloc(v.size);
+        v.buf = (uint8_t*) arena_alloc(&scratch, v.size);
         read(src_fd, v.buf, v.size);
         close(src_fd);
-    } else {
-        v = read_files(&args[1], 1);
+    } else if (h_dest) {
+        v = read_files(&scratch, &args[1], 1);
         if (v.size == -1) { arg_error("cp: cannot find source file\n"); return; };
     }
     if (h_dest) { 
@@ -379,7 +367,10 @@ void f_cp(char* args[]) {
         write(dest_fd, v.buf, v.size);
         close(dest_fd);
     } else {
-        char* path = abs_path(args[h_src ? 3 : 2]);
+        // Within the filesystem the source is cloned rather than read
+        char* src = h_src ? NULL : abs_path_in(&scratch, args[1]);
+        if (src != NULL && get_file(src, true).name[0] == 0) { arg_error("cp: cannot find source file\n"); return; }
+        char* path = abs_path_in(&scratch, args[h_src ? 3 : 2]);
         File dest = get_file(path, true);
         if (dest.type == DIRECTORY_FILE) {
             char* name = strtok(args[h_src ? 2 : 1], "/");
@@ -388,19 +379,27 @@ void f_cp(char* args[]) {
                 name = tmp;
                 tmp = strtok(NULL, "/");
             }
-            char* dest_new = (char*) malloc(strlen(path) + strlen(name) + 2); // slash!
+            char* dest_new = (char*) arena_alloc(&scratch, strlen(path) + strlen(name) + 2); // slash!
             strcpy(dest_new, path);
             strcat(dest_new, "/");
             strcat(dest_new, name);
             path = dest_new;
         }
         if (create_file(path, REGULAR_FILE) == -1) {
-            if (truncate_file(path, true) == -1) {
+            // A clone replaces the old data itself, and must not lose it when copying a file onto itself
+            if (h_src && truncate_file(path, true) == -1) {
                 cur_errno = ERR_PERM;
                 p_perror("cp");
                 return;
             }
         }
+        if (!h_src) {
+            if (clone_file(src, path) == -1) {
+                cur_errno = ERR_PERM;
+                p_perror("cp");
+            }
+            return;
+        }
         if (write_file(path, 0, v.buf, v.size, true) == -1) {
             cur_errno = ERR_PERM;
             p_perror("cp");
@@ -410,17 +409,21 @@ void f_cp(char* args[]) {
 }
 
 void f_rm(char* args[]) {
+    SCRATCH(scratch);
     int argc = 0;
     while (strcmp(args[argc], "\0")) { argc++; }
     if (argc == 1) { arg_error("rm: missing source file\n"); return; }
+    ArenaMark mark = arena_mark(&scratch);
     for (int i = 1; i < argc; i++) {
-        char* path = abs_path(args[i]);
+        char* path = abs_path_in(&scratch, args[i]);
         if (truncate_file(path, false) == -1) { arg_error("rm: cannot find file\n"); break; }
         cleanup_file(remove_file(path));
+        arena_reset(&scratch, mark);
     }
 }
 
 void f_chmod(char* args[]) {
+    SCRATCH(scratch);
     File f;
     int perm;
     if (args[1][1] == 'x') { 
@@ -433,7 +436,7 @@ void f_chmod(char* args[]) {
         arg_error("chmod: invalid permssions modifier\n");
         return;
     }
-    char* path = abs_path(args[2]);
+    char* path = abs_path_in(&scratch, args[2]);
     f = get_file(path, true);
     if (f.name[0] == 0) { arg_error("chmod: cannot find file\n"); return; }
     if (args[1][0] == '-') { 
@@ -449,89 +452,55 @@ void f_chmod(char* args[]) {
 }
 
 /**
- * @brief Computes a parsed absolute path string to the file located at `name`.
+ * @brief Computes a parsed absolute path string to the file located at `name`, see `join_path`.
  *
- * If `name` is an absolute path (begins with '\') it is returned.
- * If `name` is a relative path we append it to the global `pwd` variable.
- * "Parsed" means that all dots are removed from the returned string.
- * Single dots '.' do nothing.
- * Double dots '..' go up one directory (unless at root).
+ * Relative paths are relative to the global `pwd` variable.
  *
- * @return The path from the root directory to the file.
+ * @return The path from the root directory to the file, allocated with malloc.
  * @param name The location of the file.
  */
 char* abs_path(char* name) {
-    // Get full path with extra chars (. and ..)
-    char* path_str;
-    int len;
-    if (name[0] != '/') {
-        len = strlen(pwd) + strlen(name) + 1; // middle slash
-        path_str = (char*) malloc(len + 1);
-        strcpy(path_str, pwd);
-        strcat(path_str, "/");
-        strcat(path_str, name);
-    } else {
-        len = strlen(name) + 1;
-        path_str = (char*) malloc(len + 1);
-        strcat(path_str, name);
-    }
-    // Compute number of tokens
-    char tmp[len + 1];
-    strcpy(tmp, path_str);
-    int argc = 0;
-    if (strtok(tmp, "/")) { argc++; }
-    while (strtok(NULL, "/")) { argc++; }
-    // Build raw token sequence
-    char** tokens = malloc(sizeof(char*) * argc);
-    tokens[0] = strtok(path_str, "/");
-    for (int i = 1; i < argc; i++) { 
-        tokens[i] = strtok(NULL, "/");
-    }
-    // Build logical token sequence
-    // Recall: . = do nothing, .. = go back a token
-    char** path = malloc(sizeof(char*) * argc);
-    int i = 0; // ptr past last token
-    for (int j = 0; j < argc; ++j) {
-        if ((strcmp(tokens[j], "..")) == 0) {
-            if (i > 0) { --i; }
-        } else if ((strcmp(tokens[j], ".")) == 0) {
-            // do nothing
-        } else {
-            path[i] = tokens[j];
-            ++i;
-        }
-    }
-    // Build string
-    len = 2;
-    for (int j = 0; j < i; ++j) {
-        len += strlen(path[j]) + 1; // slash!
-    }
-    char* str = (char*) malloc(len);
-    str[0] = '\0';
-    for (int j = 0; j < i; ++j) {
-        strcat(str, "/");
-        strcat(str, path[j]);
-    }
+    char* str = (char*) malloc(strlen(pwd) + strlen(name) + 2);
+    join_path(str, pwd, name);
+    return str;
+}
+
+/**
+ * @brief Like `abs_path`, but allocates the string in `scratch` for a path only needed during the call.
+ *
+ * @return The path from the root directory to the file.
+ * @param scratch The calling syscall's scratch arena.
+ * @param name The location of the file.
+ */
+char* abs_path_in(Arena* scratch, char* name) {
+    char* str = (char*) arena_alloc(scratch, strlen(pwd) + strlen(name) + 2);
+    join_path(str, pwd, name);
     return str;
 }
 
-char* f_cat(char* args[]) {
+/*
+    Concatenates files, writing them to a file with -w or -a and otherwise returning them
+    Returns what to print allocated in scratch, NULL on failure
+*/
+char* f_cat(Arena* scratch, char* args[]) {
+    SCRATCH(local);
     int argc = 0;
     while (strcmp(args[argc], "\0")) { argc++; }
-    char* out = malloc(sizeof(char) * 4096);
     char* flag = args[argc - 2];
     bool append_f = strcmp(flag, "-a") == 0;
     bool write_f = strcmp(flag, "-w") == 0;
+    // Only contents to print outlive the call
+    Arena* into = (append_f || write_f) ? &local : scratch;
     Vec vec;
     if (argc == 3 && (append_f || write_f)) {
-        vec.buf = (uint8_t*) malloc(4096);
+        vec.buf = (uint8_t*) arena_alloc(into, 4096);
         vec.size = read(STDIN_FILENO, vec.buf, 4096);
     } else {
-        vec = read_files(&args[1], (append_f || write_f) ? argc - 3 : argc - 1);
+        vec = read_files(into, &args[1], (append_f || write_f) ? argc - 3 : argc - 1);
         if (vec.size == -1) { cur_errno = ERR_PERM; p_perror("cat"); return NULL; };
     }
     if (append_f) {
-        char* path = abs_path(args[argc - 1]);
+        char* path = abs_path_in(&local, args[argc - 1]);
         if (create_file(path, REGULAR_FILE) == -1) {
             File f = get_file(path, true);
             if (f.name[0] != 0 && f.type == DIRECTORY_FILE) {
@@ -546,7 +515,7 @@ char* f_cat(char* args[]) {
             return NULL;
         }
     } else if (write_f) {
-        char* path = abs_path(args[argc - 1]);
+        char* path = abs_path_in(&local, args[argc - 1]);
         if (create_file(path, REGULAR_FILE) == -1)  {
             if (truncate_file(path, true) == -1) {
                 cur_errno = ERR_PERM;
@@ -559,11 +528,9 @@ char* f_cat(char* args[]) {
             p_perror("cat"); return NULL;
         }
     } else {
-        sprintf(out, "%s", vec.buf);
-        return out;
-        //write(STDOUT_FILENO, vec.buf, vec.size);
+        return (char*) vec.buf;
     }
-    return out;
+    return "";
 }
 
 void f_cd(char* args[]) {
@@ -573,30 +540,37 @@ void f_cd(char* args[]) {
     if (argc > 2) { arg_error("cd: Too many arguments\n"); return; }
     char* path = abs_path(args[1]);
     File f = get_file(path, true);
-    if (f.name[0] == 0) { cur_errno = ERR_NOENT; p_perror("cd error"); return; }
-    if (f.type != DIRECTORY_FILE) { cur_errno = ERR_NOTDIR; p_perror("cd error"); return; }
+    if (f.name[0] == 0) { free(path); cur_errno = ERR_NOENT; p_perror("cd error"); return; }
+    if (f.type != DIRECTORY_FILE) { free(path); cur_errno = ERR_NOTDIR; p_perror("cd error"); return; }
+    if (pwd_allocated) { free(pwd); }
     pwd = path;
+    pwd_allocated = true;
 }
 
 void f_mkdir(char* args[]) {
+    SCRATCH(scratch);
     int argc = 0;
     while (strcmp(args[argc], "\0")) { argc++; }
+    ArenaMark mark = arena_mark(&scratch);
     for (int i = 1; i < argc; i++) {
-        char* path = abs_path(args[i]);
+        char* path = abs_path_in(&scratch, args[i]);
         if (create_file(path, DIRECTORY_FILE) == -1) { 
             cur_errno = ERR_PERM;
             p_perror("mkdir"); 
             return; 
         }
+        arena_reset(&scratch, mark);
     }
 }
 
 void f_rmdir(char* args[]) {
+    SCRATCH(scratch);
     int argc = 0;
     while (strcmp(args[argc], "\0")) { argc++; }
     if (argc == 1) { arg_error("rmdir: Missing operand\n"); return; }
+    ArenaMark mark = arena_mark(&scratch);
     for (int i = 1; i < argc; i++) {
-        char* path = abs_path(args[i]);
+        char* path = abs_path_in(&scratch, args[i]);
         File f = get_file(path, false);
         if (f.type != DIRECTORY_FILE) { cur_errno = ERR_NOTDIR; p_perror("rmdir error"); return; }
         if (truncate_file(path, false) == -1) { 
@@ -604,15 +578,21 @@ void f_rmdir(char* args[]) {
             p_perror("rmdir"); return; 
         }
         cleanup_file(remove_file(path));
+        arena_reset(&scratch, mark);
     }
 }
 
-char* f_pwd(char* args[]) {
+/*
+    Returns the working directory and a newline, allocated in scratch
+*/
+char* f_pwd(Arena* scratch, char* args[]) {
     int argc = 0;
     while (strcmp(args[argc], "\0")) { argc++; }
     if (argc > 1) { arg_error("pwd: Too many arguments\n"); return "\n"; }
     if (strlen(pwd) > 0) {
-        return strcat(pwd, "\n");
+        char* out = (char*) arena_alloc(scratch, strlen(pwd) + 2);
+        sprintf(out, "%s\n", pwd);
+        return out;
     } else {
         return "/\n";
     } 
@@ -620,13 +600,14 @@ char* f_pwd(char* args[]) {
 }
 
 void f_ln(char* args[]) {
+    SCRATCH(scratch);
     int argc = 0;
     while (strcmp(args[argc], "\0")) { argc++; }
     if (argc <= 2) { arg_error("ln: Missing target file\n"); return; }
     if (strcmp(args[1], "-s") != 0) { arg_error("ln: Hard links not supported\n"); return; }
     if (argc == 3) { arg_error("ln: Missing link name\n"); return; }
     if (argc > 4) { arg_error("ln: Too many arguments\n"); return; }
-    char* path = abs_path(args[3]);
+    char* path = abs_path_in(&scratch, args[3]);
     File file = get_file(path, false);
     if (file.name[0] != 0) {
         cur_errno = ERR_PERM;
@@ -636,7 +617,7 @@ void f_ln(char* args[]) {
         cur_errno = ERR_PERM;
         p_perror("ln error"); return;
     }
-    char* target = abs_path(args[2]);
+    char* target = abs_path_in(&scratch, args[2]);
     if (write_file(path, 0, (uint8_t*) target, strlen(target) + 1, false) == -1) {
         cur_errno = ERR_PERM;
         p_perror("ln error");
@@ -5,6 +5,7 @@ Header for System Calls
 #define SYSCALLS
 #include "table.h"
 #include "filesys.h"
+#include "arena.h"
 
 extern const char* MONTHS[];
 
@@ -59,8 +60,9 @@ void f_lseek(int fd, int offset, int whence);
 
 /*
     Returns file or list of files in directory if filename is null
+    The lines and everything needed to make them are allocated in scratch
 */
-char** f_ls(const char *filename);
+char** f_ls(Arena* scratch, const char *filename);
 
 void f_touch(char* argv[]);
 
@@ -78,16 +80,18 @@ void f_mkdir(char* argv[]);
 
 void f_rmdir(char* argv[]);
 
-char* f_pwd(char* argv[]);
+char* f_pwd(Arena* scratch, char* argv[]);
 
 void f_ln(char* argv[]);
 
-char* f_cat(char* argv[]);
+char* f_cat(Arena* scratch, char* argv[]);
 
-Vec read_files(char** names, int num);
+Vec read_files(Arena* scratch, char** names, int num);
 
 char* abs_path(char* name);
 
+char* abs_path_in(Arena* scratch, char* name);
+
 bool get_exec_perm(char* path);
 
 #endif
\ No newline at end of file
@@ -22,6 +22,8 @@ TNode* add(Table *t, char* name, int m) {
         node->file_name = name;
         // Mode
         node->mode = m;
+        // Nothing read or written yet
+        node->cursor = NO_CURSOR;
 
         // Set file pointer 
         File f = get_file(name, true);
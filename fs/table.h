@@ -1,5 +1,6 @@
 #ifndef TABLE 
 #define TABLE
+#include "filesys.h"
 /*
 Header for Linked List that will be used to implement most tables
 */
@@ -18,6 +19,8 @@ typedef struct table_node {
   int mode;
   // pointer
   int file_pointer;
+  // last position reached in the file's blocks
+  Cursor cursor;
   //next
   struct table_node *next;
 } TNode;
@@ -171,8 +171,11 @@ void rmdir_fn(char* argv[]) {
 }
 
 void pwd_fn(char* argv[], int fdin, int fdout) {
-    char* out = f_pwd(argv);
-    f_write(fdout, out, strlen(out) + 1);
+    {
+        SCRATCH(scratch);
+        char* out = f_pwd(&scratch, argv);
+        f_write(fdout, out, strlen(out) + 1);
+    }
     p_exit();
 }
 
@@ -182,17 +185,21 @@ void ln_fn(char* argv[]) {
 }
 
 void ls_fn(char* argv[], int fdin, int fdout) {
-    char** out = NULL;
-    if (strcmp(argv[1], "\0")) {
-        out = f_ls(argv[1]);
-    } else {
-        out = f_ls(NULL);
-    }
-    int i = 0;
-    if (out) {
-        while (strcmp(out[i], "\0")) {
-            f_write(fdout, out[i], strlen(out[i])+1);
-            i++;
+    {
+        // Released before p_exit, which doesn't return
+        SCRATCH(scratch);
+        char** out = NULL;
+        if (strcmp(argv[1], "\0")) {
+            out = f_ls(&scratch, argv[1]);
+        } else {
+            out = f_ls(&scratch, NULL);
+        }
+        int i = 0;
+        if (out) {
+            while (strcmp(out[i], "\0")) {
+                f_write(fdout, out[i], strlen(out[i])+1);
+                i++;
+            }
         }
     }
     p_exit();